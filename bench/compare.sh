@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compare two w25shell --bench result files (one JSON object per line).
+#
+#   sh bench/compare.sh BASELINE CURRENT [TOLERANCE_PERCENT]
+#
+# Prints one row per benchmark and exits with status 1 if any result is more
+# than TOLERANCE_PERCENT (default 25) worse than the baseline. Results in "us"
+# are latencies (lower is better); everything else is a rate.
+
+baseline=$1
+current=$2
+tolerance=${3:-25}
+
+if [ ! -f "$baseline" ] || [ ! -f "$current" ]; then
+    echo "usage: $0 BASELINE CURRENT [TOLERANCE_PERCENT]" >&2
+    exit 2
+fi
+
+awk -v tolerance="$tolerance" '
+function field(line, name,    rest) {
+    rest = substr(line, index(line, "\"" name "\":") + length(name) + 3)
+    sub(/^"/, "", rest)
+    sub(/["},].*/, "", rest)
+    return rest
+}
+{
+    key = field($0, "bench") "@" field($0, "size_mb")
+    if (FNR == NR) {
+        base[key] = field($0, "value")
+        next
+    }
+    unit = field($0, "unit")
+    value = field($0, "value")
+    if (!(key in base)) {
+        printf "%-24s %12s %12.1f %-8s %8s  new\n", key, "-", value, unit, "-"
+        next
+    }
+    change = base[key] > 0 ? (value - base[key]) * 100 / base[key] : 0
+    worse = unit == "us" ? change : -change
+    status = worse > tolerance ? "REGRESSION" : "ok"
+    if (worse > tolerance)
+        failed++
+    printf "%-24s %12.1f %12.1f %-8s %+7.1f%%  %s\n", key, base[key], value, unit, change, status
+}
+END {
+    if (failed) {
+        printf "%d benchmark(s) regressed by more than %s%%\n", failed, tolerance
+        exit 1
+    }
+}' "$baseline" "$current"
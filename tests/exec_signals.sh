@@ -0,0 +1,31 @@
+#!/bin/sh
+# The last command of -c replaces the shell; it must be stoppable with
+# SIGTERM like any other program. (SIGINT is not tried: sh starts
+# background jobs with it ignored.)
+#
+#   sh tests/exec_signals.sh [./w25shell]
+
+SHELL_BIN=${1:-./w25shell}
+failed=0
+
+for sig in TERM; do
+    "$SHELL_BIN" -c 'sleep 5' &
+    pid=$!
+    sleep 0.3
+
+    blocked=$(awk '/^SigBlk:/ { print $2 }' /proc/$pid/status)
+    kill -$sig $pid
+    started=$(date +%s)
+    wait $pid
+    status=$?
+    elapsed=$(($(date +%s) - started))
+
+    if [ "$blocked" != "0000000000000000" ] || [ $elapsed -ge 3 ]; then
+        echo "FAIL: SIG$sig to -c 'sleep 5' (SigBlk $blocked, status $status, ${elapsed}s)"
+        failed=1
+    else
+        echo "ok: SIG$sig to -c 'sleep 5' (status $status)"
+    fi
+done
+
+exit $failed
@@ -0,0 +1,30 @@
+#!/bin/sh
+# With tracing on, the last command of -c must not replace the shell: the
+# trace has to hold one record per command.
+#
+#   sh tests/exec_trace.sh [./w25shell]
+
+SHELL_BIN=${1:-./w25shell}
+trace=${TMPDIR:-/tmp}/w25shell-exec-trace.$$.jsonl
+failed=0
+
+check()
+{
+    rm -f "$trace"
+    W25SHELL_TRACE=$trace "$SHELL_BIN" -c "$1" > /dev/null
+    records=$(cat "$trace" 2>/dev/null | wc -l)
+
+    if [ "$records" -ne "$2" ]; then
+        echo "FAIL: trace of -c '$1' has $records record(s), expected $2"
+        failed=1
+    else
+        echo "ok: trace of -c '$1' has $records record(s)"
+    fi
+}
+
+check 'ls /' 1
+check 'echo a
+ls /' 2
+
+rm -f "$trace"
+exit $failed
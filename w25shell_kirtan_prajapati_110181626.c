@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,158 +8,1118 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // SECTION STARTS: "CONSTANTS AND DEFINITIONS"
-#define MAX_INPUT_SIZE 1024 // Maximum size of input line
-#define MAX_ARGS 5          // Maximum arguments per command (including command name)
-#define MAX_COMMANDS 6      // Maximum commands in a pipeline (5 pipes + 1)
-#define MAX_SEQ_COMMANDS 4  // Maximum commands in sequential execution
+#define MAX_INPUT_SIZE 1024 // Line buffer size used by --bench-parse
+#define READER_CHUNK (64 << 10) // Initial read size of the line reader (grows for longer lines)
+#define INITIAL_ARGS 8      // Initial argv capacity per command (grows on demand)
+#define INITIAL_COMMANDS 4  // Initial stage/item capacity per AST node (grows on demand)
+#define INITIAL_TOKENS 32   // Initial token capacity per line (grows on demand)
+#define ARENA_BLOCK_SIZE 8192 // Default size of one per-line arena block
+#define PARSE_BENCH_ITERATIONS 200000 // Default iterations for --bench-parse
+#define BENCH_REPEATS 3                 // Runs per --bench measurement (best one is reported)
+#define BENCH_LAUNCHES 500              // Commands run per launch-latency measurement
+#define BENCH_HEAP_MB 512               // Shell heap size for the grown-shell launch measurements
+#define BENCH_DEFAULT_SIZES {"1", "64"} // File sizes in MB when --bench is given none
+
+// Token types produced by lex_input()
+#define TOKEN_WORD 0       // Ordinary (possibly quoted) word
+#define TOKEN_PIPE 1       // |
+#define TOKEN_REVERSE 2    // = (standalone word)
+#define TOKEN_AND 3        // &&
+#define TOKEN_OR 4         // ||
+#define TOKEN_SEMI 5       // ;
+#define TOKEN_LESS 6       // <
+#define TOKEN_GREAT 7      // >
+#define TOKEN_DGREAT 8     // >>
+#define TOKEN_TILDE 9      // ~ (standalone word)
+#define TOKEN_HASH 10      // # (standalone word)
+#define TOKEN_PLUS 11      // + (standalone word)
+#define TOKEN_END 12       // End of line
+#define TOKEN_AMP 13       // & (background)
+#define TOKEN_ERRGREAT 14  // 2>
+#define TOKEN_ERRDGREAT 15 // 2>>
+#define TOKEN_HEREDOC 16    // <<
+#define TOKEN_HERESTRING 17 // <<<
+
+// Command substitution: lex_input() keeps the text of a $(...) in the
+// word between these bytes, for expand_command() to run later
+#define SUBST_OPEN '\001'     // Start of an unquoted $(...)
+#define SUBST_QUOTED '\002'   // Start of a $(...) inside double quotes
+#define SUBST_CLOSE '\003'    // End of either
+#define SUBST_MARKERS "\001\002"
+#define SUBST_BLANKS " \t\n"  // Unquoted output is split on these
+#define CAPTURE_CHUNK 4096    // Initial $(...) output buffer (grows with the pipe)
+
+// Redirection kinds attached to a command
+#define REDIR_IN 0         // < file
+#define REDIR_OUT 1        // > file
+#define REDIR_APPEND 2     // >> file
+#define REDIR_ERR 3        // 2> file
+#define REDIR_ERR_APPEND 4 // 2>> file
+#define REDIR_HEREDOC 5    // << DELIMITER (body from the following lines)
+#define REDIR_HERESTRING 6 // <<< word
+#define HEREDOC_PIPE_MAX 4096 // Larger inline input goes to a sealed memfd instead of a pipe
+
+// Command kinds: an external program/builtin or one of the file operators
+#define CMD_EXEC 0   // argv is a program (or builtin) and its arguments
+#define CMD_APPEND 1 // argv holds the two operands of ~
+#define CMD_COUNT 2  // argv holds the operands of #
+#define CMD_CONCAT 3 // argv holds the operands of +
+
+// Operators joining the pipelines of an and-or list
+#define OP_AND 0 // &&
+#define OP_OR 1  // ||
+
+// Process launch backends selectable with "set spawn <name>" or $W25SHELL_SPAWN
+#define SPAWN_BACKEND_FORK 0   // Classic fork() + execvp() in the child
+#define SPAWN_BACKEND_SPAWN 1  // posix_spawn() (clone(CLONE_VM|CLONE_VFORK) under glibc)
+#define SPAWN_BACKEND_ZYGOTE 2 // A small pre-forked helper clones and execs on request
+#define ZYGOTE_MESSAGE_SIZE (32 << 10) // Largest spawn request (path + argv); bigger ones use posix_spawn
+#define ZYGOTE_MAX_ARGS 1024           // Most arguments in a zygote request
+
+#define HASH_BUCKETS 256                // Buckets in the command path table (power of two)
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin" // Search path when $PATH is unset
+
+// Kernel-side copy strategies used by concatenate_files(), best first
+#define COPY_RANGE 0    // copy_file_range() into a regular file (reflinks when possible)
+#define COPY_SPLICE 1   // splice() into a pipe
+#define COPY_SENDFILE 2 // sendfile() into anything else
+#define COPY_BUFFER 3   // read()/write() through an aligned buffer
+#define COPY_CHUNK (1 << 30)       // Bytes requested per kernel copy call
+#define COPY_BUFFER_SIZE (1 << 20) // Size of the fallback buffer
+#define COPY_BUFFER_ALIGN 4096     // Alignment of the fallback buffer
+
+// Durability modes for the ~ operator, selected with "set append <mode>"
+#define APPEND_FAST 0   // Append in place, leave flushing to the kernel
+#define APPEND_FSYNC 1  // Append in place, then fsync both files
+#define APPEND_ATOMIC 2 // Build each result in a temp file, fsync, rename over
+
+#define WC_PARALLEL_MIN (16 << 20) // Files smaller than this are counted on one thread
+#define WC_CHUNK_MIN (4 << 20)     // Smallest chunk handed to a worker thread
+
+#define WC_CACHE_MAGIC 0x57435743u // "WCWC": word-count cache file signature
+#define WC_CACHE_VERSION 3         // Bumped whenever wc_cache_entry or the counting changes
+#define WC_CACHE_SLOTS 4096        // Entries in the cache file (power of two)
+#define WC_CACHE_PROBES 8          // Linear-probe distance before evicting
+#define WC_TAIL_WINDOW 4096        // Bytes fingerprinted before a cached end offset
+
+#define REGISTRY_MAGIC 0x57325352u // "W2SR": shell registry file signature
+#define REGISTRY_VERSION 1         // Bumped whenever registry_file changes
+#define REGISTRY_SLOTS 1024        // Shells that can be registered at once
+#define REGISTRY_PID_BITS 22       // PIDs fit in 22 bits (PID_MAX_LIMIT)
+#define REGISTRY_PID_MASK ((1ULL << REGISTRY_PID_BITS) - 1)
+
+#define RING_CAPACITY (256 << 10) // Bytes buffered between two in-process filters (power of two)
+#define RING_SPIN 100             // Polls before a ring side sleeps on its futex
+
+// In-process pipeline filters
+#define FILTER_NONE 0 // Stage runs as an external program
+#define FILTER_CAT 1  // cat [FILE|-]...
+#define FILTER_HEAD 2 // head [-n N]
+#define FILTER_TAIL 3 // tail [-n N]
+#define FILTER_WC 4   // wc -l/-c (standard input only)
+#define FILTER_GREP 5 // grep [-Fvc] STRING [FILE]
+#define FILTER_TEE 6  // tee [-a] FILE (tee()/splice() between pipes)
+#define FILTER_BUFFER_SIZE (64 << 10) // Read chunk and output buffer of a filter
+#define FILTER_TAIL_TRIM (4 << 20)    // tail trims its window past this many bytes
+#define RELAY_CHUNK (1 << 20)         // Most bytes tee() duplicates per call
+#define FILTER_CANCEL_SIGNAL SIGURG   // Knocks a cancelled filter out of a blocking call
+#define FILTER_CANCEL_MS 10           // How often a cancelled filter is knocked again
+
+#define TIME_LABEL_SIZE 64 // Characters of a stage kept for the time report
+#define PSTAT_EVENTS 6     // Counters opened per stage by pstat
+#define JOB_HISTORY 1024 // Finished jobs kept for jobs/wait when not interactive
+
+// Event loop: epoll ids and the signals event_signals() reports
+#define EVENT_SIGNAL 0   // The signalfd (SIGINT, SIGTERM, SIGCHLD)
+#define EVENT_TIMER 1    // The deadline timerfd
+#define EVENT_CHILD 2    // pidfd of the process being waited for
+#define EVENT_INPUT 3    // The descriptor lines are read from
+#define EVENT_FILTERS 4  // eventfd bumped by each filter thread that ends
+#define EVENT_BATCH 8    // Events taken per epoll_wait()
+#define EVENT_SAW_INT 1  // SIGINT was read
+#define EVENT_SAW_CHLD 2 // SIGCHLD was read
+#define EVENT_SAW_TERM 4 // SIGTERM was read
+
+#define TRACE_RECORD_SIZE 4096 // Longest JSONL trace record (argv is cut to fit)
+#define TRACE_PENDING 256      // Children whose spawn latency is remembered until reaped
+#define TRACE_FLUSH_MS 5       // How often the trace writer looks for new records
+
+#define TIMEOUT_GRACE_MS 2000 // SIGTERM to SIGKILL when a timeout deadline hits
+#define TIMEOUT_STATUS 124    // Exit status of a line stopped by its deadline
+#define LIMIT_MAX 3           // Resources the limit prefix knows (cpu, as, nofile)
+
+// Stage placement of the sched prefix / "set affinity"
+#define SCHED_PLACE_NONE 0   // Stages run wherever the kernel puts them
+#define SCHED_PLACE_AUTO 1   // Adjacent stages on sibling cores (cpu_order)
+#define SCHED_PLACE_LIST 2   // Stage i on cpus[i % cpu_count]
+#define SCHED_MAX_CPUS 1024  // Longest explicit CPU list
+#define SCHED_MAX_NODES 64   // NUMA nodes probed when ordering CPUs
+#define SCHED_IOPRIO_SHIFT 13 // ioprio value: class << 13 | level
+#define SCHED_IOPRIO_WHO 1    // IOPRIO_WHO_PROCESS (0 = the calling thread)
+
+#define WC_LINES 1 // wc -l
+#define WC_BYTES 2 // wc -c
 // SECTION ENDS: "CONSTANTS AND DEFINITIONS"
 
+// SECTION STARTS: "TYPE DEFINITIONS"
+/**
+ * Describes how a child's standard streams are wired before exec.
+ * A field equal to its own standard descriptor means "inherit".
+ */
+typedef struct
+{
+    int in_fd;  // Descriptor to install as the child's stdin
+    int out_fd; // Descriptor to install as the child's stdout
+    int err_fd; // Descriptor to install as the child's stderr
+    int cpu;    // CPU to pin the child to, -1 for any
+    pid_t pgid; // Process group to join: -1 keep the shell's, 0 start a new one
+} spawn_io;
+
+/**
+ * One block of the bump allocator; blocks are chained and kept across resets
+ */
+typedef struct arena_block
+{
+    struct arena_block *next; // Next block in the chain
+    size_t size;              // Usable bytes in data
+    size_t used;              // Bytes handed out since the last reset
+    char data[];              // Storage
+} arena_block;
+
+/**
+ * Bump allocator reset once per input line
+ */
+typedef struct
+{
+    arena_block *head;          // First block
+    arena_block *current;       // Block allocations are served from
+    void *last;                 // Most recent allocation (can grow in place)
+    unsigned long block_allocs; // Number of malloc() calls made for blocks
+} arena;
+
+/**
+ * One lexical token; text is only set for TOKEN_WORD (quotes removed)
+ * and for a | or = carrying a pipe size ("|[1M]")
+ */
+typedef struct
+{
+    int type;   // TOKEN_* value
+    char *text; // Word text, or the size in brackets
+    int expand; // The word contains a $(...)
+} token;
+
+/**
+ * One redirection of a command, kept in source order
+ */
+typedef struct redirection
+{
+    int kind;                         // REDIR_* value
+    char *target;                     // File name, here-document delimiter or here-string
+    char *body;                       // Here-document text, once read
+    size_t body_len;                  // Its length
+    struct redirection *next;         // Next redirection of the same command
+    struct redirection *next_heredoc; // Next here-document of the line awaiting its body
+} redirection;
+
+/**
+ * A simple command: one stage of a pipeline
+ */
+typedef struct
+{
+    int kind;            // CMD_* value
+    char **argv;         // NULL terminated arguments / operands
+    int argc;            // Number of entries in argv
+    redirection *redirs; // Redirections in source order
+    int expand;          // An argument or target contains a $(...)
+} command_node;
+
+/**
+ * Commands joined by | (or by = when reverse is set)
+ */
+typedef struct
+{
+    command_node **stages; // Stages in source order
+    int count;             // Number of stages
+    int reverse;           // Joined with = : data flows right to left
+    long *pipe_sizes;      // pipe_sizes[i]: capacity of the pipe after stages[i]
+                           // (0 = default); NULL if no operator gave one
+} pipeline_node;
+
+/**
+ * Pipelines joined by && and ||
+ */
+typedef struct
+{
+    pipeline_node **items; // Pipelines in source order
+    int *ops;              // ops[i] (OP_*) joins items[i] and items[i + 1]
+    int count;             // Number of pipelines
+} and_or_node;
+
+/**
+ * And-or lists separated by ; -- the root of a parsed line
+ */
+typedef struct
+{
+    and_or_node **items; // And-or lists in source order
+    int *background;     // background[i]: items[i] was followed by &
+    int count;           // Number of and-or lists
+} list_node;
+
+/**
+ * Parser state: a cursor over the token array
+ */
+typedef struct
+{
+    token *tokens; // Tokens of the line, terminated by TOKEN_END
+    int pos;       // Index of the next token
+} parser;
+
+/**
+ * One cached command name -> absolute path resolution
+ */
+typedef struct hash_entry
+{
+    char *name;              // Command name as typed
+    char *path;              // Absolute path found on $PATH
+    int dir_index;           // Index of the $PATH directory it was found in
+    unsigned int hits;       // Number of launches served from the cache
+    struct hash_entry *next; // Next entry in the same bucket
+} hash_entry;
+
+/**
+ * One $PATH directory together with the mtime seen when it was scanned
+ */
+typedef struct
+{
+    char *dir;             // Directory name
+    struct timespec mtime; // Modification time when last validated
+} hash_dir;
+
+/**
+ * Result of one word-count pass
+ */
+typedef struct
+{
+    unsigned long long words; // Runs of non-whitespace bytes
+    unsigned long long lines; // Newline characters
+    unsigned long long bytes; // Total bytes
+} word_counts;
+
+/**
+ * Work description for one chunk of an mmap'ed file
+ */
+typedef struct
+{
+    const unsigned char *data; // Start of the whole mapping
+    size_t start;              // First byte of this chunk
+    size_t end;                // One past the last byte of this chunk
+    word_counts counts;        // Result for this chunk
+} word_chunk;
+
+/**
+ * One cached word count. seq is odd while the entry is being rewritten so
+ * readers in other shells can detect a torn read and fall back.
+ */
+typedef struct
+{
+    uint32_t seq;       // Update sequence (odd = write in progress)
+    uint32_t used;      // Non-zero once the slot holds a result
+    uint64_t dev;       // st_dev of the counted file
+    uint64_t ino;       // st_ino of the counted file
+    uint64_t size;      // Size the counts cover
+    int64_t mtime_ns;   // st_mtim in nanoseconds at count time
+    int64_t ctime_ns;   // st_ctim likewise (cannot be set back like mtime)
+    uint64_t tail_hash; // FNV-1a of the WC_TAIL_WINDOW bytes before size
+    word_counts counts; // Result for bytes [0, size)
+} wc_cache_entry;
+
+/**
+ * Layout of the memory-mapped cache file
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    wc_cache_entry entries[WC_CACHE_SLOTS];
+} wc_cache_file;
+
+/**
+ * Layout of the shared registry of running shells. A slot holds the
+ * owner's registry_identity() (0 = free) and is claimed and released
+ * with compare-and-swap, so no lock is taken.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t owners[REGISTRY_SLOTS];
+} registry_file;
+
+/**
+ * Minimal "parallel for" thread pool: run fn(arg, i) for i in [0, tasks)
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;  // Signalled when a new batch is published
+    pthread_cond_t work_done;   // Signalled when the last task of a batch ends
+    int thread_count;           // Worker threads started so far
+    void (*fn)(void *, int);    // Task body of the current batch
+    void *arg;                  // Shared argument of the current batch
+    int task_count;             // Tasks in the current batch
+    int next_task;              // Next task index to hand out
+    int tasks_done;             // Tasks finished in the current batch
+    unsigned int generation;    // Bumped for every batch
+} thread_pool;
+
+/**
+ * Single-producer single-consumer byte ring joining two filter threads.
+ * head/tail are free-running byte counters; each side sleeps on a futex
+ * sequence word that the other side bumps after making progress.
+ */
+typedef struct
+{
+    char *data;                 // RING_CAPACITY bytes
+    size_t head;                // Bytes ever written (producer only)
+    char pad_head[64];          // Keep the two counters on separate cache lines
+    size_t tail;                // Bytes ever read (consumer only)
+    char pad_tail[64];
+    uint32_t data_seq;          // Bumped when data arrives or the writer closes
+    uint32_t space_seq;         // Bumped when space frees up or the reader closes
+    uint32_t data_waiters;      // Consumers sleeping on data_seq
+    uint32_t space_waiters;     // Producers sleeping on space_seq
+    int writer_done;            // Producer finished: EOF once drained
+    int reader_gone;            // Consumer finished: writes fail like EPIPE
+} spsc_ring;
+
+/**
+ * One pipeline stage run on a thread inside the shell
+ */
+typedef struct
+{
+    command_node *cmd;          // Stage as parsed
+    int kind;                   // FILTER_* kind
+    long count;                 // head/tail: number of lines
+    int wc_flags;               // wc: WC_* fields to print
+    int grep_invert;            // grep -v
+    int grep_count;             // grep -c
+    const char *pattern;        // grep: fixed string to look for
+    size_t pattern_len;
+    char **files;               // cat/grep/tee: file operands
+    int file_count;
+    int tee_append;             // tee -a
+    int in_fd;                  // Input descriptor when in_ring is NULL
+    spsc_ring *in_ring;         // Input ring from the previous filter
+    int close_in;               // in_fd belongs to this stage
+    int out_fd;                 // Output descriptor when out_ring is NULL
+    spsc_ring *out_ring;        // Output ring to the next filter
+    int close_out;              // out_fd belongs to this stage
+    char *out_buf;              // Pending output (FILTER_BUFFER_SIZE bytes)
+    size_t out_len;
+    int output_closed;          // Downstream went away
+    int cancelled;              // SIGINT/SIGTERM: stop and drop pending output
+    int done_fd;                // eventfd to bump when the thread ends, -1 for none
+    int status;                 // Exit status, as a program would report it
+    struct rusage usage;        // Thread's resource usage (only under time)
+    double finished;            // When the thread ended (only under time)
+    int cpu;                    // CPU to pin the thread to, -1 for any
+    int last_cpu;               // CPU the thread ended on (only under time)
+    int pstat_fds[PSTAT_EVENTS];      // Thread's counters (only under pstat)
+    double pstat_values[PSTAT_EVENTS];
+    pthread_t thread;
+} filter_stage;
+
+/**
+ * Source of command lines: a mapped file, a growing read buffer (pipes and
+ * terminals), or the -c string. Lines are NUL-terminated in place.
+ */
+typedef struct
+{
+    int fd;                     // Input descriptor, -1 for a -c string
+    char *data;                 // Mapping, read buffer or string
+    size_t len;                 // Valid bytes in data
+    size_t pos;                 // Start of the next unread line
+    size_t cap;                 // Read buffer capacity (0 if data is not a buffer)
+    int mapped;                 // data is an mmap() of the whole file
+    int shared;                 // fd is stdin shared with commands: keep its offset in step
+    int eof;                    // Nothing more to read into data
+    char *spill;                // Copy of a final unterminated line of a mapping
+} line_reader;
+
+/**
+ * A background or stopped job: one process group, one or more processes
+ */
+typedef struct job
+{
+    int id;                     // Job number shown as [id]
+    pid_t pgid;                 // Process group signalled by fg/bg
+    int count;                  // Processes in the job
+    pid_t *pids;                // Processes, data-wise last one last (0 once reaped)
+    int *pidfds;                // pidfd per process, -1 once reaped or unsupported
+    int running;                // Processes not yet reaped
+    int stopped;                // Stopped by a signal (Ctrl+Z, SIGTTIN, ...)
+    int status;                 // Exit status of the last process
+    char *text;                 // Command as typed, for jobs and fg
+    struct job *next;           // Next job in start order
+} job;
+
+/**
+ * One command list of a "parallel" line
+ */
+typedef struct
+{
+    and_or_node *node;          // Commands to run
+    pid_t pid;                  // Subshell running them, 0 when not running
+    int pidfd;                  // pidfd of pid, -1 if none
+    int out_fd;                 // memfd capturing stdout
+    int err_fd;                 // memfd capturing stderr
+    int status;                 // Exit status once done
+    int done;                   // Finished (or failed to start)
+    double started;             // Launch time (for time)
+} parallel_task;
+
+/**
+ * Figures of one stage run under the time prefix
+ */
+typedef struct
+{
+    char label[TIME_LABEL_SIZE]; // Stage as typed (truncated)
+    double real;                 // Seconds from launch to exit
+    struct rusage usage;         // From wait4(), or RUSAGE_THREAD for filters
+    int in_process;              // Ran on a thread of the shell
+    int cpu;                     // CPU it last ran on, -1 if unknown
+} stage_timing;
+
+/**
+ * One counter opened by pstat
+ */
+typedef struct
+{
+    uint32_t type;      // PERF_TYPE_*
+    uint64_t config;    // PERF_COUNT_*
+    const char *name;   // Column heading
+} pstat_event;
+
+/**
+ * Counters of one stage run under the pstat prefix
+ */
+typedef struct
+{
+    pid_t pid;                   // Stage process, 0 for an in-process filter
+    int fds[PSTAT_EVENTS];       // Counter descriptors until read, else -1
+    double values[PSTAT_EVENTS]; // Scaled counts, -1 if unavailable
+    char label[TIME_LABEL_SIZE]; // Stage as typed (truncated)
+    int done;                    // Counters have been read
+} pstat_sample;
+
+/**
+ * Header of a spawn request sent to the zygote. The program path and
+ * its arguments follow as NUL-terminated strings; stdin, stdout and
+ * stderr are passed alongside with SCM_RIGHTS.
+ */
+typedef struct
+{
+    int pgid; // Process group as in spawn_io
+    int argc; // Arguments after the path
+} zygote_request;
+
+/**
+ * One setting of the limit prefix, installed with prlimit() in the child
+ */
+typedef struct
+{
+    int resource;        // RLIMIT_*
+    struct rlimit value; // Soft and hard limit
+} resource_limit;
+
+/**
+ * Placement and scheduling of pipeline stages (sched prefix, set affinity)
+ */
+typedef struct
+{
+    int placement;            // SCHED_PLACE_*
+    int cpu_count;            // CPUs in cpus
+    int cpus[SCHED_MAX_CPUS]; // Explicit list for SCHED_PLACE_LIST
+    int nice;                 // Added to each stage's niceness, 0 = unchanged
+    int ioprio;               // ioprio_set() value, -1 = unchanged
+    int batch;                // Run stages under SCHED_BATCH
+} sched_settings;
+
+/**
+ * Output of one $(...); arguments point into it until the next line
+ */
+typedef struct capture_buffer
+{
+    struct capture_buffer *next; // Older capture of the same line
+    char data[];                 // Output, NUL-terminated
+} capture_buffer;
+
+/**
+ * A word being assembled from text and $(...) output
+ */
+typedef struct
+{
+    char *text;      // Field so far (borrowed when capacity is 0)
+    size_t len;      // Its length
+    size_t capacity; // Size of an arena copy, 0 while borrowed
+    int active;      // Something (possibly empty) was added
+} field_builder;
+
+/**
+ * Growing NULL-terminated array of words in the line arena
+ */
+typedef struct
+{
+    char **words; // The words
+    int count;    // Number of words
+    int capacity; // Entries allocated
+} word_list;
+// SECTION ENDS: "TYPE DEFINITIONS"
+
 // SECTION STARTS: "GLOBAL VARIABLES"
 // Global variables to track all shell processes for killallterms command
 pid_t current_pid;
+
+// Arena holding everything parsed from the current input line
+arena line_arena = {NULL, NULL, NULL, 0};
+
+// Outputs of the $(...) run for the current line, newest first
+capture_buffer *captures = NULL;
+
+// Here-documents of the line being parsed, in order, until heredoc_read()
+redirection *heredoc_head = NULL;
+redirection **heredoc_tail = &heredoc_head;
+
+// Exit status of the most recently executed list
+int last_status = 0;
+
+// Whether the last parse_input() failed (as opposed to an empty line)
+int parse_failed = 0;
+
+// Whether lines come from a terminal (prompt and Ctrl+D newline)
+int interactive = 0;
+
+// Job control: set when the shell owns the terminal
+int job_control = 0;
+pid_t shell_pgid = 0;
+job *job_list = NULL; // Background and stopped jobs in start order
+
+// Event loop (epoll over the signalfd, the deadline timer, pidfds, stdin)
+int event_fd = -1;
+int signal_fd = -1;
+int event_timer = -1;
+sigset_t event_saved_mask;  // Signal mask from before the loop, for children
+int shell_interrupted = 0;  // SIGINT reached a shell with no prompt
+int shell_terminating = 0;  // SIGTERM: let the foreground end, then exit
+
+// Per-stage figures collected while a "time" line runs
+int timing_active = 0;
+double pipeline_started = 0; // Launch time of the stages being waited for
+stage_timing *timings = NULL;
+int timing_count = 0;
+int timing_capacity = 0;
+
+// Counters for pstat: hardware first, software if those cannot be opened
+const pstat_event pstat_hardware_events[PSTAT_EVENTS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-ms"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "cache-refs"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+const pstat_event pstat_software_events[PSTAT_EVENTS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-ms"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "migrations"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN, "minor-faults"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, "major-faults"},
+};
+int pstat_active = 0;   // A pstat line is running
+int pstat_software = 0; // Using pstat_software_events
+pstat_sample *pstat_samples = NULL;
+int pstat_count = 0;
+int pstat_capacity = 0;
+
+// JSONL execution trace ("set trace FILE" or $W25SHELL_TRACE)
+int trace_active = 0;
+int trace_fd = -1;
+char *trace_path = NULL;
+spsc_ring *trace_ring = NULL; // Shell produces, trace_thread consumes
+pthread_t trace_thread;
+int trace_stopping = 0;
+unsigned long trace_dropped = 0;
+unsigned long trace_seq = 0;
+unsigned long trace_line_id = 0;
+char *trace_line = NULL;           // Line being executed (in line_arena)
+double trace_parse_seconds = 0;    // parse_input() time of that line
+const char *trace_list_op = "";    // Operator before the running and-or item
+const char *trace_pipe_op = "";    // "|" or "=" inside a pipeline
+pid_t trace_spawn_pids[TRACE_PENDING];
+double trace_spawn_times[TRACE_PENDING];
+
+// Backend used by spawn_process() to launch external commands
+int spawn_backend = SPAWN_BACKEND_SPAWN;
+int zygote_fd = -1; // Socket to the zygote, -1 when it is not running
+pid_t zygote_pid = 0;
+
+// Command path cache, filled lazily by hash_lookup()
+hash_entry *command_hash[HASH_BUCKETS];
+char *hash_path_value = NULL; // $PATH the cache was built for
+hash_dir *hash_dirs = NULL;   // Split copy of hash_path_value
+int hash_dir_count = 0;
+
+// Durability mode used by append_files()
+int append_mode = APPEND_FAST;
+
+// Run cat/head/tail/wc/grep/tee pipeline stages on threads instead of processes
+int inprocess_filters = 1;
+
+// Report the throughput of + on stderr ("set concatstats on")
+int concat_stats = 0;
+
+// Capacity of the pipes between stages ("set pipesize"), 0 = kernel default
+long pipe_size = 0;
+long pipe_max_size = 0; // /proc/sys/fs/pipe-max-size, read on first use
+
+// Deadline and resource limits of the line being run ("timeout" / "limit")
+double deadline_at = 0;      // CLOCK_MONOTONIC seconds, 0 = no deadline
+double deadline_kill_at = 0; // When SIGTERM turns into SIGKILL
+int deadline_fired = 0;      // SIGTERM has been sent
+resource_limit limits[LIMIT_MAX];
+int limit_count = 0;
+
+// Placement and scheduling of stages ("set affinity" and the sched prefix)
+sched_settings stage_sched = {SCHED_PLACE_NONE, 0, {0}, 0, -1, 0};
+int *cpu_order = NULL; // Usable CPUs, SMT siblings and package neighbours adjacent
+int cpu_order_count = 0;
+int sched_base = 0; // Position in cpu_order of the pipeline being placed
+int sched_next = 0; // Where the next pipeline starts
+
+// Registry of running shells, for killallterms
+registry_file *registry = NULL;
+int registry_slot = -1;     // This shell's slot, -1 if not registered
+uint64_t registry_self = 0; // This shell's identity in it
+
+// Word-count cache, mapped on the first # command
+wc_cache_file *wc_cache = NULL;
+int wc_cache_fd = -1;
+char wc_cache_path[PATH_MAX];
+
+// Workers shared by the parallel builtins, started on first use
+thread_pool worker_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                           0, NULL, NULL, 0, 0, 0, 0};
 // SECTION ENDS: "GLOBAL VARIABLES"
 
 // SECTION STARTS: "FUNCTION PROTOTYPES"
 // Function prototypes
 void display_prompt();
-int read_input(char *input, size_t size);
-int parse_input(char *input, char ***commands, int *command_count, char *special_char);
-void execute_command(char **args);
-void execute_piped_commands(char ***commands, int command_count);
-void execute_reverse_piped_commands(char ***commands, int command_count);
-void execute_sequential_commands(char ***commands, int command_count);
-void execute_conditional_commands(char ***commands, int command_count, char *operators);
-void append_files(char *file1, char *file2);
-void count_words(char *filename);
-void concatenate_files(char **filenames, int count);
-void cleanup_commands(char ***commands, int command_count);
-int validate_args_count(char **args);
-void handle_redirection(char **args, int *in_fd, int *out_fd);
+char *read_input(line_reader *reader);
+int line_reader_open(line_reader *reader, int fd);
+void line_reader_string(line_reader *reader, char *text);
+char *line_reader_next(line_reader *reader);
+void line_reader_sync_out(line_reader *reader);
+void line_reader_sync_in(line_reader *reader);
+void exec_in_place(list_node *list);
+list_node *parse_input(char *input);
+const char *substitution_end(const char *p);
+char *capture_output(char *text, size_t *len, int *killed);
+void captures_release();
+int field_append(field_builder *f, const char *text, size_t n, int borrow);
+int field_finish(field_builder *f, word_list *out);
+int expand_word(char *word, word_list *out, int split);
+int expand_command(command_node *cmd);
+token *lex_input(char *input);
+int execute_command(command_node *cmd);
+int execute_piped_commands(command_node **stages, int count, const long *sizes);
+int execute_reverse_piped_commands(command_node **stages, int count, const long *sizes);
+long parse_size(const char *text);
+int pipeline_pipe(int fds[2], long size);
+int execute_sequential_commands(list_node *list);
+int execute_conditional_commands(and_or_node *node);
+int execute_pipeline(pipeline_node *pipeline);
+int execute_in_shell(command_node *cmd);
+int run_shell_command(command_node *cmd);
+int is_shell_command(command_node *cmd);
+pid_t launch_stage(command_node *cmd, const spawn_io *io);
+int exit_status_of(int wait_status);
+int append_files(char *file1, char *file2);
+int count_words(char *filename, int threads, int verify);
+int count_words_command(char **args);
+int count_file(const char *filename, int threads, word_counts *counts);
+int count_words_reference(const char *filename, word_counts *counts);
+int count_region(int fd, off_t start, off_t end, int threads, word_counts *counts);
+void count_block(const unsigned char *p, size_t len, int *in_word, word_counts *counts);
+int count_file_cached(const char *filename, int threads, word_counts *counts);
+int wc_cache_open();
+int wccache_command(char **args);
+int thread_pool_run(void (*fn)(void *, int), void *arg, int tasks);
+int concatenate_files(char **filenames, int count);
+void *arena_alloc(arena *a, size_t size);
+void *arena_grow(arena *a, void *old, size_t old_size, size_t new_size);
+char *arena_strdup(arena *a, const char *s);
+void arena_reset(arena *a);
+void parse_benchmark(long iterations);
+double parse_benchmark_run(long iterations, long *parsed, double *allocs_per_line);
+int handle_redirection(redirection *redirs, int *in_fd, int *out_fd, int *err_fd);
+void heredoc_read(line_reader *reader);
+int inline_input(const char *data, size_t len, int newline);
 void killterm_command();
 void killallterms_command();
+int set_command(char **args);
+void spawn_io_init(spawn_io *io);
+int child_setup_needed(const spawn_io *io);
+int child_setup(const spawn_io *io);
+pid_t spawn_process(char **args, const spawn_io *io);
+int spawn_backend_from_name(const char *name);
+const char *spawn_backend_name(int backend);
+const char *hash_lookup(const char *name);
+int hash_sync_path();
+void hash_clear();
+int hash_command(char **args);
+long long copy_fd_to_fd(int in_fd, int out_fd, int *method);
+long long copy_with_buffer(int in_fd, int out_fd);
+int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len);
+char *copy_buffer();
+int append_atomic(const char *target, int target_fd, off_t target_size, int source_fd, off_t source_size);
+double monotonic_seconds();
+void ring_wait(uint32_t *word, uint32_t observed, uint32_t *waiters);
+void ring_notify(uint32_t *word, uint32_t *waiters);
+spsc_ring *ring_create();
+void ring_destroy(spsc_ring *ring);
+int ring_write(spsc_ring *ring, const char *buf, size_t len);
+size_t ring_read(spsc_ring *ring, char *buf, size_t len);
+void ring_close_write(spsc_ring *ring);
+void ring_close_read(spsc_ring *ring);
+int filter_parse_lines(char **args, long *count);
+int filter_parse(command_node *cmd, filter_stage *fs);
+ssize_t filter_source_read(filter_stage *fs, int fd, spsc_ring *ring, char *buf, size_t len);
+int filter_flush(filter_stage *fs);
+int filter_emit(filter_stage *fs, const char *data, size_t len);
+void filter_close_input(filter_stage *fs);
+int filter_direct_method(filter_stage *fs, int fd, spsc_ring *ring);
+void filter_cat(filter_stage *fs, char *buf);
+void filter_head(filter_stage *fs, char *buf);
+size_t filter_tail_start(const char *data, size_t len, long lines);
+void filter_tail(filter_stage *fs, char *buf);
+void filter_wc(filter_stage *fs, char *buf);
+int filter_grep_line(filter_stage *fs, const char *line, size_t len, unsigned long long *matches);
+int filter_grep_block(filter_stage *fs, char *p, char *end, unsigned long long *matches);
+void filter_grep(filter_stage *fs, char *buf);
+void filter_tee(filter_stage *fs, char *buf);
+void *filter_thread(void *arg);
+void filter_cancel_handler(int sig);
+void filter_cancel(filter_stage *filters, const int *is_filter, spsc_ring **rings, int count);
+int filter_wait(filter_stage *filters, const int *is_filter, spsc_ring **rings, pid_t *pids, int count, int done_fd);
+int pipeline_has_filters(command_node **stages, int count);
+int execute_filter_pipeline(command_node **stages, int count, const long *sizes);
+void job_control_init();
+void child_enter_group(const spawn_io *io);
+void write_pipeline_text(FILE *out, command_node **stages, int count, int reverse);
+void write_word(FILE *out, const char *word);
+char *pipeline_text(command_node **stages, int count, int reverse);
+char *and_or_text(and_or_node *node);
+job *job_add(pid_t pgid, const pid_t *pids, int count, char *text, int stopped);
+void job_remove(job *j);
+void job_update(job *j, int index, int wait_status);
+void jobs_poll();
+void jobs_refresh();
+void job_print(job *j);
+void jobs_notify();
+job *job_find(const char *spec);
+int job_wait(job *j, int foreground);
+int wait_foreground(pid_t *pids, int count, int last, pid_t pgid, command_node **stages, int reverse);
+int execute_background(and_or_node *node);
+int jobs_command(char **args);
+int fg_command(char **args);
+int bg_command(char **args);
+int wait_command(char **args);
+int event_init();
+void event_detach();
+int event_signals(pid_t *pids, int count, pid_t pgid);
+int foreground_wait(pid_t *pids, int count, int index, pid_t pgid);
+ssize_t event_read(int fd, char *buf, size_t len);
+int event_stopping();
+int parallel_prefix(command_node *cmd, int *jobs);
+int parallel_start(parallel_task *task, int null_fd);
+void parallel_timing(parallel_task *task, const struct rusage *usage);
+int parallel_reap(parallel_task *tasks, int count);
+void parallel_emit(parallel_task *task);
+int execute_parallel_commands(list_node *list, int first, int jobs);
+int list_head_empty(list_node *list);
+int command_prefix(command_node *cmd, const char *word);
+void timing_start();
+void timing_record(command_node *cmd, const char *label, double real, const struct rusage *usage, int in_process,
+                   int cpu);
+double timeval_seconds(const struct timeval *tv);
+void timing_print_row(const char *label, double real, const struct rusage *usage, int cpu);
+int execute_timed_commands(list_node *list, int first);
+double parse_duration(const char *text);
+int deadline_prefix(command_node *cmd, double *seconds);
+int execute_deadline_commands(list_node *list, int first, double seconds);
+void deadline_signal(pid_t *pids, int count, pid_t pgid, int sig);
+int limit_prefix(command_node *cmd, resource_limit *parsed, int *count);
+int execute_limited_commands(list_node *list, int first, resource_limit *parsed, int count);
+int limit_apply();
+int parse_cpu_list(const char *text, int *cpus, int max);
+long cpu_topology_value(int cpu, const char *name);
+int compare_cpu_keys(const void *a, const void *b);
+int cpu_topology();
+int sched_stage_cpu(int stage);
+int sched_tuned();
+int sched_apply(int cpu);
+int sched_parse_placement(const char *text, sched_settings *settings);
+int sched_prefix(command_node *cmd, sched_settings *parsed);
+int execute_sched_commands(list_node *list, int first, sched_settings *parsed);
+int process_last_cpu(pid_t pid);
+int pstat_open(pid_t pid, int *fds);
+void pstat_read(int *fds, double *values);
+pstat_sample *pstat_add(pid_t pid);
+void pstat_attach(pid_t pid);
+void pstat_collect(pid_t pid, command_node *cmd);
+void pstat_record_thread(command_node *cmd, const double *values);
+void pstat_print_value(double value);
+int execute_pstat_commands(list_node *list, int first);
+int trace_open(const char *path);
+void trace_close();
+void *trace_flusher(void *arg);
+void trace_push(const char *record, size_t len);
+void trace_escape(char *out, size_t *pos, size_t size, const char *text);
+void trace_spawned(pid_t pid, double seconds);
+void trace_record(command_node *cmd, const char *label, pid_t pid, int status, double run,
+                  const struct rusage *usage);
+char *trace_parse_line(char *record, unsigned long *line_id);
+int compare_doubles(const void *a, const void *b);
+int trace_replay(const char *path, long repeat);
+void bench_emit(const char *name, long size_mb, const char *unit, double value);
+int bench_redirect(int target, const char *path);
+void bench_restore(int target, int saved);
+int bench_make_file(const char *path, long size_mb);
+double bench_launch(int backend, int iterations);
+double bench_pipeline(const char *file, long size_mb, int stages, int reverse);
+double bench_count(const char *file, long size_mb);
+double bench_concat(const char *file, const char *out, long size_mb);
+double bench_append(const char *file, const char *a, const char *b, long size_mb);
+int run_benchmarks(char **sizes, int count);
+int zygote_start();
+uint64_t registry_identity(pid_t pid);
+int registry_open();
+void registry_register();
+void registry_deregister();
+void zygote_main(int fd);
+pid_t zygote_spawn(const char *path, char **args, const spawn_io *io);
+void zygote_stop();
+void zygote_detach();
 // SECTION ENDS: "FUNCTION PROTOTYPES"
 
 // SECTION STARTS: "MAIN SHELL LOOP"
 /**
  * Main function - Entry point of the shell program
+ *
+ * @param argc Argument count
+ * @param argv Arguments ("--bench-parse [iterations]" runs the parser benchmark,
+ *             "--bench [size_mb]..." runs the benchmark suite,
+ *             "--replay TRACE [repeat]" replays a trace)
  */
-int main()
+int main(int argc, char **argv)
 {
-    char input[MAX_INPUT_SIZE];  // Buffer to store user input
-    char ***commands = NULL;     // Array to store parsed commands
-    int command_count = 0;       // Number of commands in input
-    char special_char[10] = {0}; // Special character in the command
+    line_reader reader;     // Where command lines come from
+    list_node *list = NULL; // Parsed command line
+    char *input;
 
     // Store the current process ID
     current_pid = getpid();
 
-    // Main shell loop
-    while (1)
+    if (argc > 1 && strcmp(argv[1], "--bench-parse") == 0)
     {
-        // Display shell prompt
-        display_prompt();
+        parse_benchmark(argc > 2 ? atol(argv[2]) : PARSE_BENCH_ITERATIONS);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        return run_benchmarks(argv + 2, argc - 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0)
+    {
+        return trace_replay(argv[2], argc > 3 ? atol(argv[3]) : 1);
+    }
 
-        // Read user input
-        if (read_input(input, MAX_INPUT_SIZE) == 0)
-        {
-            continue; // Empty input, show prompt again
-        }
+    // Allow the launch backend to be chosen from the environment
+    char *backend_env = getenv("W25SHELL_SPAWN");
+    if (backend_env != NULL)
+    {
+        int backend = spawn_backend_from_name(backend_env);
+        if (backend >= 0)
+            spawn_backend = backend;
+        else
+            fprintf(stderr, "w25shell: Unknown spawn backend '%s'\n", backend_env);
+    }
 
-        // Allocate memory for commands array
-        commands = (char ***)malloc(MAX_COMMANDS * sizeof(char **));
-        if (!commands)
-        {
-            perror("Memory allocation failed");
-            continue;
-        }
+    // Make this shell known to killallterms
+    registry_register();
 
-        // Parse the user input
-        if (parse_input(input, commands, &command_count, special_char) != 0)
-        {
-            // Parsing error occurred
-            cleanup_commands(commands, command_count);
-            free(commands);
-            continue;
-        }
+    // Signals are events from here on; threads started later inherit the mask
+    event_init();
 
-        // Handle built-in commands
-        if (command_count == 1 && commands[0][0] != NULL)
-        {
-            if (strcmp(commands[0][0], "killterm") == 0)
-            {
-                killterm_command();
-                cleanup_commands(commands, command_count);
-                free(commands);
-                continue;
-            }
-            else if (strcmp(commands[0][0], "killallterms") == 0)
-            {
-                killallterms_command();
-                cleanup_commands(commands, command_count);
-                free(commands);
-                continue;
-            }
-        }
+    // Tracing from the first line on, for scripts and -c
+    char *trace_env = getenv("W25SHELL_TRACE");
+    if (trace_env != NULL && *trace_env != '\0')
+        trace_open(trace_env);
 
-        // Execute commands based on special character
-        if (special_char[0] == '|')
-        {
-            // Forward piping
-            execute_piped_commands(commands, command_count);
-        }
-        else if (special_char[0] == '=')
-        {
-            // Reverse piping
-            execute_reverse_piped_commands(commands, command_count);
-        }
-        else if (special_char[0] == '~' && command_count == 2)
+    // Pick the input: a -c string, a script file or standard input
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
         {
-            // Append files
-            append_files(commands[0][0], commands[1][0]);
+            fprintf(stderr, "w25shell: -c: option requires an argument\n");
+            return 2;
         }
-        else if (special_char[0] == '#' && command_count == 1)
+        line_reader_string(&reader, argv[2]);
+    }
+    else if (argc > 1)
+    {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || line_reader_open(&reader, fd) < 0)
         {
-            // Count words
-            count_words(commands[0][0]);
+            fprintf(stderr, "w25shell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
         }
-        else if (special_char[0] == '+')
+
+        // An interpreter line is for the kernel, not for us
+        if (reader.len - reader.pos >= 2 && reader.data[reader.pos] == '#' && reader.data[reader.pos + 1] == '!')
+            line_reader_next(&reader);
+    }
+    else
+    {
+        if (line_reader_open(&reader, STDIN_FILENO) < 0)
         {
-            // Concatenate files
-            // Extract file names from commands for concatenation
-            char *files[MAX_COMMANDS];
-            for (int i = 0; i < command_count; i++)
-            {
-                files[i] = commands[i][0];
-            }
-            concatenate_files(files, command_count);
+            perror("w25shell: stdin");
+            return 127;
         }
-        else if (special_char[0] == ';')
+        interactive = isatty(STDIN_FILENO);
+        if (interactive)
+            job_control_init();
+    }
+
+    // Fork the zygote now, while the shell is at its smallest
+    if (spawn_backend == SPAWN_BACKEND_ZYGOTE)
+        zygote_start();
+
+    // Main shell loop
+    while (1)
+    {
+        // Everything parsed from the previous line is released at once
+        arena_reset(&line_arena);
+        if (captures != NULL)
+            captures_release();
+
+        // Collect background jobs that have finished meanwhile
+        if (job_list != NULL)
+            jobs_notify();
+
+        // Display shell prompt
+        if (interactive)
+            display_prompt();
+
+        // Read user input
+        input = read_input(&reader);
+        if (input == NULL)
         {
-            // Sequential execution
-            execute_sequential_commands(commands, command_count);
+            break; // End of input
         }
-        else if (special_char[0] == '&' || special_char[0] == '|')
+        if (*input == '\0')
         {
-            // Conditional execution with && and ||
-            execute_conditional_commands(commands, command_count, special_char);
+            continue; // Empty input, show prompt again
         }
-        else if (command_count == 1)
+
+        // Parse the user input into an AST
+        if (trace_active)
         {
-            execute_command(commands[0]);
+            trace_line = arena_strdup(&line_arena, input);
+            trace_line_id++;
+            trace_list_op = "";
+            trace_pipe_op = "";
+            double parse_started = monotonic_seconds();
+            list = parse_input(input);
+            trace_parse_seconds = monotonic_seconds() - parse_started;
         }
         else
+            list = parse_input(input);
+        if (list == NULL)
         {
-            printf("w25shell: Unsupported command or operation\n");
+            // A syntax error (already reported) fails with status 2, and
+            // ends a script or -c string as in POSIX shells
+            if (parse_failed)
+            {
+                last_status = 2;
+                if (!interactive)
+                    break;
+            }
+            continue;
         }
 
-        // Clean up allocated memory
-        cleanup_commands(commands, command_count);
-        free(commands);
+        // Here-document bodies are the lines that follow
+        if (heredoc_head != NULL)
+            heredoc_read(&reader);
+
+        // Last line of -c: a lone external command replaces the shell
+        if (reader.fd < 0 && reader.pos >= reader.len)
+            exec_in_place(list);
+
+        // Walk the AST: ; lists of && / || lists of pipelines
+        line_reader_sync_out(&reader);
+        last_status = execute_sequential_commands(list);
+        line_reader_sync_in(&reader);
+
+        if (event_stopping())
+            break;
     }
 
-    return 0;
+    // SIGTERM or an interrupted script ends the shell like the signal would
+    if (shell_terminating)
+        last_status = 128 + SIGTERM;
+    else if (shell_interrupted && !interactive)
+        last_status = 128 + SIGINT;
+
+    // Handle EOF (Ctrl+D)
+    if (interactive)
+        printf("\n");
+
+    return last_status;
 }
 // SECTION ENDS: "MAIN SHELL LOOP"
 
@@ -173,798 +1134,9210 @@ void display_prompt()
 }
 
 /**
- * Function to read user input
+ * Function to read user input
+ *
+ * @param reader Line source
+ * @return The next line without its newline, or NULL at end of input
+ */
+char *read_input(line_reader *reader)
+{
+    char *line = line_reader_next(reader);
+
+    // Tolerate CRLF scripts
+    if (line != NULL)
+    {
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\r')
+            line[length - 1] = '\0';
+    }
+
+    return line;
+}
+
+/**
+ * Function to start reading lines from a descriptor. Regular files are
+ * mapped whole, so a script costs one mmap() instead of a read() per
+ * buffer; pipes and terminals are read into a buffer that grows with the
+ * longest line.
+ *
+ * @param reader Reader to set up
+ * @param fd Descriptor to read from (owned by the reader)
+ * @return 0 on success, -1 on error (errno set)
+ */
+int line_reader_open(line_reader *reader, int fd)
+{
+    struct stat st;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->shared = fd == STDIN_FILENO;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+
+        // Private and writable so each line can be terminated in place;
+        // only the pages actually touched get copied
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->data = (char *)map;
+            reader->len = st.st_size;
+            reader->pos = offset > 0 && offset <= st.st_size ? offset : 0;
+            reader->mapped = 1;
+            reader->eof = 1;
+            return 0;
+        }
+    }
+
+    reader->cap = READER_CHUNK;
+    reader->data = (char *)malloc(reader->cap);
+    return reader->data != NULL ? 0 : -1;
+}
+
+/**
+ * Function to read lines out of a -c argument
+ *
+ * @param reader Reader to set up
+ * @param text Command string (modified in place)
+ */
+void line_reader_string(line_reader *reader, char *text)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+    reader->data = text;
+    reader->len = strlen(text);
+    reader->eof = 1;
+}
+
+/**
+ * Function to return the next line, reading more input as needed.
+ * There is no length limit: the buffer doubles until the line fits.
+ *
+ * @param reader Line source
+ * @return NUL-terminated line without its newline, NULL at end of input
+ */
+char *line_reader_next(line_reader *reader)
+{
+    while (1)
+    {
+        char *line = reader->data + reader->pos;
+        char *newline = memchr(line, '\n', reader->len - reader->pos);
+
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            reader->pos = newline + 1 - reader->data;
+            return line;
+        }
+
+        if (reader->eof)
+        {
+            if (reader->pos >= reader->len)
+                return NULL;
+
+            size_t length = reader->len - reader->pos;
+            reader->pos = reader->len;
+
+            // A buffer or string has room for the terminator; a mapping
+            // only does when the file does not end on a page boundary
+            if (!reader->mapped || reader->len % sysconf(_SC_PAGESIZE) != 0)
+            {
+                line[length] = '\0';
+                return line;
+            }
+
+            free(reader->spill);
+            reader->spill = strndup(line, length);
+            return reader->spill;
+        }
+
+        // Keep the partial line and make room behind it
+        if (reader->pos > 0)
+        {
+            memmove(reader->data, line, reader->len - reader->pos);
+            reader->len -= reader->pos;
+            reader->pos = 0;
+        }
+        if (reader->len + 1 >= reader->cap)
+        {
+            char *grown = (char *)realloc(reader->data, reader->cap * 2);
+            if (!grown)
+            {
+                perror("Memory allocation failed");
+                reader->eof = 1;
+                continue;
+            }
+            reader->data = grown;
+            reader->cap *= 2;
+        }
+
+        // On a terminal this returns one line at a time anyway; waiting
+        // happens in the event loop so signals are handled at the prompt
+        ssize_t n = event_read(reader->fd, reader->data + reader->len, reader->cap - reader->len - 1);
+        if (n < 0 && errno == ECANCELED)
+        {
+            // Ctrl+C at the prompt: drop the line and prompt again
+            printf("\n");
+            reader->len = 0;
+            reader->data[0] = '\0';
+            return reader->data;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            reader->eof = 1;
+        else
+            reader->len += n;
+    }
+}
+
+/**
+ * Function to hand stdin to the commands of a line: a mapped stdin is
+ * repositioned just past the current line, so a command reading standard
+ * input continues where the shell stopped, as with a byte-wise reader
+ *
+ * @param reader Line source
+ */
+void line_reader_sync_out(line_reader *reader)
+{
+    if (reader->shared && reader->mapped)
+        lseek(reader->fd, reader->pos, SEEK_SET);
+}
+
+/**
+ * Function to take stdin back after a line: skip whatever the commands
+ * consumed from it
+ *
+ * @param reader Line source
+ */
+void line_reader_sync_in(line_reader *reader)
+{
+    if (reader->shared && reader->mapped)
+    {
+        off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+        if (offset > (off_t)reader->pos && offset <= (off_t)reader->len)
+            reader->pos = offset;
+    }
+}
+
+/**
+ * Function to exec the final command of -c in place of the shell when it
+ * is a single external program, saving a fork and a wait. Returns only
+ * if the line does not qualify or the exec fails.
+ *
+ * @param list Parsed last line
+ */
+void exec_in_place(list_node *list)
+{
+    if (list->count != 1 || list->background[0] || list->items[0]->count != 1 || list->items[0]->items[0]->count != 1)
+        return;
+
+    // A trace, time or pstat report needs the shell to see the command end
+    if (trace_active || timing_active || pstat_active)
+        return;
+
+    command_node *cmd = list->items[0]->items[0]->stages[0];
+    if (cmd->argc == 0 || cmd->redirs != NULL || cmd->expand || is_shell_command(cmd))
+        return;
+
+    // Line prefixes belong to the shell even where a program has the name
+    static const char *prefixes[] = {"time", "pstat", "parallel", "timeout", "limit", "sched"};
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+    {
+        if (strcmp(cmd->argv[0], prefixes[i]) == 0)
+            return;
+    }
+
+    const char *path = hash_lookup(cmd->argv[0]);
+    if (path == NULL)
+        return;
+
+    // The program gets the signal mask the shell started with, and the
+    // registry slot goes: it names this pid but the shell is gone
+    fflush(stdout);
+    event_detach();
+    registry_deregister();
+    execv(path, cmd->argv);
+    registry_register();
+    event_init();
+}
+// SECTION ENDS: "SHELL INTERFACE"
+
+// SECTION STARTS: "COMMAND PARSING"
+/**
+ * Function to split a line into tokens in one left-to-right pass.
+ * Quotes and backslashes are removed while copying word text into a single
+ * arena buffer. The operators =, ~, # and + are only recognised as whole,
+ * unquoted words, so "a=b", "g++" or "~/dir" stay ordinary words.
+ *
+ * @param input The user input string
+ * @return Token array terminated by TOKEN_END, or NULL on error (reported)
+ */
+token *lex_input(char *input)
+{
+    size_t len = strlen(input);
+    int capacity = INITIAL_TOKENS;
+    int count = 0;
+
+    // Word text never exceeds the input plus one terminator per word
+    char *out = (char *)arena_alloc(&line_arena, 2 * len + 2);
+    token *tokens = (token *)arena_alloc(&line_arena, capacity * sizeof(token));
+    if (!out || !tokens)
+    {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    const char *p = input;
+
+    while (1)
+    {
+        // Skip whitespace between tokens
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            p++;
+
+        // Keep room for this token and the final TOKEN_END
+        if (count + 2 > capacity)
+        {
+            tokens = (token *)arena_grow(&line_arena, tokens, capacity * sizeof(token), 2 * capacity * sizeof(token));
+            capacity *= 2;
+            if (!tokens)
+            {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+        }
+
+        token *tok = &tokens[count];
+        tok->text = NULL;
+        tok->expand = 0;
+
+        if (*p == '\0')
+        {
+            tok->type = TOKEN_END;
+            return tokens;
+        }
+
+        // Operators made of shell metacharacters
+        if (*p == '|')
+        {
+            tok->type = p[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+            p += p[1] == '|' ? 2 : 1;
+
+            // |[SIZE] sets the capacity of this pipe
+            size_t size_len = tok->type == TOKEN_PIPE && *p == '[' ? strspn(p + 1, "0123456789KkMmGg") : 0;
+            if (size_len > 0 && p[1 + size_len] == ']')
+            {
+                tok->text = out;
+                memcpy(out, p + 1, size_len);
+                out += size_len;
+                *out++ = '\0';
+                p += size_len + 2;
+            }
+            count++;
+            continue;
+        }
+        if (*p == '&')
+        {
+            tok->type = p[1] == '&' ? TOKEN_AND : TOKEN_AMP;
+            p += p[1] == '&' ? 2 : 1;
+            count++;
+            continue;
+        }
+        if (*p == ';')
+        {
+            tok->type = TOKEN_SEMI;
+            p++;
+            count++;
+            continue;
+        }
+        if (*p == '<')
+        {
+            // < file, << DELIMITER or <<< word
+            int length = p[1] != '<' ? 1 : p[2] != '<' ? 2 : 3;
+            tok->type = length == 1 ? TOKEN_LESS : length == 2 ? TOKEN_HEREDOC : TOKEN_HERESTRING;
+            p += length;
+            count++;
+            continue;
+        }
+        if (*p == '2' && p[1] == '>')
+        {
+            // Only at the start of a token: in "a2>b" the 2 stays part of
+            // the word "a2", followed by > and b
+            tok->type = p[2] == '>' ? TOKEN_ERRDGREAT : TOKEN_ERRGREAT;
+            p += p[2] == '>' ? 3 : 2;
+            count++;
+            continue;
+        }
+        if (*p == '>')
+        {
+            tok->type = p[1] == '>' ? TOKEN_DGREAT : TOKEN_GREAT;
+            p += p[1] == '>' ? 2 : 1;
+            count++;
+            continue;
+        }
+
+        // A word: copy it with quoting removed
+        char *word = out;
+        int quoted = 0;
+
+        while (*p != '\0' && strchr(" \t\n|&;<>", *p) == NULL)
+        {
+            if (*p == '$' && p[1] == '(')
+            {
+                // $(...): keep the command text for expand_command()
+                const char *end = substitution_end(p + 2);
+                if (!end)
+                {
+                    fprintf(stderr, "w25shell: syntax error: unterminated $(\n");
+                    return NULL;
+                }
+                *out++ = SUBST_OPEN;
+                memcpy(out, p + 2, end - p - 2);
+                out += end - p - 2;
+                *out++ = SUBST_CLOSE;
+                p = end + 1;
+                tok->expand = 1;
+            }
+            else if (*p == '\'')
+            {
+                // Single quotes: everything literal up to the next quote
+                const char *end = strchr(p + 1, '\'');
+                if (!end)
+                {
+                    fprintf(stderr, "w25shell: syntax error: unterminated quote\n");
+                    return NULL;
+                }
+                memcpy(out, p + 1, end - p - 1);
+                out += end - p - 1;
+                p = end + 1;
+                quoted = 1;
+            }
+            else if (*p == '"')
+            {
+                // Double quotes: backslash only escapes \ " $ `
+                p++;
+                while (*p != '"')
+                {
+                    if (*p == '\0')
+                    {
+                        fprintf(stderr, "w25shell: syntax error: unterminated quote\n");
+                        return NULL;
+                    }
+                    if (*p == '$' && p[1] == '(')
+                    {
+                        // Quoted $(...) output stays one word
+                        const char *end = substitution_end(p + 2);
+                        if (!end)
+                        {
+                            fprintf(stderr, "w25shell: syntax error: unterminated $(\n");
+                            return NULL;
+                        }
+                        *out++ = SUBST_QUOTED;
+                        memcpy(out, p + 2, end - p - 2);
+                        out += end - p - 2;
+                        *out++ = SUBST_CLOSE;
+                        p = end + 1;
+                        tok->expand = 1;
+                        continue;
+                    }
+                    if (*p == '\\' && p[1] != '\0' && strchr("\\\"$`", p[1]) != NULL)
+                        p++;
+                    *out++ = *p++;
+                }
+                p++;
+                quoted = 1;
+            }
+            else if (*p == '\\' && p[1] != '\0')
+            {
+                // Backslash outside quotes escapes the next character
+                *out++ = p[1];
+                p += 2;
+                quoted = 1;
+            }
+            else
+            {
+                *out++ = *p++;
+            }
+        }
+        *out++ = '\0';
+
+        // Standalone unquoted =, ~, # and + are operators; =[SIZE] is a
+        // sized = like |[SIZE]
+        tok->type = TOKEN_WORD;
+        if (!quoted && word[0] == '=' && word[1] == '[' && out - word > 3 && out[-2] == ']')
+        {
+            out[-2] = '\0';
+            tok->type = TOKEN_REVERSE;
+            tok->text = word + 2;
+        }
+        else if (!quoted && word[0] != '\0' && word[1] == '\0')
+        {
+            if (word[0] == '=')
+                tok->type = TOKEN_REVERSE;
+            else if (word[0] == '~')
+                tok->type = TOKEN_TILDE;
+            else if (word[0] == '#')
+                tok->type = TOKEN_HASH;
+            else if (word[0] == '+')
+                tok->type = TOKEN_PLUS;
+        }
+        if (tok->type == TOKEN_WORD)
+            tok->text = word;
+
+        count++;
+    }
+}
+
+/**
+ * Function to report a syntax error at the parser's current token
+ *
+ * @param ps Parser state
+ */
+void parse_error(parser *ps)
+{
+    static const char *names[] = {"word", "|", "=",       "&&", "||", ";",   "<",  ">",  ">>",
+                                  "~",    "#", "+", "newline", "&",  "2>", "2>>", "<<", "<<<"};
+    token *tok = &ps->tokens[ps->pos];
+
+    fprintf(stderr, "w25shell: syntax error near '%s'\n", tok->type == TOKEN_WORD ? tok->text : names[tok->type]);
+}
+
+/**
+ * Function to parse one simple command: words and redirections, possibly
+ * turned into a file operation by #, ~ or +
+ *
+ * @param ps Parser state
+ * @return Command node, or NULL on error (reported)
+ */
+command_node *parse_command(parser *ps)
+{
+    command_node *cmd = (command_node *)arena_alloc(&line_arena, sizeof(command_node));
+    int capacity = INITIAL_ARGS;
+    redirection **redir_tail;
+
+    if (!cmd || !(cmd->argv = (char **)arena_alloc(&line_arena, capacity * sizeof(char *))))
+    {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    cmd->kind = CMD_EXEC;
+    cmd->argc = 0;
+    cmd->redirs = NULL;
+    cmd->expand = 0;
+    redir_tail = &cmd->redirs;
+
+    // "# file" counts words
+    if (ps->tokens[ps->pos].type == TOKEN_HASH)
+    {
+        cmd->kind = CMD_COUNT;
+        ps->pos++;
+    }
+
+    while (1)
+    {
+        token *tok = &ps->tokens[ps->pos];
+
+        if (tok->type == TOKEN_WORD)
+        {
+            // Keep room for the terminating NULL
+            if (cmd->argc + 1 == capacity)
+            {
+                cmd->argv = (char **)arena_grow(&line_arena, cmd->argv, capacity * sizeof(char *),
+                                                2 * capacity * sizeof(char *));
+                capacity *= 2;
+                if (!cmd->argv)
+                {
+                    perror("Memory allocation failed");
+                    return NULL;
+                }
+            }
+            cmd->argv[cmd->argc++] = tok->text;
+            cmd->expand |= tok->expand;
+            ps->pos++;
+        }
+        else if (tok->type == TOKEN_LESS || tok->type == TOKEN_GREAT || tok->type == TOKEN_DGREAT ||
+                 tok->type == TOKEN_ERRGREAT || tok->type == TOKEN_ERRDGREAT || tok->type == TOKEN_HEREDOC ||
+                 tok->type == TOKEN_HERESTRING)
+        {
+            ps->pos++;
+            if (ps->tokens[ps->pos].type != TOKEN_WORD)
+            {
+                parse_error(ps);
+                return NULL;
+            }
+
+            redirection *redir = (redirection *)arena_alloc(&line_arena, sizeof(redirection));
+            if (!redir)
+            {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+            redir->kind = tok->type == TOKEN_LESS         ? REDIR_IN
+                          : tok->type == TOKEN_GREAT      ? REDIR_OUT
+                          : tok->type == TOKEN_DGREAT     ? REDIR_APPEND
+                          : tok->type == TOKEN_ERRGREAT   ? REDIR_ERR
+                          : tok->type == TOKEN_ERRDGREAT  ? REDIR_ERR_APPEND
+                          : tok->type == TOKEN_HEREDOC    ? REDIR_HEREDOC
+                                                          : REDIR_HERESTRING;
+            redir->target = ps->tokens[ps->pos].text;
+            redir->body = NULL;
+            redir->body_len = 0;
+            redir->next = NULL;
+            redir->next_heredoc = NULL;
+            *redir_tail = redir;
+            redir_tail = &redir->next;
+
+            // A delimiter is compared as typed; the body follows the line
+            if (redir->kind == REDIR_HEREDOC)
+            {
+                *heredoc_tail = redir;
+                heredoc_tail = &redir->next_heredoc;
+            }
+            else
+                cmd->expand |= ps->tokens[ps->pos].expand;
+            ps->pos++;
+        }
+        else if (tok->type == TOKEN_PLUS || tok->type == TOKEN_TILDE)
+        {
+            // file1 + file2 [+ ...] or file1 ~ file2
+            int kind = tok->type == TOKEN_PLUS ? CMD_CONCAT : CMD_APPEND;
+            if (cmd->argc == 0 || (cmd->kind != CMD_EXEC && cmd->kind != kind) || (kind == CMD_APPEND && cmd->kind == kind))
+            {
+                parse_error(ps);
+                return NULL;
+            }
+            cmd->kind = kind;
+            ps->pos++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    cmd->argv[cmd->argc] = NULL;
+
+    if (cmd->argc == 0 && (cmd->kind != CMD_EXEC || cmd->redirs == NULL))
+    {
+        parse_error(ps);
+        return NULL;
+    }
+    if (cmd->kind == CMD_APPEND && cmd->argc != 2)
+    {
+        fprintf(stderr, "w25shell: ~ expects exactly two files\n");
+        return NULL;
+    }
+
+    return cmd;
+}
+
+/**
+ * Function to parse stages joined by | (or by =, which cannot be mixed)
+ *
+ * @param ps Parser state
+ * @return Pipeline node, or NULL on error (reported)
+ */
+pipeline_node *parse_pipeline(parser *ps)
+{
+    pipeline_node *pipeline = (pipeline_node *)arena_alloc(&line_arena, sizeof(pipeline_node));
+    int capacity = INITIAL_COMMANDS;
+
+    if (!pipeline || !(pipeline->stages = (command_node **)arena_alloc(&line_arena, capacity * sizeof(command_node *))))
+    {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    pipeline->count = 0;
+    pipeline->reverse = 0;
+    pipeline->pipe_sizes = NULL;
+
+    while (1)
+    {
+        command_node *cmd = parse_command(ps);
+        if (!cmd)
+            return NULL;
+
+        if (pipeline->count == capacity)
+        {
+            int sized = pipeline->pipe_sizes != NULL;
+            pipeline->stages = (command_node **)arena_grow(&line_arena, pipeline->stages,
+                                                           capacity * sizeof(command_node *),
+                                                           2 * capacity * sizeof(command_node *));
+            if (sized)
+            {
+                pipeline->pipe_sizes = (long *)arena_grow(&line_arena, pipeline->pipe_sizes, capacity * sizeof(long),
+                                                          2 * capacity * sizeof(long));
+                if (pipeline->pipe_sizes)
+                    memset(pipeline->pipe_sizes + capacity, 0, capacity * sizeof(long));
+            }
+            capacity *= 2;
+            if (!pipeline->stages || (sized && !pipeline->pipe_sizes))
+            {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+        }
+        pipeline->stages[pipeline->count++] = cmd;
+
+        int type = ps->tokens[ps->pos].type;
+        if (type != TOKEN_PIPE && type != TOKEN_REVERSE)
+            return pipeline;
+
+        // | and = give opposite data directions; one pipeline uses one
+        if (pipeline->count > 1 && pipeline->reverse != (type == TOKEN_REVERSE))
+        {
+            fprintf(stderr, "w25shell: cannot mix | and = in one pipeline\n");
+            return NULL;
+        }
+        pipeline->reverse = type == TOKEN_REVERSE;
+
+        // The operator may carry the capacity of the pipe after this stage
+        const char *size_text = ps->tokens[ps->pos].text;
+        if (size_text != NULL)
+        {
+            long size = parse_size(size_text);
+            if (size <= 0)
+            {
+                fprintf(stderr, "w25shell: invalid pipe size '%s'\n", size_text);
+                return NULL;
+            }
+            if (!pipeline->pipe_sizes)
+            {
+                pipeline->pipe_sizes = (long *)arena_alloc(&line_arena, capacity * sizeof(long));
+                if (!pipeline->pipe_sizes)
+                {
+                    perror("Memory allocation failed");
+                    return NULL;
+                }
+                memset(pipeline->pipe_sizes, 0, capacity * sizeof(long));
+            }
+            pipeline->pipe_sizes[pipeline->count - 1] = size;
+        }
+        ps->pos++;
+    }
+}
+
+/**
+ * Function to parse pipelines joined by && and ||
+ *
+ * @param ps Parser state
+ * @return And-or node, or NULL on error (reported)
+ */
+and_or_node *parse_and_or(parser *ps)
+{
+    and_or_node *node = (and_or_node *)arena_alloc(&line_arena, sizeof(and_or_node));
+    int capacity = INITIAL_COMMANDS;
+
+    if (!node || !(node->items = (pipeline_node **)arena_alloc(&line_arena, capacity * sizeof(pipeline_node *))) ||
+        !(node->ops = (int *)arena_alloc(&line_arena, capacity * sizeof(int))))
+    {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    node->count = 0;
+
+    while (1)
+    {
+        pipeline_node *pipeline = parse_pipeline(ps);
+        if (!pipeline)
+            return NULL;
+
+        if (node->count == capacity)
+        {
+            node->items = (pipeline_node **)arena_grow(&line_arena, node->items, capacity * sizeof(pipeline_node *),
+                                                       2 * capacity * sizeof(pipeline_node *));
+            node->ops = (int *)arena_grow(&line_arena, node->ops, capacity * sizeof(int), 2 * capacity * sizeof(int));
+            capacity *= 2;
+            if (!node->items || !node->ops)
+            {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+        }
+        node->items[node->count++] = pipeline;
+
+        int type = ps->tokens[ps->pos].type;
+        if (type != TOKEN_AND && type != TOKEN_OR)
+            return node;
+
+        node->ops[node->count - 1] = type == TOKEN_AND ? OP_AND : OP_OR;
+        ps->pos++;
+    }
+}
+
+/**
+ * Function to parse the input into an AST: and-or lists separated by ;,
+ * each made of pipelines joined by && / ||, each made of simple commands
+ * joined by | or =, each carrying its own redirections.
+ *
+ * @param input The user input string
+ * @return Root list node, or NULL on error (reported, parse_failed set) or
+ *         for an empty line
+ */
+list_node *parse_input(char *input)
+{
+    parser ps;
+    int capacity = INITIAL_COMMANDS;
+
+    // Cleared again below once the whole line parsed
+    parse_failed = 1;
+
+    // Bodies of here-documents are only read for the line of the main loop
+    heredoc_head = NULL;
+    heredoc_tail = &heredoc_head;
+
+    ps.tokens = lex_input(input);
+    ps.pos = 0;
+    if (!ps.tokens)
+        return NULL;
+
+    list_node *list = (list_node *)arena_alloc(&line_arena, sizeof(list_node));
+    if (!list || !(list->items = (and_or_node **)arena_alloc(&line_arena, capacity * sizeof(and_or_node *))) ||
+        !(list->background = (int *)arena_alloc(&line_arena, capacity * sizeof(int))))
+    {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    list->count = 0;
+
+    while (ps.tokens[ps.pos].type != TOKEN_END)
+    {
+        and_or_node *node = parse_and_or(&ps);
+        if (!node)
+            return NULL;
+
+        if (list->count == capacity)
+        {
+            list->items = (and_or_node **)arena_grow(&line_arena, list->items, capacity * sizeof(and_or_node *),
+                                                     2 * capacity * sizeof(and_or_node *));
+            list->background = (int *)arena_grow(&line_arena, list->background, capacity * sizeof(int),
+                                                 2 * capacity * sizeof(int));
+            capacity *= 2;
+            if (!list->items || !list->background)
+            {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+        }
+        list->background[list->count] = 0;
+        list->items[list->count++] = node;
+
+        // An and-or list ends at ; or & (optionally trailing) or at the end
+        if (ps.tokens[ps.pos].type == TOKEN_SEMI || ps.tokens[ps.pos].type == TOKEN_AMP)
+        {
+            list->background[list->count - 1] = ps.tokens[ps.pos].type == TOKEN_AMP;
+            ps.pos++;
+        }
+        else if (ps.tokens[ps.pos].type != TOKEN_END)
+        {
+            parse_error(&ps);
+            return NULL;
+        }
+    }
+
+    parse_failed = 0;
+    return list->count > 0 ? list : NULL;
+}
+
+/**
+ * Function to print the parse_input() benchmark: lines parsed, nanoseconds
+ * per line and heap allocations per line
+ *
+ * @param iterations Number of passes over the sample lines
+ */
+void parse_benchmark(long iterations)
+{
+    long parsed;
+    double allocs;
+
+    double ns = parse_benchmark_run(iterations, &parsed, &allocs);
+    printf("parse_input lines=%ld ns_per_line=%.1f allocs_per_line=%.4f\n", parsed, ns, allocs);
+}
+
+/**
+ * Function to measure parse_input() on a fixed set of representative lines.
+ * Every parser allocation goes through line_arena, so arena block
+ * allocations are the only heap traffic.
+ *
+ * @param iterations Number of passes over the sample lines
+ * @param parsed Output number of lines parsed
+ * @param allocs_per_line Output heap allocations per line
+ * @return Nanoseconds per line
+ */
+double parse_benchmark_run(long iterations, long *parsed, double *allocs_per_line)
+{
+    static const char *lines[] = {
+        "ls -l",
+        "ls | grep . | sort | head -n 3 | wc -l",
+        "wc -l = grep -v test = cat sample.txt",
+        "date ; pwd ; ls",
+        "ls && pwd && echo \"Both succeeded\"",
+        "file1.txt + file2.txt + file3.txt + file4.txt",
+        "grep hello < input.txt > output.txt",
+        "make 2>/dev/null | grep -c error || echo 'no errors' ; ls -l | sort > out.txt",
+        "echo a b c d e f g h i j k l m n o p",
+    };
+    int line_count = sizeof(lines) / sizeof(lines[0]);
+    char input[MAX_INPUT_SIZE];
+
+    if (iterations < 1)
+        iterations = 1;
+
+    // Warm up so the arena reaches its steady-state size
+    for (int i = 0; i < line_count; i++)
+    {
+        arena_reset(&line_arena);
+        snprintf(input, sizeof(input), "%s", lines[i]);
+        parse_input(input);
+    }
+
+    unsigned long allocs_before = line_arena.block_allocs;
+    double start = monotonic_seconds();
+
+    for (long n = 0; n < iterations; n++)
+    {
+        for (int i = 0; i < line_count; i++)
+        {
+            arena_reset(&line_arena);
+            snprintf(input, sizeof(input), "%s", lines[i]);
+            parse_input(input);
+        }
+    }
+
+    double elapsed = monotonic_seconds() - start;
+    *parsed = iterations * line_count;
+
+    *allocs_per_line = (double)(line_arena.block_allocs - allocs_before) / *parsed;
+    return elapsed * 1e9 / *parsed;
+}
+// SECTION ENDS: "COMMAND PARSING"
+
+// SECTION STARTS: "COMMAND SUBSTITUTION"
+/**
+ * Function to find the ) that closes a $( while lexing: parentheses nest,
+ * and quotes and backslashes hide them
+ *
+ * @param p First character after "$("
+ * @return The closing parenthesis, or NULL if the line ends first
+ */
+const char *substitution_end(const char *p)
+{
+    int depth = 1;
+
+    while (*p != '\0')
+    {
+        if (*p == '\'')
+        {
+            p = strchr(p + 1, '\'');
+            if (p == NULL)
+                return NULL;
+        }
+        else if (*p == '"')
+        {
+            p++;
+            while (*p != '"')
+            {
+                if (*p == '\0')
+                    return NULL;
+                if (*p == '\\' && p[1] != '\0')
+                    p++;
+                p++;
+            }
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (*p == '(')
+        {
+            depth++;
+        }
+        else if (*p == ')' && --depth == 0)
+        {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function to run the text of a $(...) and collect what it writes to
+ * stdout. A lone builtin or file operator runs inside the shell with
+ * stdout on a memfd; anything else runs in a forked subshell writing to a
+ * pipe, read into a buffer grown by what FIONREAD says the pipe holds.
+ * Trailing newlines are dropped. The buffer lives until the next line.
+ *
+ * @param text Command line inside the parentheses
+ * @param len Output length of the result
+ * @param killed Output SIGINT or SIGTERM if that ended the subshell, else 0
+ * @return NUL-terminated output (empty if the command could not run)
+ */
+char *capture_output(char *text, size_t *len, int *killed)
+{
+    static char empty[1] = "";
+    list_node *list = parse_input(text);
+    size_t cap = CAPTURE_CHUNK;
+    size_t used = 0;
+    capture_buffer *buf = NULL;
+
+    *len = 0;
+    *killed = 0;
+    if (list == NULL)
+        return empty;
+
+    pipeline_node *lone = list->count == 1 && !list->background[0] && list->items[0]->count == 1
+                              ? list->items[0]->items[0]
+                              : NULL;
+    if (lone != NULL && lone->count == 1 && is_shell_command(lone->stages[0]))
+    {
+        // No fork: the builtin writes to a memfd whose size is then known
+        int fd = memfd_create("w25shell-subst", MFD_CLOEXEC);
+        if (fd < 0)
+        {
+            perror("memfd_create failed");
+            return empty;
+        }
+
+        fflush(stdout);
+        int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(fd, STDOUT_FILENO);
+        execute_pipeline(lone);
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            cap = st.st_size + 1;
+        buf = (capture_buffer *)malloc(sizeof(capture_buffer) + cap);
+        while (buf != NULL && used + 1 < cap)
+        {
+            ssize_t n = pread(fd, buf->data + used, cap - used - 1, used);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            used += n;
+        }
+        close(fd);
+    }
+    else
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            perror("pipe failed");
+            return empty;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork failed");
+            close(fds[0]);
+            close(fds[1]);
+            return empty;
+        }
+
+        if (pid == 0)
+        {
+            // Subshell in the shell's group: Ctrl+C reaches it, Ctrl+Z
+            // cannot stop it halfway through a command line
+            spawn_io io;
+            spawn_io_init(&io);
+            child_enter_group(&io);
+            if (job_control)
+                signal(SIGTSTP, SIG_IGN);
+
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+
+            job_control = 0;
+            interactive = 0;
+            job_list = NULL;
+            trace_active = 0;
+            zygote_detach();
+
+            int status = execute_sequential_commands(list);
+            fflush(stdout);
+            _exit(status);
+        }
+
+        close(fds[1]);
+        buf = (capture_buffer *)malloc(sizeof(capture_buffer) + cap);
+        while (buf != NULL)
+        {
+            int avail = 0;
+            if (ioctl(fds[0], FIONREAD, &avail) < 0)
+                avail = 0;
+
+            // Nothing to read yet: wait, handling signals for the subshell
+            if (avail == 0 && signal_fd >= 0)
+            {
+                struct pollfd watched[2] = {{fds[0], POLLIN, 0}, {signal_fd, POLLIN, 0}};
+                if (poll(watched, 2, -1) < 0 && errno != EINTR)
+                    break;
+                if (watched[1].revents & POLLIN)
+                    event_signals(&pid, 1, 0);
+                if (watched[0].revents == 0)
+                    continue;
+            }
+
+            // Grow once by whatever the pipe already holds
+            size_t need = used + (avail > 0 ? (size_t)avail : 1) + 1;
+            if (need > cap)
+            {
+                size_t grown_cap = cap * 2 > need ? cap * 2 : need;
+                capture_buffer *grown = (capture_buffer *)realloc(buf, sizeof(capture_buffer) + grown_cap);
+                if (grown == NULL)
+                {
+                    perror("Memory allocation failed");
+                    break;
+                }
+                buf = grown;
+                cap = grown_cap;
+            }
+
+            ssize_t n = read(fds[0], buf->data + used, cap - used - 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            used += n;
+        }
+        close(fds[0]);
+
+        int wait_status;
+        foreground_wait(&pid, 1, 0, 0);
+        while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR)
+            ;
+        // Killed, or a subshell that stopped on the signal itself
+        int status = exit_status_of(wait_status);
+        if (status == 128 + SIGINT || status == 128 + SIGTERM)
+            *killed = status - 128;
+    }
+
+    if (buf == NULL)
+        return empty;
+
+    while (used > 0 && buf->data[used - 1] == '\n')
+        used--;
+    buf->data[used] = '\0';
+    buf->next = captures;
+    captures = buf;
+    *len = used;
+    return buf->data;
+}
+
+/**
+ * Function to free the outputs of every $(...) of the previous line
+ */
+void captures_release()
+{
+    while (captures != NULL)
+    {
+        capture_buffer *next = captures->next;
+        free(captures);
+        captures = next;
+    }
+}
+
+/**
+ * Function to add text to the field being built. Text from a capture
+ * buffer is borrowed as long as the field consists of it alone; anything
+ * joined to it is copied into the line arena.
+ *
+ * @param f Field being built
+ * @param text Text to add
+ * @param n Its length
+ * @param borrow text may be referenced in place (and terminated there)
+ * @return 0 on success, -1 on allocation failure (reported)
+ */
+int field_append(field_builder *f, const char *text, size_t n, int borrow)
+{
+    f->active = 1;
+    if (n == 0)
+        return 0;
+
+    if (f->len == 0 && borrow)
+    {
+        f->text = (char *)text;
+        f->len = n;
+        f->capacity = 0;
+        return 0;
+    }
+
+    if (f->len + n + 1 > f->capacity)
+    {
+        size_t capacity = (f->len + n + 1) * 2;
+        char *copy = (char *)arena_alloc(&line_arena, capacity);
+        if (copy == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        memcpy(copy, f->text, f->len);
+        f->text = copy;
+        f->capacity = capacity;
+    }
+
+    memcpy(f->text + f->len, text, n);
+    f->len += n;
+    return 0;
+}
+
+/**
+ * Function to terminate the field being built and add it to a word list
+ *
+ * @param f Field being built (reset afterwards)
+ * @param out Word list to add to
+ * @return 0 on success, -1 on allocation failure (reported)
+ */
+int field_finish(field_builder *f, word_list *out)
+{
+    if (!f->active)
+        return 0;
+
+    if (out->count + 1 >= out->capacity)
+    {
+        out->words = (char **)arena_grow(&line_arena, out->words, out->capacity * sizeof(char *),
+                                         2 * out->capacity * sizeof(char *));
+        out->capacity *= 2;
+        if (out->words == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+    }
+
+    // A borrowed field ends on a separator or the buffer's terminator
+    if (f->len == 0)
+        f->text = (char *)"";
+    else
+        f->text[f->len] = '\0';
+    out->words[out->count++] = f->text;
+
+    f->text = NULL;
+    f->len = 0;
+    f->capacity = 0;
+    f->active = 0;
+    return 0;
+}
+
+/**
+ * Function to expand the $(...) in a word. Unquoted output is split on
+ * blanks and newlines into separate words, the first and last joined to
+ * the text around the substitution; quoted output stays one word.
+ *
+ * @param word Word text with SUBST_* markers (modified)
+ * @param out Word list the resulting words are added to
+ * @param split Split unquoted output (0 for redirection targets)
+ * @return 0 on success, 128 + the signal that killed a substitution, 1 on
+ *         allocation failure (reported)
+ */
+int expand_word(char *word, word_list *out, int split)
+{
+    field_builder f = {NULL, 0, 0, 0};
+    char *p = word;
+
+    while (*p != '\0')
+    {
+        if (*p != SUBST_OPEN && *p != SUBST_QUOTED)
+        {
+            size_t n = strcspn(p, SUBST_MARKERS);
+            if (field_append(&f, p, n, 0) < 0)
+                return 1;
+            p += n;
+            continue;
+        }
+
+        int quoted = *p == SUBST_QUOTED || !split;
+        char *end = strchr(p + 1, SUBST_CLOSE);
+        *end = '\0';
+        size_t n;
+        int killed;
+        char *output = capture_output(p + 1, &n, &killed);
+        p = end + 1;
+
+        // An interrupted substitution cancels the whole command
+        if (killed)
+            return 128 + killed;
+
+        if (quoted)
+        {
+            if (field_append(&f, output, n, 1) < 0)
+                return 1;
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < n)
+        {
+            size_t start = i + strspn(output + i, SUBST_BLANKS);
+            if (start >= n)
+                break;
+            i = start + strcspn(output + start, SUBST_BLANKS);
+
+            // Blanks before this piece end the field in progress
+            if (start > 0 && field_finish(&f, out) < 0)
+                return 1;
+            if (field_append(&f, output + start, i - start, 1) < 0)
+                return 1;
+        }
+        if (n > 0 && strchr(SUBST_BLANKS, output[n - 1]) != NULL && field_finish(&f, out) < 0)
+            return 1;
+    }
+
+    return field_finish(&f, out) < 0 ? 1 : 0;
+}
+
+/**
+ * Function to run the $(...) of a command and replace its arguments and
+ * redirection targets with the results. Done right before the command's
+ * pipeline starts, so earlier commands of the line have taken effect.
+ *
+ * @param cmd Command with expand set (cleared afterwards)
+ * @return 0 on success, else the exit status for the command (see
+ *         expand_word())
+ */
+int expand_command(command_node *cmd)
+{
+    word_list args = {NULL, 0, cmd->argc + INITIAL_ARGS};
+    int failed;
+
+    args.words = (char **)arena_alloc(&line_arena, args.capacity * sizeof(char *));
+    if (args.words == NULL)
+    {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    for (int i = 0; i < cmd->argc; i++)
+    {
+        char *word = cmd->argv[i];
+        if (strpbrk(word, SUBST_MARKERS) == NULL)
+        {
+            field_builder f = {word, strlen(word), 0, 1};
+            if (field_finish(&f, &args) < 0)
+                return 1;
+        }
+        else if ((failed = expand_word(word, &args, 1)) != 0)
+        {
+            return failed;
+        }
+    }
+    args.words[args.count] = NULL;
+    cmd->argv = args.words;
+    cmd->argc = args.count;
+
+    for (redirection *redir = cmd->redirs; redir != NULL; redir = redir->next)
+    {
+        if (redir->kind == REDIR_HEREDOC || strpbrk(redir->target, SUBST_MARKERS) == NULL)
+            continue;
+
+        char *slot[2];
+        word_list target = {slot, 0, 2};
+        if ((failed = expand_word(redir->target, &target, 0)) != 0)
+            return failed;
+        redir->target = target.count > 0 ? target.words[0] : (char *)"";
+    }
+
+    cmd->expand = 0;
+    return 0;
+}
+// SECTION ENDS: "COMMAND SUBSTITUTION"
+
+// SECTION STARTS: "BASIC COMMAND EXECUTION"
+/**
+ * Function to execute a single command
+ *
+ * @param cmd Command and its redirections
+ * @return Exit status of the command
+ */
+int execute_command(command_node *cmd)
+{
+    // Builtins and file operators run inside the shell itself
+    if (is_shell_command(cmd))
+    {
+        return execute_in_shell(cmd);
+    }
+
+    // A bare redirection ("> file") just creates/truncates the file
+    if (cmd->argc == 0)
+    {
+        int in_fd = STDIN_FILENO;
+        int out_fd = STDOUT_FILENO;
+        int err_fd = STDERR_FILENO;
+        int failed = handle_redirection(cmd->redirs, &in_fd, &out_fd, &err_fd) < 0;
+        if (in_fd != STDIN_FILENO)
+            close(in_fd);
+        if (out_fd != STDOUT_FILENO)
+            close(out_fd);
+        if (err_fd != STDERR_FILENO)
+            close(err_fd);
+        return failed;
+    }
+
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int err_fd = STDERR_FILENO;
+
+    // Open the redirection targets; the command does not run if one fails
+    if (handle_redirection(cmd->redirs, &in_fd, &out_fd, &err_fd) < 0)
+    {
+        return 1;
+    }
+
+    // Launch the command with its streams wired to the redirection targets
+    spawn_io io;
+    spawn_io_init(&io);
+    io.in_fd = in_fd;
+    io.out_fd = out_fd;
+    io.err_fd = err_fd;
+    io.cpu = sched_stage_cpu(0);
+    io.pgid = job_control ? 0 : -1;
+
+    timing_start();
+    pid_t pid = spawn_process(cmd->argv, &io);
+
+    // Close any open file descriptors
+    if (in_fd != STDIN_FILENO)
+        close(in_fd);
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
+    if (err_fd != STDERR_FILENO)
+        close(err_fd);
+
+    if (pid < 0)
+    {
+        return 127;
+    }
+
+    // Wait for the child process to complete (or to be stopped)
+    return wait_foreground(&pid, 1, 0, job_control ? pid : 0, &cmd, 0);
+}
+
+/**
+ * Function to execute a pipeline node with the matching executor
+ *
+ * @param pipeline Stages joined by | or =
+ * @return Exit status of the pipeline
+ */
+int execute_pipeline(pipeline_node *pipeline)
+{
+    trace_pipe_op = pipeline->count == 1 ? "" : pipeline->reverse ? "=" : "|";
+
+    // $(...) runs now, after the commands before this pipeline
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        int failed = pipeline->stages[i]->expand ? expand_command(pipeline->stages[i]) : 0;
+        if (failed != 0)
+        {
+            // Ctrl+C left the cursor after "^C"
+            if (job_control && failed == 128 + SIGINT)
+                printf("\n");
+            return failed;
+        }
+    }
+
+    if (pipeline->count == 1)
+    {
+        return execute_command(pipeline->stages[0]);
+    }
+
+    if (pipeline->reverse)
+    {
+        return execute_reverse_piped_commands(pipeline->stages, pipeline->count, pipeline->pipe_sizes);
+    }
+
+    return execute_piped_commands(pipeline->stages, pipeline->count, pipeline->pipe_sizes);
+}
+
+/**
+ * Function to tell whether a command is handled by the shell itself
+ *
+ * @param cmd Command to check
+ * @return 1 for file operators and builtins, 0 for external programs
+ */
+int is_shell_command(command_node *cmd)
+{
+    static const char *builtins[] = {"killterm", "killallterms", "hash", "wccache", "set",
+                                     "jobs", "fg", "bg", "wait"};
+
+    if (cmd->kind != CMD_EXEC)
+        return 1;
+    if (cmd->argc == 0)
+        return 0;
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(cmd->argv[0], builtins[i]) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to run a builtin or file operator in the current process,
+ * with its redirections applied to the shell's own stdin/stdout for the
+ * duration of the call
+ *
+ * @param cmd Command to run
+ * @return Exit status of the command
+ */
+int execute_in_shell(command_node *cmd)
+{
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int err_fd = STDERR_FILENO;
+    int saved_in = -1;
+    int saved_out = -1;
+    int saved_err = -1;
+
+    if (handle_redirection(cmd->redirs, &in_fd, &out_fd, &err_fd) < 0)
+    {
+        return 1;
+    }
+
+    // Swap the targets in, keeping the originals out of any child we spawn
+    fflush(stdout);
+    if (in_fd != STDIN_FILENO)
+    {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != STDOUT_FILENO)
+    {
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    if (err_fd != STDERR_FILENO)
+    {
+        fflush(stderr);
+        saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(err_fd, STDERR_FILENO);
+        close(err_fd);
+    }
+
+    struct rusage before;
+    double started = 0;
+    if (trace_active)
+    {
+        getrusage(RUSAGE_THREAD, &before);
+        started = monotonic_seconds();
+    }
+
+    int status = run_shell_command(cmd);
+
+    if (trace_active)
+    {
+        struct rusage after;
+        getrusage(RUSAGE_THREAD, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+        after.ru_minflt -= before.ru_minflt;
+        after.ru_majflt -= before.ru_majflt;
+        after.ru_nvcsw -= before.ru_nvcsw;
+        after.ru_nivcsw -= before.ru_nivcsw;
+        trace_record(cmd, NULL, 0, status, monotonic_seconds() - started, &after);
+    }
+
+    // Put the shell's own streams back
+    fflush(stdout);
+    if (saved_in >= 0)
+    {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out >= 0)
+    {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    if (saved_err >= 0)
+    {
+        fflush(stderr);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_err);
+    }
+
+    return status;
+}
+
+/**
+ * Function to dispatch a builtin or file operator (no redirection handling)
+ *
+ * @param cmd Command to run
+ * @return Exit status of the command
+ */
+int run_shell_command(command_node *cmd)
+{
+    switch (cmd->kind)
+    {
+    case CMD_APPEND:
+        return append_files(cmd->argv[0], cmd->argv[1]);
+    case CMD_COUNT:
+        return count_words_command(cmd->argv);
+    case CMD_CONCAT:
+        return concatenate_files(cmd->argv, cmd->argc);
+    }
+
+    if (strcmp(cmd->argv[0], "killterm") == 0)
+    {
+        killterm_command();
+    }
+    else if (strcmp(cmd->argv[0], "killallterms") == 0)
+    {
+        killallterms_command();
+    }
+    else if (strcmp(cmd->argv[0], "hash") == 0)
+    {
+        return hash_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "wccache") == 0)
+    {
+        return wccache_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "set") == 0)
+    {
+        return set_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "jobs") == 0)
+    {
+        return jobs_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "fg") == 0)
+    {
+        return fg_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "bg") == 0)
+    {
+        return bg_command(cmd->argv);
+    }
+    else if (strcmp(cmd->argv[0], "wait") == 0)
+    {
+        return wait_command(cmd->argv);
+    }
+
+    return 0;
+}
+
+/**
+ * Function to convert a waitpid() status to a shell exit status
+ *
+ * @param wait_status Status filled in by waitpid()
+ * @return Exit code, or 128 + signal number for a killed child
+ */
+int exit_status_of(int wait_status)
+{
+    if (WIFEXITED(wait_status))
+        return WEXITSTATUS(wait_status);
+    if (WIFSIGNALED(wait_status))
+        return 128 + WTERMSIG(wait_status);
+    return 1;
+}
+// SECTION ENDS: "BASIC COMMAND EXECUTION"
+
+// SECTION STARTS: "PROCESS SPAWNING"
+/**
+ * Function to reset a spawn_io to "inherit every standard stream"
+ *
+ * @param io Stream wiring to initialise
+ */
+void spawn_io_init(spawn_io *io)
+{
+    io->in_fd = STDIN_FILENO;
+    io->out_fd = STDOUT_FILENO;
+    io->err_fd = STDERR_FILENO;
+    io->cpu = -1;
+    io->pgid = -1;
+}
+
+/**
+ * Function to tell whether a child needs work between fork and exec
+ * (limits, pinning or scheduling), which only the fork backend can do
+ *
+ * @param io Stream wiring and CPU of the child
+ * @return 1 if child_setup() has something to install, 0 otherwise
+ */
+int child_setup_needed(const spawn_io *io)
+{
+    return limit_count > 0 || io->cpu >= 0 || sched_tuned();
+}
+
+/**
+ * Function to install limits, CPU and scheduling in a freshly forked child
+ *
+ * @param io Stream wiring and CPU of the child
+ * @return 0 on success, -1 if something was refused (reported)
+ */
+int child_setup(const spawn_io *io)
+{
+    if (limit_apply() < 0)
+        return -1;
+    return io->cpu >= 0 || sched_tuned() ? sched_apply(io->cpu) : 0;
+}
+
+/**
+ * Function to launch an external command with the configured backend.
+ * Every executor goes through here so path lookup, redirections and pipe
+ * ends are handled in one place. Descriptors that must not leak into the child are expected
+ * to be close-on-exec; only the three standard streams are installed explicitly.
+ *
+ * @param args Command and its arguments (NULL terminated)
+ * @param io Descriptors to install as the child's stdin/stdout/stderr
+ * @return PID of the child, or -1 if it could not be launched
+ */
+pid_t spawn_process(char **args, const spawn_io *io)
+{
+    pid_t pid;
+    double spawn_started = trace_active ? monotonic_seconds() : 0;
+
+    // Resolve the command once in the parent instead of letting execvp()
+    // probe every $PATH directory in every child
+    const char *path = hash_lookup(args[0]);
+    if (path == NULL)
+    {
+        fprintf(stderr, "w25shell: %s: command not found\n", args[0]);
+        return -1;
+    }
+
+    // Shell output still buffered (stdout is fully buffered off a
+    // terminal) must come out before the child's
+    fflush(stdout);
+
+    // Zygote backend: a helper forks instead of us; if it cannot, spawn
+    if (spawn_backend == SPAWN_BACKEND_ZYGOTE && !pstat_active && !child_setup_needed(io))
+    {
+        pid = zygote_spawn(path, args, io);
+        if (pid > 0)
+        {
+            if (trace_active)
+                trace_spawned(pid, monotonic_seconds() - spawn_started);
+            return pid;
+        }
+    }
+
+    // pstat needs a fork: the child waits on a gate until its counters are
+    // attached, so they are in place before exec enables them. Limits,
+    // pinning and scheduling are installed between fork and exec too.
+    if (spawn_backend == SPAWN_BACKEND_FORK || pstat_active || child_setup_needed(io))
+    {
+        int gate[2] = {-1, -1};
+        if (pstat_active && pipe2(gate, O_CLOEXEC) < 0)
+            gate[0] = gate[1] = -1;
+
+        pid = fork();
+
+        if (pid < 0)
+        {
+            perror("fork failed");
+            if (gate[0] >= 0)
+            {
+                close(gate[0]);
+                close(gate[1]);
+            }
+            return -1;
+        }
+        else if (pid == 0)
+        {
+            if (gate[0] >= 0)
+            {
+                char byte;
+                close(gate[1]);
+                while (read(gate[0], &byte, 1) < 0 && errno == EINTR)
+                    ;
+            }
+
+            // Child process: join the job's group, install redirections / pipe ends
+            child_enter_group(io);
+            if (io->in_fd != STDIN_FILENO)
+            {
+                dup2(io->in_fd, STDIN_FILENO);
+            }
+            if (io->out_fd != STDOUT_FILENO)
+            {
+                dup2(io->out_fd, STDOUT_FILENO);
+            }
+            if (io->err_fd != STDERR_FILENO)
+            {
+                dup2(io->err_fd, STDERR_FILENO);
+            }
+            if (child_setup(io) < 0)
+                _exit(126);
+
+            // Execute the command
+            execv(path, args);
+
+            // If execv returns, it means an error occurred
+            perror("execv failed");
+            _exit(EXIT_FAILURE);
+        }
+
+        // Also set the group from this side so it exists before we use it
+        if (io->pgid >= 0)
+            setpgid(pid, io->pgid ? io->pgid : pid);
+
+        // Counters first, then let the child go on to exec
+        if (gate[0] >= 0)
+        {
+            close(gate[0]);
+            pstat_attach(pid);
+            close(gate[1]);
+        }
+
+        if (trace_active)
+            trace_spawned(pid, monotonic_seconds() - spawn_started);
+        return pid;
+    }
+
+    // posix_spawn backend: the same dup2 wiring expressed as file actions,
+    // so no page tables are copied regardless of the shell's size
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0)
+    {
+        fprintf(stderr, "w25shell: spawn setup failed: %s\n", strerror(err));
+        return -1;
+    }
+
+    if (io->in_fd != STDIN_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io->in_fd, STDIN_FILENO);
+    }
+    if (io->out_fd != STDOUT_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io->out_fd, STDOUT_FILENO);
+    }
+    if (io->err_fd != STDERR_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io->err_fd, STDERR_FILENO);
+    }
+
+    // Attributes are only needed for job control and the event loop's
+    // blocked signals; NULL keeps the fast path
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attrp = NULL;
+    if (io->pgid >= 0 || job_control || event_fd >= 0)
+    {
+        short flags = 0;
+        attrp = &attr;
+        posix_spawnattr_init(&attr);
+
+        if (io->pgid >= 0)
+        {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, io->pgid);
+        }
+        if (job_control)
+        {
+            // Ignored signals stay ignored across exec unless reset here
+            sigset_t defaults;
+            sigemptyset(&defaults);
+            sigaddset(&defaults, SIGINT);
+            sigaddset(&defaults, SIGQUIT);
+            sigaddset(&defaults, SIGTSTP);
+            sigaddset(&defaults, SIGTTIN);
+            sigaddset(&defaults, SIGTTOU);
+            flags |= POSIX_SPAWN_SETSIGDEF;
+            posix_spawnattr_setsigdefault(&attr, &defaults);
+        }
+        if (event_fd >= 0)
+        {
+            flags |= POSIX_SPAWN_SETSIGMASK;
+            posix_spawnattr_setsigmask(&attr, &event_saved_mask);
+        }
+        posix_spawnattr_setflags(&attr, flags);
+    }
+
+    extern char **environ;
+    err = posix_spawn(&pid, path, &actions, attrp, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (attrp)
+        posix_spawnattr_destroy(&attr);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "w25shell: %s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+
+    if (trace_active)
+        trace_spawned(pid, monotonic_seconds() - spawn_started);
+    return pid;
+}
+
+/**
+ * Function to launch one pipeline stage: external programs go through
+ * spawn_process(), builtins and file operators run in a forked copy of
+ * the shell. The stage's own redirections override the pipe ends in io.
+ *
+ * @param cmd Stage to launch
+ * @param io Pipe ends for the stage
+ * @return PID of the child, or -1 if it could not be launched
+ */
+pid_t launch_stage(command_node *cmd, const spawn_io *io)
+{
+    spawn_io stage_io = *io;
+    int in_fd = io->in_fd;
+    int out_fd = io->out_fd;
+    int err_fd = io->err_fd;
+    pid_t pid;
+
+    if (cmd->redirs != NULL)
+    {
+        in_fd = STDIN_FILENO;
+        out_fd = STDOUT_FILENO;
+        err_fd = STDERR_FILENO;
+        if (handle_redirection(cmd->redirs, &in_fd, &out_fd, &err_fd) < 0)
+        {
+            return -1;
+        }
+        if (in_fd != STDIN_FILENO)
+            stage_io.in_fd = in_fd;
+        if (out_fd != STDOUT_FILENO)
+            stage_io.out_fd = out_fd;
+        if (err_fd != STDERR_FILENO)
+            stage_io.err_fd = err_fd;
+    }
+
+    if (cmd->argc > 0 && !is_shell_command(cmd))
+    {
+        pid = spawn_process(cmd->argv, &stage_io);
+    }
+    else
+    {
+        fflush(stdout);
+        pid = fork();
+
+        if (pid < 0)
+        {
+            perror("fork failed");
+        }
+        else if (pid == 0)
+        {
+            // Child process: wire the stage, run it, report its status
+            child_enter_group(&stage_io);
+            job_control = 0;
+            trace_active = 0;
+            zygote_detach();
+            if (stage_io.in_fd != STDIN_FILENO)
+            {
+                dup2(stage_io.in_fd, STDIN_FILENO);
+            }
+            if (stage_io.out_fd != STDOUT_FILENO)
+            {
+                dup2(stage_io.out_fd, STDOUT_FILENO);
+            }
+            if (stage_io.err_fd != STDERR_FILENO)
+            {
+                dup2(stage_io.err_fd, STDERR_FILENO);
+            }
+            if (child_setup(&stage_io) < 0)
+                _exit(126);
+
+            int status = cmd->argc > 0 ? run_shell_command(cmd) : 0;
+            fflush(stdout);
+            _exit(status);
+        }
+        else if (stage_io.pgid >= 0)
+        {
+            setpgid(pid, stage_io.pgid ? stage_io.pgid : pid);
+        }
+    }
+
+    // Redirection targets opened here belong to the child now
+    if (stage_io.in_fd != io->in_fd)
+        close(stage_io.in_fd);
+    if (stage_io.out_fd != io->out_fd)
+        close(stage_io.out_fd);
+    if (stage_io.err_fd != io->err_fd)
+        close(stage_io.err_fd);
+
+    return pid;
+}
+
+/**
+ * Function to map a backend name to its SPAWN_BACKEND_* value
+ *
+ * @param name Backend name ("fork" or "spawn")
+ * @return Backend constant, or -1 if the name is unknown
+ */
+int spawn_backend_from_name(const char *name)
+{
+    if (strcmp(name, "fork") == 0)
+        return SPAWN_BACKEND_FORK;
+    if (strcmp(name, "spawn") == 0)
+        return SPAWN_BACKEND_SPAWN;
+    if (strcmp(name, "zygote") == 0)
+        return SPAWN_BACKEND_ZYGOTE;
+    return -1;
+}
+
+/**
+ * Function to get the printable name of a backend
+ *
+ * @param backend SPAWN_BACKEND_* value
+ * @return Backend name
+ */
+const char *spawn_backend_name(int backend)
+{
+    return backend == SPAWN_BACKEND_FORK ? "fork" : backend == SPAWN_BACKEND_ZYGOTE ? "zygote" : "spawn";
+}
+// SECTION ENDS: "PROCESS SPAWNING"
+
+// SECTION STARTS: "ZYGOTE"
+/**
+ * Function to start the zygote: a helper forked while the shell is still
+ * small, which launches commands on the shell's behalf. Its children are
+ * created with CLONE_PARENT, so they are the shell's own children and are
+ * waited for exactly like the other backends' children.
+ *
+ * @return 0 on success, -1 on error
+ */
+int zygote_start()
+{
+    int sv[2];
+
+    if (zygote_fd >= 0)
+        return 0;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_fd = sv[0];
+    zygote_pid = pid;
+    return 0;
+}
+
+/**
+ * Function run by the zygote: receive a request, clone, exec, reply
+ * with the PID. Exits when the shell closes its end of the socket.
+ *
+ * @param fd Zygote's end of the socket
+ */
+void zygote_main(int fd)
+{
+    static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+    int inherited_ignore[5];
+    char *buf = (char *)malloc(ZYGOTE_MESSAGE_SIZE);
+    char *args[ZYGOTE_MAX_ARGS + 1];
+
+    // The clones must start with the signals the shell blocks unblocked
+    event_detach();
+
+    // Keep nothing of the shell's open files (pipes in particular would
+    // never see EOF) except the socket, moved to fd 3
+    if (fd != 3)
+    {
+        dup3(fd, 3, O_CLOEXEC);
+        fd = 3;
+    }
+    close_range(4, ~0U, 0);
+
+    // Remember what the shell's children inherit, then keep terminal
+    // signals from killing or stopping the zygote itself
+    for (int i = 0; i < 5; i++)
+    {
+        inherited_ignore[i] = signal(job_signals[i], SIG_IGN) == SIG_IGN && !job_control;
+    }
+
+    while (buf != NULL)
+    {
+        union {
+            char space[CMSG_SPACE(3 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {buf, ZYGOTE_MESSAGE_SIZE - 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // The shell has gone
+
+        // Three descriptors: the command's stdin, stdout and stderr
+        int fds[3] = {-1, -1, -1};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        // Header, then path and argv as consecutive strings
+        zygote_request req;
+        int result = -EINVAL;
+        buf[n] = '\0';
+        if ((size_t)n >= sizeof(req) && fds[2] >= 0)
+        {
+            memcpy(&req, buf, sizeof(req));
+            char *p = buf + sizeof(req);
+            char *path = p;
+            for (int i = 0; i < req.argc && i < ZYGOTE_MAX_ARGS; i++)
+            {
+                p += strlen(p) + 1;
+                args[i] = p;
+            }
+            args[req.argc] = NULL;
+
+            pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0);
+            if (pid == 0)
+            {
+                if (req.pgid >= 0)
+                    setpgid(0, req.pgid);
+                for (int i = 0; i < 5; i++)
+                    signal(job_signals[i], inherited_ignore[i] ? SIG_IGN : SIG_DFL);
+
+                dup2(fds[0], STDIN_FILENO);
+                dup2(fds[1], STDOUT_FILENO);
+                dup2(fds[2], STDERR_FILENO);
+                execv(path, args);
+
+                perror("execv failed");
+                _exit(EXIT_FAILURE);
+            }
+            result = pid > 0 ? pid : -errno;
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        send(fd, &result, sizeof(result), MSG_NOSIGNAL);
+    }
+
+    _exit(0);
+}
+
+/**
+ * Function to launch a command through the zygote
+ *
+ * @param path Resolved program path
+ * @param args Argument vector
+ * @param io Streams and process group for the command
+ * @return PID of the command, or -1 if the zygote could not launch it
+ *         (the caller then falls back to posix_spawn())
+ */
+pid_t zygote_spawn(const char *path, char **args, const spawn_io *io)
+{
+    char buf[ZYGOTE_MESSAGE_SIZE];
+    zygote_request req;
+    size_t len = sizeof(req);
+
+    if (zygote_fd < 0 && zygote_start() < 0)
+        return -1;
+
+    req.pgid = io->pgid;
+    req.argc = 0;
+
+    // Pack the path and argv after the header; oversized commands fall back
+    const char *strings = path;
+    for (int i = -1; strings != NULL; strings = args[++i])
+    {
+        size_t n = strlen(strings) + 1;
+        if (len + n >= sizeof(buf) || req.argc >= ZYGOTE_MAX_ARGS)
+            return -1;
+        memcpy(buf + len, strings, n);
+        len += n;
+        if (i >= 0)
+            req.argc++;
+    }
+    memcpy(buf, &req, sizeof(req));
+
+    // The command's streams travel with the request
+    int fds[3] = {io->in_fd, io->out_fd, io->err_fd};
+    union {
+        char space[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int result;
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n > 0)
+    {
+        while ((n = recv(zygote_fd, &result, sizeof(result), 0)) < 0 && errno == EINTR)
+            ;
+    }
+
+    if (n != sizeof(result))
+    {
+        // The zygote died: start a new one next time
+        zygote_stop();
+        return -1;
+    }
+    if (result < 0)
+    {
+        errno = -result;
+        return -1;
+    }
+
+    // Also set the group from this side so it exists before we use it
+    if (io->pgid >= 0)
+        setpgid(result, io->pgid ? io->pgid : result);
+    return result;
+}
+
+/**
+ * Function to stop the zygote
+ */
+void zygote_stop()
+{
+    if (zygote_fd < 0)
+        return;
+
+    close(zygote_fd);
+    while (waitpid(zygote_pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    zygote_fd = -1;
+    zygote_pid = 0;
+}
+
+/**
+ * Function to let go of the zygote in a forked subshell. Its children
+ * would belong to the top-level shell, which the subshell cannot wait
+ * for, so the subshell uses posix_spawn() instead.
+ */
+void zygote_detach()
+{
+    if (zygote_fd < 0)
+        return;
+
+    close(zygote_fd);
+    zygote_fd = -1;
+    zygote_pid = 0;
+}
+// SECTION ENDS: "ZYGOTE"
+
+// SECTION STARTS: "COMMAND HASH TABLE"
+/**
+ * Function to hash a command name (FNV-1a)
+ *
+ * @param name Command name
+ * @return Bucket index into command_hash
+ */
+unsigned int hash_bucket(const char *name)
+{
+    unsigned int h = 2166136261u;
+
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+
+    return h & (HASH_BUCKETS - 1);
+}
+
+/**
+ * Function to drop every cached entry (the directory list is kept)
+ */
+void hash_clear()
+{
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+        hash_entry *entry = command_hash[i];
+        while (entry)
+        {
+            hash_entry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        command_hash[i] = NULL;
+    }
+}
+
+/**
+ * Function to make sure the cache was built for the current $PATH.
+ * When $PATH changed, the table is flushed and the directory list rebuilt.
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+int hash_sync_path()
+{
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = DEFAULT_PATH;
+
+    if (hash_path_value != NULL && strcmp(hash_path_value, path) == 0)
+        return 0;
+
+    // $PATH changed (or first use): start over
+    hash_clear();
+    for (int i = 0; i < hash_dir_count; i++)
+        free(hash_dirs[i].dir);
+    free(hash_dirs);
+    free(hash_path_value);
+    hash_dirs = NULL;
+    hash_dir_count = 0;
+
+    hash_path_value = strdup(path);
+    if (!hash_path_value)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    // One slot per ':' separated element
+    int slots = 1;
+    for (const char *c = path; *c; c++)
+    {
+        if (*c == ':')
+            slots++;
+    }
+
+    hash_dirs = (hash_dir *)calloc(slots, sizeof(hash_dir));
+    if (!hash_dirs)
+    {
+        perror("Memory allocation failed");
+        free(hash_path_value);
+        hash_path_value = NULL;
+        return -1;
+    }
+
+    const char *start = path;
+    while (1)
+    {
+        const char *end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+
+        // An empty element means the current directory
+        hash_dirs[hash_dir_count].dir = len ? strndup(start, len) : strdup(".");
+        if (hash_dirs[hash_dir_count].dir)
+            hash_dir_count++;
+
+        if (!end)
+            break;
+        start = end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to check whether a $PATH directory changed since it was scanned
+ *
+ * @param index Index into hash_dirs
+ * @return 1 if the directory's mtime still matches, 0 otherwise
+ */
+int hash_dir_unchanged(int index)
+{
+    struct stat st;
+
+    if (stat(hash_dirs[index].dir, &st) < 0)
+        return 0;
+
+    return st.st_mtim.tv_sec == hash_dirs[index].mtime.tv_sec &&
+           st.st_mtim.tv_nsec == hash_dirs[index].mtime.tv_nsec;
+}
+
+/**
+ * Function to drop every cached entry that came from one directory
+ *
+ * @param index Index into hash_dirs
+ */
+void hash_forget_dir(int index)
+{
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+        hash_entry **link = &command_hash[i];
+        while (*link)
+        {
+            hash_entry *entry = *link;
+            if (entry->dir_index == index)
+            {
+                *link = entry->next;
+                free(entry->name);
+                free(entry->path);
+                free(entry);
+            }
+            else
+            {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/**
+ * Function to resolve a command name to the path that will be executed.
+ * Names containing '/' are used as-is. Other names are served from the
+ * cache when the directory they were found in has not changed, otherwise
+ * $PATH is walked once and the result cached.
+ *
+ * @param name Command name
+ * @return Path to execute, or NULL if the command was not found
+ */
+const char *hash_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    if (hash_sync_path() < 0)
+        return NULL;
+
+    unsigned int bucket = hash_bucket(name);
+
+    // Cache hit: trust it as long as its directory is unchanged
+    for (hash_entry *entry = command_hash[bucket]; entry; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            if (hash_dir_unchanged(entry->dir_index))
+            {
+                entry->hits++;
+                return entry->path;
+            }
+
+            // Binaries were added or removed there; rescan
+            hash_forget_dir(entry->dir_index);
+            break;
+        }
+    }
+
+    // Cache miss: walk $PATH in order
+    char candidate[PATH_MAX];
+    struct stat st;
+
+    for (int i = 0; i < hash_dir_count; i++)
+    {
+        int len = snprintf(candidate, sizeof(candidate), "%s/%s", hash_dirs[i].dir, name);
+        if (len < 0 || (size_t)len >= sizeof(candidate))
+            continue;
+
+        if (stat(candidate, &st) < 0 || !S_ISREG(st.st_mode) || access(candidate, X_OK) < 0)
+            continue;
+
+        // Remember the directory's current mtime for later validation.
+        // Entries cached under an older mtime go first: the new one would
+        // otherwise vouch for them without their being checked again.
+        struct stat dir_st;
+        if (stat(hash_dirs[i].dir, &dir_st) == 0)
+        {
+            if (dir_st.st_mtim.tv_sec != hash_dirs[i].mtime.tv_sec ||
+                dir_st.st_mtim.tv_nsec != hash_dirs[i].mtime.tv_nsec)
+                hash_forget_dir(i);
+            hash_dirs[i].mtime = dir_st.st_mtim;
+        }
+
+        hash_entry *entry = (hash_entry *)malloc(sizeof(hash_entry));
+        if (!entry)
+        {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+
+        entry->name = strdup(name);
+        entry->path = strdup(candidate);
+        if (!entry->name || !entry->path)
+        {
+            perror("Memory allocation failed");
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return NULL;
+        }
+
+        entry->dir_index = i;
+        entry->hits = 1;
+        entry->next = command_hash[bucket];
+        command_hash[bucket] = entry;
+        return entry->path;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function to handle the hash builtin
+ * "hash" lists the cache, "hash -r" clears it, "hash name..." primes it
+ *
+ * @param args Command and its arguments
+ * @return Exit status (0 on success)
+ */
+int hash_command(char **args)
+{
+    if (args[1] == NULL)
+    {
+        int shown = 0;
+
+        for (int i = 0; i < HASH_BUCKETS; i++)
+        {
+            for (hash_entry *entry = command_hash[i]; entry; entry = entry->next)
+            {
+                if (shown++ == 0)
+                    printf("hits\tcommand\n");
+                printf("%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+
+        if (shown == 0)
+            printf("hash: hash table empty\n");
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0)
+    {
+        hash_clear();
+        return 0;
+    }
+
+    int status = 0;
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (hash_lookup(args[i]) == NULL)
+        {
+            fprintf(stderr, "w25shell: hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+// SECTION ENDS: "COMMAND HASH TABLE"
+
+// SECTION STARTS: "PIPE CAPACITY"
+/**
+ * Function to parse a size such as "65536", "512K" or "16M"
+ *
+ * @param text Size text
+ * @return Size in bytes, or -1 if text is not a size
+ */
+long parse_size(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || value < 0)
+        return -1;
+    if (*end == 'K' || *end == 'k')
+        value <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        value <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        value <<= 30, end++;
+
+    return *end == '\0' ? value : -1;
+}
+
+/**
+ * Function to create a pipeline pipe (close-on-exec) with the requested
+ * capacity. Sizes above /proc/sys/fs/pipe-max-size are clamped to it; if
+ * the kernel still refuses (per-user pipe limits), the default is kept.
+ *
+ * @param fds Output read and write ends
+ * @param size Capacity in bytes, 0 for pipe_size
+ * @return 0 on success, -1 on error
+ */
+int pipeline_pipe(int fds[2], long size)
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+
+    if (size <= 0)
+        size = pipe_size;
+    if (size <= 0)
+        return 0;
+
+    if (pipe_max_size == 0)
+    {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+        if (f == NULL || fscanf(f, "%ld", &pipe_max_size) != 1)
+            pipe_max_size = 1 << 20;
+        if (f)
+            fclose(f);
+    }
+
+    fcntl(fds[1], F_SETPIPE_SZ, size < pipe_max_size ? size : pipe_max_size);
+    return 0;
+}
+// SECTION ENDS: "PIPE CAPACITY"
+
+// SECTION STARTS: "FORWARD PIPING"
+/**
+ * Function to execute piped commands
+ *
+ * @param stages Commands of the pipeline in source order
+ * @param count Number of commands
+ * @param sizes sizes[i]: capacity of the pipe after stages[i] (0 or NULL = pipe_size)
+ * @return Exit status of the last command
+ */
+int execute_piped_commands(command_node **stages, int count, const long *sizes)
+{
+    int i;
+    int pipefd[2 * (count - 1)];
+    pid_t pids[count];
+
+    // Stages like grep/head/wc run on threads when possible
+    if (pipeline_has_filters(stages, count))
+    {
+        return execute_filter_pipeline(stages, count, sizes);
+    }
+
+    // Create all required pipes; close-on-exec keeps unrelated ends out of
+    // every child, so the spawn layer only has to install stdin/stdout
+    for (i = 0; i < count - 1; i++)
+    {
+        if (pipeline_pipe(pipefd + 2 * i, sizes ? sizes[i] : 0) < 0)
+        {
+            perror("pipe failed");
+            for (int j = 0; j < 2 * i; j++)
+            {
+                close(pipefd[j]);
+            }
+            return 1;
+        }
+    }
+
+    // Execute each command in the pipeline, all in one process group
+    pid_t pgid = 0;
+    timing_start();
+    for (i = 0; i < count; i++)
+    {
+        spawn_io io;
+        spawn_io_init(&io);
+        io.cpu = sched_stage_cpu(i);
+        io.pgid = job_control ? pgid : -1;
+
+        // Set up input (read from previous pipe)
+        if (i > 0)
+        {
+            io.in_fd = pipefd[(i - 1) * 2];
+        }
+
+        // Set up output (write to next pipe)
+        if (i < count - 1)
+        {
+            io.out_fd = pipefd[i * 2 + 1];
+        }
+
+        pids[i] = launch_stage(stages[i], &io);
+        if (pgid == 0 && pids[i] > 0)
+            pgid = pids[i];
+    }
+
+    // Parent process closes all pipe file descriptors
+    for (i = 0; i < 2 * (count - 1); i++)
+    {
+        close(pipefd[i]);
+    }
+
+    // Wait for every stage; the pipeline's status is the last stage's
+    return wait_foreground(pids, count, count - 1, job_control ? pgid : 0, stages, 0);
+}
+// SECTION ENDS: "FORWARD PIPING"
+
+// SECTION STARTS: "REVERSE PIPING"
+/**
+ * Function to execute reverse piped commands
+ *
+ * @param stages Commands of the pipeline in source order
+ * @param count Number of commands
+ * @param sizes sizes[i]: capacity of the pipe after stages[i] (0 or NULL = pipe_size)
+ * @return Exit status of the first (data-wise last) command
+ */
+int execute_reverse_piped_commands(command_node **stages, int count, const long *sizes)
+{
+    int i;
+    int pipefd[2 * (count - 1)];
+    pid_t pids[count];
+
+    // In-process filters take the stages in data-flow order
+    if (pipeline_has_filters(stages, count))
+    {
+        command_node *ordered[count];
+        long ordered_sizes[count];
+        for (i = 0; i < count; i++)
+        {
+            ordered[i] = stages[count - 1 - i];
+            ordered_sizes[i] = sizes && i < count - 1 ? sizes[count - 2 - i] : 0;
+        }
+        return execute_filter_pipeline(ordered, count, ordered_sizes);
+    }
+
+    // Create all required pipes (close-on-exec, see execute_piped_commands)
+    for (i = 0; i < count - 1; i++)
+    {
+        if (pipeline_pipe(pipefd + 2 * i, sizes ? sizes[i] : 0) < 0)
+        {
+            perror("pipe failed");
+            for (int j = 0; j < 2 * i; j++)
+            {
+                close(pipefd[j]);
+            }
+            return 1;
+        }
+    }
+
+    // Execute commands in reverse order, all in one process group
+    pid_t pgid = 0;
+    timing_start();
+    for (i = count - 1; i >= 0; i--)
+    {
+        spawn_io io;
+        spawn_io_init(&io);
+        io.cpu = sched_stage_cpu(i);
+        io.pgid = job_control ? pgid : -1;
+
+        // Set up input (read from previous pipe)
+        if (i < count - 1)
+        {
+            io.in_fd = pipefd[i * 2];
+        }
+
+        // Set up output (write to next pipe)
+        if (i > 0)
+        {
+            io.out_fd = pipefd[(i - 1) * 2 + 1];
+        }
+
+        pids[i] = launch_stage(stages[i], &io);
+        if (pgid == 0 && pids[i] > 0)
+            pgid = pids[i];
+    }
+
+    // Parent process closes all pipe file descriptors
+    for (i = 0; i < 2 * (count - 1); i++)
+    {
+        close(pipefd[i]);
+    }
+
+    // Wait for every stage; data ends at the leftmost command
+    return wait_foreground(pids, count, 0, job_control ? pgid : 0, stages, 1);
+}
+// SECTION ENDS: "REVERSE PIPING"
+
+// SECTION STARTS: "RING BUFFERS"
+/**
+ * Function to sleep until *word no longer holds observed. Spins briefly
+ * first since the other side of a ring is usually just a few copies away.
+ *
+ * @param word Futex word (a sequence counter bumped by the other side)
+ * @param observed Value seen before deciding to wait
+ * @param waiters Counter telling the other side a wake-up is needed
+ */
+void ring_wait(uint32_t *word, uint32_t observed, uint32_t *waiters)
+{
+    for (int spin = 0; spin < RING_SPIN; spin++)
+    {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != observed)
+            return;
+#if defined(__x86_64__)
+        _mm_pause();
+#endif
+    }
+
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == observed)
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, observed, NULL, NULL, 0);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Function to publish progress on one side of a ring and wake the other
+ * side only if it is actually asleep
+ *
+ * @param word Futex word to bump
+ * @param waiters Number of threads sleeping on word
+ */
+void ring_notify(uint32_t *word, uint32_t *waiters)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Function to create an empty ring
+ *
+ * @return New ring, or NULL on allocation failure
+ */
+spsc_ring *ring_create()
+{
+    spsc_ring *ring = (spsc_ring *)calloc(1, sizeof(spsc_ring));
+    if (!ring)
+        return NULL;
+
+    ring->data = (char *)malloc(RING_CAPACITY);
+    if (!ring->data)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/**
+ * Function to free a ring once both of its threads have finished
+ *
+ * @param ring Ring to free
+ */
+void ring_destroy(spsc_ring *ring)
+{
+    if (ring)
+    {
+        free(ring->data);
+        free(ring);
+    }
+}
+
+/**
+ * Function to copy bytes into a ring, blocking while it is full
+ *
+ * @param ring Ring written by the calling (only) producer
+ * @param buf Bytes to write
+ * @param len Number of bytes
+ * @return 0 on success, -1 if the consumer has gone away
+ */
+int ring_write(spsc_ring *ring, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        uint32_t observed = __atomic_load_n(&ring->space_seq, __ATOMIC_ACQUIRE);
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t space = RING_CAPACITY - (head - tail);
+
+        if (__atomic_load_n(&ring->reader_gone, __ATOMIC_ACQUIRE))
+            return -1;
+
+        if (space == 0)
+        {
+            ring_wait(&ring->space_seq, observed, &ring->space_waiters);
+            continue;
+        }
+
+        // Copy in at most two pieces around the wrap point
+        size_t n = len < space ? len : space;
+        size_t offset = head & (RING_CAPACITY - 1);
+        size_t first = n < RING_CAPACITY - offset ? n : RING_CAPACITY - offset;
+
+        memcpy(ring->data + offset, buf, first);
+        memcpy(ring->data, buf + first, n - first);
+
+        __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+        ring_notify(&ring->data_seq, &ring->data_waiters);
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to copy bytes out of a ring, blocking while it is empty
+ *
+ * @param ring Ring read by the calling (only) consumer
+ * @param buf Destination
+ * @param len Capacity of buf
+ * @return Bytes read, 0 once the producer closed and the ring is drained
+ */
+size_t ring_read(spsc_ring *ring, char *buf, size_t len)
+{
+    while (1)
+    {
+        uint32_t observed = __atomic_load_n(&ring->data_seq, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t avail = head - tail;
+
+        if (avail == 0)
+        {
+            // Check closed only after seeing the ring empty
+            if (__atomic_load_n(&ring->writer_done, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+                return 0;
+
+            ring_wait(&ring->data_seq, observed, &ring->data_waiters);
+            continue;
+        }
+
+        size_t n = len < avail ? len : avail;
+        size_t offset = tail & (RING_CAPACITY - 1);
+        size_t first = n < RING_CAPACITY - offset ? n : RING_CAPACITY - offset;
+
+        memcpy(buf, ring->data + offset, first);
+        memcpy(buf + first, ring->data, n - first);
+
+        __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+        ring_notify(&ring->space_seq, &ring->space_waiters);
+        return n;
+    }
+}
+
+/**
+ * Function to mark the producer side finished (EOF for the consumer)
+ *
+ * @param ring Ring to close
+ */
+void ring_close_write(spsc_ring *ring)
+{
+    __atomic_store_n(&ring->writer_done, 1, __ATOMIC_RELEASE);
+    ring_notify(&ring->data_seq, &ring->data_waiters);
+}
+
+/**
+ * Function to mark the consumer side finished; the producer's next write
+ * fails the way a write to a pipe without readers does
+ *
+ * @param ring Ring to close
+ */
+void ring_close_read(spsc_ring *ring)
+{
+    __atomic_store_n(&ring->reader_gone, 1, __ATOMIC_RELEASE);
+    ring_notify(&ring->space_seq, &ring->space_waiters);
+}
+// SECTION ENDS: "RING BUFFERS"
+
+// SECTION STARTS: "IN-PROCESS FILTERS"
+/**
+ * Function to parse a "-n N", "-nN" or "-N" line count for head/tail
+ *
+ * @param args Arguments after the command name
+ * @param count Output line count
+ * @return 1 if the arguments are understood, 0 otherwise
+ */
+int filter_parse_lines(char **args, long *count)
+{
+    *count = 10;
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        char *value;
+
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+            value = args[++i];
+        else if (strncmp(args[i], "-n", 2) == 0)
+            value = args[i] + 2;
+        else if (args[i][0] == '-' && args[i][1] >= '0' && args[i][1] <= '9')
+            value = args[i] + 1;
+        else
+            return 0; // File operands and other options: leave to the real tool
+
+        char *end;
+        *count = strtol(value, &end, 10);
+        if (*value < '0' || *value > '9' || *end != '\0')
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Function to decide whether a stage can run as an in-process filter and
+ * fill in its options. Only the option subsets implemented here qualify;
+ * everything else keeps running the real program.
+ *
+ * @param cmd Pipeline stage
+ * @param fs Filter to fill in
+ * @return FILTER_* kind, FILTER_NONE if the stage must be exec'ed
+ */
+int filter_parse(command_node *cmd, filter_stage *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->cmd = cmd;
+    fs->in_fd = -1;
+    fs->out_fd = -1;
+    fs->done_fd = -1;
+
+    if (!inprocess_filters || cmd->kind != CMD_EXEC || cmd->argc == 0)
+        return FILTER_NONE;
+
+    // A thread can be neither killed at a deadline nor limited on its own
+    if (deadline_at > 0 || limit_count > 0)
+        return FILTER_NONE;
+
+    // Filter threads share the shell's stderr, so 2> needs a real process
+    for (redirection *r = cmd->redirs; r != NULL; r = r->next)
+    {
+        if (r->kind == REDIR_ERR || r->kind == REDIR_ERR_APPEND)
+            return FILTER_NONE;
+    }
+
+    char *name = cmd->argv[0];
+    char **args = cmd->argv + 1;
+
+    if (strcmp(name, "cat") == 0)
+    {
+        // Plain concatenation only; "-" means the stage input
+        for (int i = 0; args[i] != NULL; i++)
+        {
+            if (args[i][0] == '-' && args[i][1] != '\0')
+                return FILTER_NONE;
+        }
+        fs->files = args;
+        fs->file_count = cmd->argc - 1;
+        return fs->kind = FILTER_CAT;
+    }
+
+    if (strcmp(name, "head") == 0 || strcmp(name, "tail") == 0)
+    {
+        if (!filter_parse_lines(args, &fs->count))
+            return FILTER_NONE;
+        return fs->kind = name[0] == 'h' ? FILTER_HEAD : FILTER_TAIL;
+    }
+
+    if (strcmp(name, "wc") == 0)
+    {
+        // Standard input only: file operands change the output format.
+        // Words are left to the real wc, whose count follows the locale
+        // (multibyte and non-printable characters); lines and bytes are
+        // the same in every locale.
+        for (int i = 0; args[i] != NULL; i++)
+        {
+            if (args[i][0] != '-' || args[i][1] == '\0')
+                return FILTER_NONE;
+            for (char *c = args[i] + 1; *c; c++)
+            {
+                if (*c == 'l')
+                    fs->wc_flags |= WC_LINES;
+                else if (*c == 'c')
+                    fs->wc_flags |= WC_BYTES;
+                else
+                    return FILTER_NONE;
+            }
+        }
+        if (fs->wc_flags == 0)
+            return FILTER_NONE;
+        return fs->kind = FILTER_WC;
+    }
+
+    if (strcmp(name, "grep") == 0)
+    {
+        int fixed = 0;
+        int i = 0;
+
+        for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+        {
+            if (strcmp(args[i], "--") == 0)
+            {
+                i++;
+                break;
+            }
+            for (char *c = args[i] + 1; *c; c++)
+            {
+                if (*c == 'F')
+                    fixed = 1;
+                else if (*c == 'v')
+                    fs->grep_invert = 1;
+                else if (*c == 'c')
+                    fs->grep_count = 1;
+                else
+                    return FILTER_NONE;
+            }
+        }
+
+        // One pattern and at most one file (more files add name prefixes)
+        if (args[i] == NULL || (args[i + 1] != NULL && args[i + 2] != NULL))
+            return FILTER_NONE;
+
+        // Without -F the pattern is a regex; only plain strings qualify
+        if (!fixed && strpbrk(args[i], ".[]*^$\\+?(){}|") != NULL)
+            return FILTER_NONE;
+
+        // A newline makes grep search for several patterns
+        if (strchr(args[i], '\n') != NULL)
+            return FILTER_NONE;
+
+        fs->pattern = args[i];
+        fs->pattern_len = strlen(args[i]);
+        fs->files = args + i + 1;
+        fs->file_count = args[i + 1] != NULL && strcmp(args[i + 1], "-") != 0;
+        return fs->kind = FILTER_GREP;
+    }
+
+    if (strcmp(name, "tee") == 0)
+    {
+        // One file, optionally appended to
+        int i = args[0] != NULL && strcmp(args[0], "-a") == 0;
+        if (args[i] == NULL || args[i + 1] != NULL || args[i][0] == '-')
+            return FILTER_NONE;
+
+        fs->tee_append = i;
+        fs->files = args + i;
+        fs->file_count = 1;
+        return fs->kind = FILTER_TEE;
+    }
+
+    return FILTER_NONE;
+}
+
+/**
+ * Function to read from a filter source, either a ring or a descriptor
+ *
+ * @param fs Filter stage (a cancelled one reads end of input)
+ * @param fd Source descriptor (used when ring is NULL)
+ * @param ring Source ring, or NULL
+ * @param buf Destination
+ * @param len Capacity of buf
+ * @return Bytes read, 0 at end of input, -1 on error
+ */
+ssize_t filter_source_read(filter_stage *fs, int fd, spsc_ring *ring, char *buf, size_t len)
+{
+    while (!__atomic_load_n(&fs->cancelled, __ATOMIC_ACQUIRE))
+    {
+        if (ring)
+            return ring_read(ring, buf, len);
+
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to send a filter's buffered output downstream
+ *
+ * @param fs Filter stage
+ * @return 0 on success, -1 once the consumer has gone away
+ */
+int filter_flush(filter_stage *fs)
+{
+    size_t done = 0;
+
+    // Output of a cancelled stage is dropped, as if it had been killed
+    if (__atomic_load_n(&fs->cancelled, __ATOMIC_ACQUIRE))
+        fs->output_closed = 1;
+    if (fs->output_closed)
+        return -1;
+
+    if (fs->out_ring)
+    {
+        done = ring_write(fs->out_ring, fs->out_buf, fs->out_len) == 0 ? fs->out_len : 0;
+    }
+    else
+    {
+        while (done < fs->out_len)
+        {
+            ssize_t n = write(fs->out_fd, fs->out_buf + done, fs->out_len - done);
+            if (n < 0 && errno == EINTR && !__atomic_load_n(&fs->cancelled, __ATOMIC_ACQUIRE))
+                continue;
+            if (n < 0)
+                break;
+            done += n;
+        }
+    }
+
+    if (done < fs->out_len)
+    {
+        // Downstream is gone (EPIPE); stop producing like a SIGPIPE'd tool
+        fs->output_closed = 1;
+        fs->status = 141;
+        return -1;
+    }
+
+    fs->out_len = 0;
+    return 0;
+}
+
+/**
+ * Function to queue filter output, flushing when the buffer fills
+ *
+ * @param fs Filter stage
+ * @param data Bytes to emit
+ * @param len Number of bytes
+ * @return 0 on success, -1 once the consumer has gone away
+ */
+int filter_emit(filter_stage *fs, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (fs->out_len == FILTER_BUFFER_SIZE && filter_flush(fs) < 0)
+            return -1;
+
+        size_t n = FILTER_BUFFER_SIZE - fs->out_len;
+        if (n > len)
+            n = len;
+
+        memcpy(fs->out_buf + fs->out_len, data, n);
+        fs->out_len += n;
+        data += n;
+        len -= n;
+    }
+
+    return fs->output_closed ? -1 : 0;
+}
+
+/**
+ * Function to stop reading a filter's input early (head has enough lines)
+ * so the producer sees a closed pipe instead of blocking forever
+ *
+ * @param fs Filter stage
+ */
+void filter_close_input(filter_stage *fs)
+{
+    if (fs->in_ring)
+        ring_close_read(fs->in_ring);
+    else if (fs->close_in && fs->in_fd >= 0)
+        close(fs->in_fd);
+
+    fs->in_ring = NULL;
+    fs->close_in = 0;
+}
+
+/**
+ * Function to decide whether a cat source can bypass user space
+ *
+ * @param fs Filter stage
+ * @param fd Source descriptor
+ * @param ring Source ring (NULL when reading fd)
+ * @return COPY_SPLICE or COPY_RANGE, or -1 to copy through the buffer
+ */
+int filter_direct_method(filter_stage *fs, int fd, spsc_ring *ring)
+{
+    struct stat in_st;
+    struct stat out_st;
+
+    if (ring != NULL || fs->out_ring != NULL || fd < 0 || fs->out_fd < 0)
+        return -1;
+    if (fstat(fd, &in_st) < 0 || !S_ISREG(in_st.st_mode) || fstat(fs->out_fd, &out_st) < 0)
+        return -1;
+    if (S_ISFIFO(out_st.st_mode))
+        return COPY_SPLICE;
+    if (S_ISREG(out_st.st_mode))
+        return COPY_RANGE;
+    return -1;
+}
+
+/**
+ * Function to copy every source of a cat stage downstream
+ *
+ * @param fs Filter stage
+ * @param buf Scratch buffer of FILTER_BUFFER_SIZE bytes
+ */
+void filter_cat(filter_stage *fs, char *buf)
+{
+    int sources = fs->file_count > 0 ? fs->file_count : 1;
+
+    for (int i = 0; i < sources && !fs->output_closed; i++)
+    {
+        int fd = fs->in_fd;
+        spsc_ring *ring = fs->in_ring;
+
+        // "-" and the no-operand case read the stage's own input
+        if (fs->file_count > 0 && strcmp(fs->files[i], "-") != 0)
+        {
+            ring = NULL;
+            fd = open(fs->files[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                fprintf(stderr, "cat: %s: %s\n", fs->files[i], strerror(errno));
+                fs->status = 1;
+                continue;
+            }
+        }
+
+        // A file feeding a pipe or file goes through the kernel: splice() or
+        // copy_file_range(), never this thread's buffer
+        int method = filter_direct_method(fs, fd, ring);
+        if (method >= 0 && filter_flush(fs) == 0)
+        {
+            if (copy_fd_to_fd(fd, fs->out_fd, &method) < 0)
+            {
+                fs->output_closed = 1;
+                fs->status = 141;
+            }
+            if (fd != fs->in_fd)
+                close(fd);
+            continue;
+        }
+
+        ssize_t n;
+        while ((n = filter_source_read(fs, fd, ring, buf, FILTER_BUFFER_SIZE)) > 0)
+        {
+            if (filter_emit(fs, buf, n) < 0 || filter_flush(fs) < 0)
+                break;
+        }
+
+        if (fd != fs->in_fd)
+            close(fd);
+    }
+}
+
+/**
+ * Function to pass the first N lines of the input downstream
+ *
+ * @param fs Filter stage
+ * @param buf Scratch buffer of FILTER_BUFFER_SIZE bytes
+ */
+void filter_head(filter_stage *fs, char *buf)
+{
+    long remaining = fs->count;
+    ssize_t n;
+
+    while (remaining > 0 && (n = filter_source_read(fs, fs->in_fd, fs->in_ring, buf, FILTER_BUFFER_SIZE)) > 0)
+    {
+        // Find where the last wanted line ends inside this chunk
+        char *p = buf;
+        char *end = buf + n;
+        while (remaining > 0 && (p = memchr(p, '\n', end - p)) != NULL)
+        {
+            p++;
+            remaining--;
+        }
+
+        size_t len = remaining == 0 ? (size_t)(p - buf) : (size_t)n;
+        if (filter_emit(fs, buf, len) < 0 || filter_flush(fs) < 0)
+            break;
+    }
+
+    // Enough lines: let the producer find out now rather than at its end
+    filter_close_input(fs);
+}
+
+/**
+ * Function to find where the last N lines of a buffer start
+ *
+ * @param data Buffer
+ * @param len Bytes in data
+ * @param lines Number of trailing lines wanted
+ * @return Offset of the first byte to keep
+ */
+size_t filter_tail_start(const char *data, size_t len, long lines)
+{
+    size_t pos = len;
+
+    if (lines == 0)
+        return len;
+
+    // A trailing newline terminates the last line rather than starting one
+    if (pos > 0 && data[pos - 1] == '\n')
+        pos--;
+
+    while (pos > 0)
+    {
+        if (data[pos - 1] == '\n' && --lines == 0)
+            return pos;
+        pos--;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to pass the last N lines of the input downstream. Only a
+ * bounded window is kept: the buffer is trimmed to the last N lines
+ * whenever it grows past FILTER_TAIL_TRIM bytes.
+ *
+ * @param fs Filter stage
+ * @param buf Scratch buffer of FILTER_BUFFER_SIZE bytes
+ */
+void filter_tail(filter_stage *fs, char *buf)
+{
+    char *keep = NULL;
+    size_t keep_len = 0;
+    size_t keep_cap = 0;
+    ssize_t n;
+
+    while ((n = filter_source_read(fs, fs->in_fd, fs->in_ring, buf, FILTER_BUFFER_SIZE)) > 0)
+    {
+        if (keep_len + n > keep_cap)
+        {
+            size_t cap = keep_cap ? keep_cap * 2 : FILTER_BUFFER_SIZE;
+            while (cap < keep_len + n)
+                cap *= 2;
+
+            char *grown = (char *)realloc(keep, cap);
+            if (!grown)
+            {
+                perror("Memory allocation failed");
+                fs->status = 1;
+                free(keep);
+                return;
+            }
+            keep = grown;
+            keep_cap = cap;
+        }
+
+        memcpy(keep + keep_len, buf, n);
+        keep_len += n;
+
+        if (keep_len > FILTER_TAIL_TRIM)
+        {
+            size_t start = filter_tail_start(keep, keep_len, fs->count);
+            memmove(keep, keep + start, keep_len - start);
+            keep_len -= start;
+        }
+    }
+
+    size_t start = filter_tail_start(keep, keep_len, fs->count);
+    filter_emit(fs, keep + start, keep_len - start);
+    free(keep);
+}
+
+/**
+ * Function to count the lines and bytes of the input like wc
+ *
+ * @param fs Filter stage
+ * @param buf Scratch buffer of FILTER_BUFFER_SIZE bytes
+ */
+void filter_wc(filter_stage *fs, char *buf)
+{
+    word_counts counts;
+    int in_word = 0;
+    ssize_t n;
+
+    memset(&counts, 0, sizeof(counts));
+
+    while ((n = filter_source_read(fs, fs->in_fd, fs->in_ring, buf, FILTER_BUFFER_SIZE)) > 0)
+    {
+        count_block((const unsigned char *)buf, n, &in_word, &counts);
+    }
+
+    // Same layout as wc on standard input: a lone count is unpadded
+    char line[80];
+    int len = 0;
+    int fields = !!(fs->wc_flags & WC_LINES) + !!(fs->wc_flags & WC_BYTES);
+    int width = fields > 1 ? 7 : 0;
+    const char *sep = "";
+
+    if (fs->wc_flags & WC_LINES)
+    {
+        len += snprintf(line + len, sizeof(line) - len, "%s%*llu", sep, width, counts.lines);
+        sep = " ";
+    }
+    if (fs->wc_flags & WC_BYTES)
+    {
+        len += snprintf(line + len, sizeof(line) - len, "%s%*llu", sep, width, counts.bytes);
+    }
+    line[len++] = '\n';
+
+    filter_emit(fs, line, len);
+}
+
+/**
+ * Function to handle one complete line for grep
+ *
+ * @param fs Filter stage
+ * @param line Start of the line
+ * @param len Length without the newline
+ * @param matches Running count of selected lines
+ * @return 0 to continue, -1 once the consumer has gone away
+ */
+int filter_grep_line(filter_stage *fs, const char *line, size_t len, unsigned long long *matches)
+{
+    int found = fs->pattern_len == 0 || memmem(line, len, fs->pattern, fs->pattern_len) != NULL;
+
+    if (found == fs->grep_invert)
+        return 0;
+
+    (*matches)++;
+    if (fs->grep_count)
+        return 0;
+
+    if (filter_emit(fs, line, len) < 0 || filter_emit(fs, "\n", 1) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Function to run grep over a block of complete lines. The pattern is
+ * searched across the whole block rather than line by line, and only the
+ * lines around each hit are looked at; with -v the runs of lines between
+ * hits are passed on in one piece.
+ *
+ * @param fs Filter stage
+ * @param p Start of the block
+ * @param end One past the block's final newline
+ * @param matches Running count of selected lines
+ * @return 0 to continue, -1 once the consumer has gone away
+ */
+int filter_grep_block(filter_stage *fs, char *p, char *end, unsigned long long *matches)
+{
+    while (p < end)
+    {
+        char *hit = memmem(p, end - p, fs->pattern, fs->pattern_len);
+        char *line_start = end;
+        char *line_end = end;
+
+        if (hit != NULL)
+        {
+            line_start = memrchr(p, '\n', hit - p);
+            line_start = line_start ? line_start + 1 : p;
+            line_end = (char *)memchr(hit, '\n', end - hit) + 1;
+        }
+
+        if (fs->grep_invert)
+        {
+            // Every line before the hit is selected
+            if (fs->grep_count)
+            {
+                for (char *c = p; (c = memchr(c, '\n', line_start - c)) != NULL; c++)
+                    (*matches)++;
+            }
+            else if (line_start > p)
+            {
+                (*matches)++;
+                if (filter_emit(fs, p, line_start - p) < 0)
+                    return -1;
+            }
+        }
+        else if (hit != NULL)
+        {
+            (*matches)++;
+            if (!fs->grep_count && filter_emit(fs, line_start, line_end - line_start) < 0)
+                return -1;
+        }
+
+        p = line_end;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to select lines containing a fixed string like grep -F
+ *
+ * @param fs Filter stage
+ * @param buf Scratch buffer of FILTER_BUFFER_SIZE bytes
+ */
+void filter_grep(filter_stage *fs, char *buf)
+{
+    int fd = fs->in_fd;
+    spsc_ring *ring = fs->in_ring;
+    unsigned long long matches = 0;
+
+    if (fs->file_count > 0)
+    {
+        ring = NULL;
+        fd = open(fs->files[0], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "grep: %s: %s\n", fs->files[0], strerror(errno));
+            fs->status = 2;
+            return;
+        }
+    }
+
+    // Lines are assembled in a growable buffer: carried partial line + chunk
+    size_t cap = 2 * FILTER_BUFFER_SIZE;
+    size_t len = 0;
+    char *data = (char *)malloc(cap);
+    int stopped = 0;
+    ssize_t n;
+
+    while (data && !stopped && (n = filter_source_read(fs, fd, ring, buf, FILTER_BUFFER_SIZE)) > 0)
+    {
+        if (len + n > cap)
+        {
+            char *grown = (char *)realloc(data, cap * 2 > len + n ? cap * 2 : len + n);
+            if (!grown)
+                break;
+            data = grown;
+            cap = cap * 2 > len + n ? cap * 2 : len + n;
+        }
+        memcpy(data + len, buf, n);
+        len += n;
+
+        // Handle every complete line, carry the rest
+        char *last = memrchr(data, '\n', len);
+        if (last == NULL)
+            continue;
+
+        if (filter_grep_block(fs, data, last + 1, &matches) < 0)
+            stopped = 1;
+
+        len = data + len - (last + 1);
+        memmove(data, last + 1, len);
+
+        // Keep output flowing for slow producers
+        if (!stopped && filter_flush(fs) < 0)
+            stopped = 1;
+    }
+
+    // A last line without a newline still counts
+    if (data && !stopped && len > 0)
+        filter_grep_line(fs, data, len, &matches);
+
+    if (!data)
+    {
+        perror("Memory allocation failed");
+        fs->status = 2;
+    }
+    else if (fs->status == 0)
+    {
+        fs->status = matches > 0 ? 0 : 1;
+    }
+
+    if (fs->grep_count)
+    {
+        char line[32];
+        int count_len = snprintf(line, sizeof(line), "%llu\n", matches);
+        filter_emit(fs, line, count_len);
+    }
+
+    free(data);
+    if (fd != fs->in_fd)
+        close(fd);
+}
+
+/**
+ * Function to copy the input to a file and to the output. Between two
+ * pipes the data is duplicated with tee() and moved to the file with
+ * splice(), so it never enters user space; anywhere else it is copied.
+ *
+ * @param fs Filter stage
+ * @param buf Work buffer (FILTER_BUFFER_SIZE bytes)
+ */
+void filter_tee(filter_stage *fs, char *buf)
+{
+    struct stat in_st, out_st;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (fs->tee_append ? O_APPEND : O_TRUNC);
+    int file_fd = open(fs->files[0], flags, 0644);
+
+    if (file_fd < 0)
+    {
+        fprintf(stderr, "tee: %s: %s\n", fs->files[0], strerror(errno));
+        fs->status = 1;
+    }
+
+    int zero_copy = !fs->in_ring && !fs->out_ring && fstat(fs->in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode) &&
+                    fstat(fs->out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+
+    while (zero_copy)
+    {
+        ssize_t n = tee(fs->in_fd, fs->out_fd, RELAY_CHUNK, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EPIPE)
+        {
+            fs->output_closed = 1;
+            break;
+        }
+        if (n < 0)
+        {
+            zero_copy = 0; // Not spliceable after all: copy the rest
+            break;
+        }
+        if (n == 0)
+            break;
+
+        // Consume what was duplicated: into the file, or just drop it
+        while (n > 0)
+        {
+            ssize_t moved = file_fd >= 0 ? splice(fs->in_fd, NULL, file_fd, NULL, n, SPLICE_F_MOVE) : -1;
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved <= 0)
+            {
+                // No splice to this file (or no file): read and write instead
+                moved = read(fs->in_fd, buf, n < FILTER_BUFFER_SIZE ? n : FILTER_BUFFER_SIZE);
+                if (moved <= 0)
+                    break;
+                if (file_fd >= 0 && write(file_fd, buf, moved) != moved)
+                {
+                    fprintf(stderr, "tee: %s: %s\n", fs->files[0], strerror(errno));
+                    fs->status = 1;
+                    close(file_fd);
+                    file_fd = -1;
+                }
+            }
+            n -= moved;
+        }
+    }
+
+    if (!zero_copy && !fs->output_closed)
+    {
+        ssize_t n;
+        while ((n = filter_source_read(fs, fs->in_fd, fs->in_ring, buf, FILTER_BUFFER_SIZE)) > 0)
+        {
+            if (file_fd >= 0 && write(file_fd, buf, n) != n)
+            {
+                fprintf(stderr, "tee: %s: %s\n", fs->files[0], strerror(errno));
+                fs->status = 1;
+                close(file_fd);
+                file_fd = -1;
+            }
+            if (filter_emit(fs, buf, n) < 0)
+                break;
+        }
+    }
+
+    if (file_fd >= 0)
+        close(file_fd);
+}
+
+/**
+ * Thread body of an in-process filter stage
+ *
+ * @param arg The filter_stage
+ * @return NULL
+ */
+void *filter_thread(void *arg)
+{
+    filter_stage *fs = (filter_stage *)arg;
+    char *buf = (char *)malloc(FILTER_BUFFER_SIZE);
+
+    // Pin and tune this thread like a stage process (not when a failed
+    // launch runs it on the shell's own thread)
+    if (fs->kind != FILTER_NONE && (fs->cpu >= 0 || sched_tuned()))
+        sched_apply(fs->cpu);
+
+    // Under pstat the thread counts itself
+    if (pstat_active)
+        pstat_open(0, fs->pstat_fds);
+
+    fs->out_buf = (char *)malloc(FILTER_BUFFER_SIZE);
+
+    if (!buf || !fs->out_buf)
+    {
+        perror("Memory allocation failed");
+        fs->status = 1;
+    }
+    else if (fs->kind == FILTER_CAT)
+        filter_cat(fs, buf);
+    else if (fs->kind == FILTER_HEAD)
+        filter_head(fs, buf);
+    else if (fs->kind == FILTER_TAIL)
+        filter_tail(fs, buf);
+    else if (fs->kind == FILTER_WC)
+        filter_wc(fs, buf);
+    else if (fs->kind == FILTER_GREP)
+        filter_grep(fs, buf);
+    else if (fs->kind == FILTER_TEE)
+        filter_tee(fs, buf);
+
+    // Deliver what is left, then signal EOF downstream
+    if (fs->out_buf)
+        filter_flush(fs);
+
+    if (fs->out_ring)
+        ring_close_write(fs->out_ring);
+    else if (fs->close_out)
+        close(fs->out_fd);
+
+    filter_close_input(fs);
+
+    free(buf);
+    free(fs->out_buf);
+
+    if (timing_active || trace_active)
+    {
+        getrusage(RUSAGE_THREAD, &fs->usage);
+        fs->finished = monotonic_seconds();
+        fs->last_cpu = sched_getcpu();
+    }
+    if (pstat_active)
+        pstat_read(fs->pstat_fds, fs->pstat_values);
+    if (fs->done_fd >= 0)
+        eventfd_write(fs->done_fd, 1);
+    return NULL;
+}
+
+/**
+ * Function to catch FILTER_CANCEL_SIGNAL. It does nothing: being
+ * delivered without SA_RESTART is what interrupts the thread's call.
+ *
+ * @param sig Signal number (unused)
+ */
+void filter_cancel_handler(int sig)
+{
+    (void)sig;
+}
+
+/**
+ * Function to stop the filter threads of a pipeline: every ring is closed
+ * in both directions and each thread gets FILTER_CANCEL_SIGNAL, so the
+ * read() or write() it may be blocked in fails with EINTR. Repeated
+ * until the threads have ended, since one may enter a call just after
+ * the signal.
+ *
+ * @param filters Stages of the pipeline
+ * @param is_filter is_filter[i] == 1: stage i runs on its own thread
+ * @param rings rings[i]: ring after stage i, or NULL
+ * @param count Number of stages
+ */
+void filter_cancel(filter_stage *filters, const int *is_filter, spsc_ring **rings, int count)
+{
+    static int installed = 0;
+    if (!installed)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = filter_cancel_handler;
+        sigemptyset(&action.sa_mask);
+        sigaction(FILTER_CANCEL_SIGNAL, &action, NULL);
+        installed = 1;
+    }
+
+    // Flag every stage before any ring closes, or a consumer could take
+    // the closed ring for a normal end of input and print its result
+    for (int i = 0; i < count; i++)
+    {
+        if (is_filter[i] == 1)
+            __atomic_store_n(&filters[i].cancelled, 1, __ATOMIC_RELEASE);
+    }
+
+    for (int i = 0; i < count - 1; i++)
+    {
+        if (rings[i])
+        {
+            ring_close_read(rings[i]);
+            ring_close_write(rings[i]);
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (is_filter[i] == 1)
+            pthread_kill(filters[i].thread, FILTER_CANCEL_SIGNAL);
+    }
+}
+
+/**
+ * Function to wait for the filter threads of a pipeline inside the event
+ * loop. SIGINT and SIGTERM reach the external stages as usual and cancel
+ * the threads, which then end like killed processes: early and without
+ * printing anything more.
+ *
+ * @param filters Stages of the pipeline
+ * @param is_filter is_filter[i] == 1: stage i runs on its own thread
+ * @param rings rings[i]: ring after stage i, or NULL
+ * @param pids Processes of the external stages (<= 0 for the others)
+ * @param count Number of stages
+ * @param done_fd eventfd the threads bump when they end
+ * @return Signal that cancelled the pipeline, 0 if it ran to the end
+ */
+int filter_wait(filter_stage *filters, const int *is_filter, spsc_ring **rings, pid_t *pids, int count, int done_fd)
+{
+    int pending = 0;
+    for (int i = 0; i < count; i++)
+        pending += is_filter[i] == 1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_FILTERS;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, done_fd, &ev) < 0)
+        return 0;
+
+    int cancelled = 0;
+    while (pending > 0)
+    {
+        struct epoll_event events[EVENT_BATCH];
+        int n = epoll_wait(event_fd, events, EVENT_BATCH, cancelled ? FILTER_CANCEL_MS : -1);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 == EVENT_FILTERS)
+            {
+                eventfd_t ended;
+                if (eventfd_read(done_fd, &ended) == 0)
+                    pending -= (int)ended;
+            }
+            else if (events[i].data.u32 == EVENT_SIGNAL)
+            {
+                int seen = event_signals(pids, count, 0);
+                if (!cancelled && (seen & (EVENT_SAW_INT | EVENT_SAW_TERM)))
+                    cancelled = (seen & EVENT_SAW_TERM) ? SIGTERM : SIGINT;
+            }
+            else if (events[i].data.u32 == EVENT_TIMER)
+            {
+                uint64_t expirations;
+                if (read(event_timer, &expirations, sizeof(expirations)) < 0)
+                    continue;
+            }
+        }
+
+        if (cancelled && pending > 0)
+            filter_cancel(filters, is_filter, rings, count);
+    }
+
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, done_fd, NULL);
+    return cancelled;
+}
+
+/**
+ * Function to tell whether any stage of a pipeline can run in-process
+ *
+ * @param stages Pipeline stages
+ * @param count Number of stages
+ * @return 1 if at least one stage is an in-process filter
+ */
+int pipeline_has_filters(command_node **stages, int count)
+{
+    filter_stage probe;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (filter_parse(stages[i], &probe) != FILTER_NONE)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to run a pipeline in which some stages are in-process filters.
+ * Filters run on their own threads; two adjacent filters are joined by an
+ * SPSC ring, and a real pipe is only created where a filter borders an
+ * external program or a tee.
+ *
+ * @param stages Stages in data-flow order (first stage reads stdin)
+ * @param count Number of stages
+ * @param sizes sizes[i]: capacity of a pipe after stages[i] (0 or NULL = pipe_size)
+ * @return Exit status of the last stage
+ */
+int execute_filter_pipeline(command_node **stages, int count, const long *sizes)
+{
+    filter_stage filters[count];
+    int is_filter[count];
+    pid_t pids[count];
+    spsc_ring *rings[count];
+    int pipes[count][2];
+    int i;
+
+    // Classify every stage and pick the connector after it
+    for (i = 0; i < count; i++)
+    {
+        is_filter[i] = filter_parse(stages[i], &filters[i]) != FILTER_NONE;
+        pids[i] = -1;
+        rings[i] = NULL;
+        pipes[i][0] = pipes[i][1] = -1;
+    }
+
+    // tee relays between real pipes, so it never gets a ring
+    int failed = 0;
+    for (i = 0; i < count - 1 && !failed; i++)
+    {
+        if (is_filter[i] && is_filter[i + 1] && filters[i].kind != FILTER_TEE && filters[i + 1].kind != FILTER_TEE)
+            failed = (rings[i] = ring_create()) == NULL;
+        else
+            failed = pipeline_pipe(pipes[i], sizes ? sizes[i] : 0) < 0;
+    }
+
+    if (failed)
+    {
+        perror("pipe failed");
+        for (i = 0; i < count - 1; i++)
+        {
+            ring_destroy(rings[i]);
+            if (pipes[i][0] >= 0)
+            {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+        }
+        return 1;
+    }
+
+    // Anything printed by the shell so far must precede the filters' output
+    fflush(stdout);
+    timing_start();
+
+    // Launch external stages first, then hand the remaining ends to filters
+    for (i = 0; i < count; i++)
+    {
+        int in_fd = i > 0 ? pipes[i - 1][0] : STDIN_FILENO;
+        int out_fd = i < count - 1 ? pipes[i][1] : STDOUT_FILENO;
+        int cpu = sched_stage_cpu(i);
+
+        if (!is_filter[i])
+        {
+            spawn_io io;
+            spawn_io_init(&io);
+            if (in_fd >= 0)
+                io.in_fd = in_fd;
+            if (out_fd >= 0)
+                io.out_fd = out_fd;
+            io.cpu = cpu;
+
+            pids[i] = launch_stage(stages[i], &io);
+
+            // Those ends live on in the child only
+            if (i > 0 && pipes[i - 1][0] >= 0)
+                close(pipes[i - 1][0]);
+            if (i < count - 1 && pipes[i][1] >= 0)
+                close(pipes[i][1]);
+            continue;
+        }
+
+        filter_stage *fs = &filters[i];
+        fs->cpu = cpu;
+        fs->in_fd = in_fd;
+        fs->in_ring = i > 0 ? rings[i - 1] : NULL;
+        fs->close_in = i > 0 && in_fd >= 0;
+        fs->out_fd = out_fd;
+        fs->out_ring = i < count - 1 ? rings[i] : NULL;
+        fs->close_out = i < count - 1 && out_fd >= 0;
+
+        // Redirections replace the connector, which is closed right away
+        int redir_in = STDIN_FILENO;
+        int redir_out = STDOUT_FILENO;
+        int redir_err = STDERR_FILENO; // Never set: filter_parse() refuses 2>
+        if (handle_redirection(stages[i]->redirs, &redir_in, &redir_out, &redir_err) < 0)
+        {
+            fs->kind = FILTER_NONE;
+            fs->status = 1;
+        }
+        if (redir_in != STDIN_FILENO)
+        {
+            filter_close_input(fs);
+            fs->in_fd = redir_in;
+            fs->close_in = 1;
+        }
+        if (redir_out != STDOUT_FILENO)
+        {
+            if (fs->out_ring)
+                ring_close_write(fs->out_ring);
+            else if (fs->close_out)
+                close(fs->out_fd);
+            fs->out_ring = NULL;
+            fs->out_fd = redir_out;
+            fs->close_out = 1;
+        }
+    }
+
+    // With the event loop, the shell learns of each thread's end through
+    // an eventfd, so Ctrl+C and SIGTERM can be handled while they run
+    int done_fd = event_init() == 0 ? eventfd(0, EFD_CLOEXEC) : -1;
+    for (i = 0; i < count; i++)
+        filters[i].done_fd = is_filter[i] ? done_fd : -1;
+
+    // Filter threads must see EPIPE instead of taking the shell down with
+    // SIGPIPE; the blocked mask is inherited by the threads only
+    sigset_t pipe_mask, old_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, &old_mask);
+
+    for (i = 0; i < count; i++)
+    {
+        if (is_filter[i] && pthread_create(&filters[i].thread, NULL, filter_thread, &filters[i]) != 0)
+        {
+            // Could not start: behave like a stage that exited immediately
+            perror("Failed to start filter");
+            filters[i].kind = FILTER_NONE;
+            filters[i].status = 1;
+            filters[i].done_fd = -1;
+            filter_thread(&filters[i]);
+            is_filter[i] = -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    int cancelled = done_fd >= 0 ? filter_wait(filters, is_filter, rings, pids, count, done_fd) : 0;
+    int processes = 0;
+    for (i = 0; i < count; i++)
+        processes += pids[i] > 0;
+
+    // Collect every stage; the pipeline's status is the last stage's
+    int status = 127;
+    for (i = 0; i < count; i++)
+    {
+        int stage_status = 127;
+
+        if (is_filter[i] == 1)
+        {
+            pthread_join(filters[i].thread, NULL);
+            stage_status = filters[i].status;
+            if (timing_active)
+                timing_record(stages[i], NULL, filters[i].finished - pipeline_started, &filters[i].usage, 1,
+                              filters[i].last_cpu);
+            if (trace_active)
+                trace_record(stages[i], NULL, 0, stage_status, filters[i].finished - pipeline_started,
+                             &filters[i].usage);
+            if (pstat_active)
+                pstat_record_thread(stages[i], filters[i].pstat_values);
+        }
+        else if (is_filter[i] == -1)
+        {
+            stage_status = filters[i].status;
+        }
+        else if (pids[i] > 0)
+        {
+            // Shares the shell's group, so it is never suspended
+            stage_status = wait_foreground(&pids[i], 1, 0, 0, &stages[i], 0);
+        }
+
+        if (i == count - 1)
+            status = stage_status;
+    }
+
+    for (i = 0; i < count - 1; i++)
+        ring_destroy(rings[i]);
+    if (done_fd >= 0)
+        close(done_fd);
+
+    // Cancelled threads end the pipeline the way the signal would have;
+    // the newline after "^C" is already there if a process was killed
+    if (cancelled)
+    {
+        if (job_control && cancelled == SIGINT && processes == 0)
+            printf("\n");
+        status = 128 + cancelled;
+    }
+
+    return status;
+}
+// SECTION ENDS: "IN-PROCESS FILTERS"
+
+// SECTION STARTS: "JOB CONTROL"
+/**
+ * Function to take over the terminal when the shell is interactive: the
+ * shell leads its own process group, owns the terminal between jobs and
+ * ignores the keyboard signals meant for the foreground job
+ */
+void job_control_init()
+{
+    // Changing the terminal's group from a background group raises SIGTTOU
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid)
+        setpgid(0, shell_pgid);
+
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0)
+    {
+        signal(SIGTTOU, SIG_DFL);
+        return;
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    job_control = 1;
+}
+
+/**
+ * Function to prepare a freshly forked child: leave the event loop, join
+ * the process group chosen in io and restore the signals the interactive
+ * shell ignores
+ *
+ * @param io Stream wiring of the child (only pgid is used)
+ */
+void child_enter_group(const spawn_io *io)
+{
+    event_detach();
+
+    if (io->pgid >= 0)
+        setpgid(0, io->pgid);
+
+    if (job_control)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+}
+
+/**
+ * Function to print a pipeline the way it was typed (for jobs and fg)
+ *
+ * @param out Stream to print to
+ * @param stages Stages in source order
+ * @param count Number of stages
+ * @param reverse Stages are joined with = instead of |
+ */
+void write_pipeline_text(FILE *out, command_node **stages, int count, int reverse)
+{
+    static const char *redir_ops[] = {"<", ">", ">>", "2>", "2>>", "<<", "<<<"};
+
+    for (int i = 0; i < count; i++)
+    {
+        command_node *cmd = stages[i];
+
+        if (i > 0)
+            fputs(reverse ? " = " : " | ", out);
+
+        // File operators keep their operands in argv
+        if (cmd->kind == CMD_COUNT)
+            fputs(cmd->argc > 0 ? "# " : "#", out);
+        for (int j = 0; j < cmd->argc; j++)
+        {
+            if (j > 0)
+                fputs(cmd->kind == CMD_APPEND ? " ~ " : cmd->kind == CMD_CONCAT ? " + " : " ", out);
+            write_word(out, cmd->argv[j]);
+        }
+
+        for (redirection *r = cmd->redirs; r != NULL; r = r->next)
+        {
+            fprintf(out, " %s ", redir_ops[r->kind]);
+            write_word(out, r->target);
+        }
+    }
+}
+
+/**
+ * Function to print a word with any $(...) it still holds put back
+ *
+ * @param out Stream to print to
+ * @param word Word text, possibly with SUBST_* markers
+ */
+void write_word(FILE *out, const char *word)
+{
+    int quoted = 0;
+
+    for (const char *p = word; *p != '\0'; p++)
+    {
+        if (*p == SUBST_OPEN || *p == SUBST_QUOTED)
+        {
+            quoted = *p == SUBST_QUOTED;
+            fputs(quoted ? "\"$(" : "$(", out);
+        }
+        else if (*p == SUBST_CLOSE)
+        {
+            fputs(quoted ? ")\"" : ")", out);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+}
+
+/**
+ * Function to build the display text of a pipeline
+ *
+ * @param stages Stages in source order
+ * @param count Number of stages
+ * @param reverse Stages are joined with = instead of |
+ * @return Heap-allocated text, or NULL on allocation failure
+ */
+char *pipeline_text(command_node **stages, int count, int reverse)
+{
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+
+    if (!out)
+        return NULL;
+    write_pipeline_text(out, stages, count, reverse);
+    fclose(out);
+    return text;
+}
+
+/**
+ * Function to build the display text of an and-or list
+ *
+ * @param node Pipelines joined by && and ||
+ * @return Heap-allocated text, or NULL on allocation failure
+ */
+char *and_or_text(and_or_node *node)
+{
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+
+    if (!out)
+        return NULL;
+    for (int i = 0; i < node->count; i++)
+    {
+        if (i > 0)
+            fputs(node->ops[i - 1] == OP_AND ? " && " : " || ", out);
+        write_pipeline_text(out, node->items[i]->stages, node->items[i]->count, node->items[i]->reverse);
+    }
+    fclose(out);
+    return text;
+}
+
+/**
+ * Function to add a job to the job table. Every live process gets a pidfd
+ * so finished jobs can be found with one poll() instead of a wait per pid.
+ *
+ * @param pgid Process group of the job
+ * @param pids Processes of the job, data-wise last one last (<= 0: none)
+ * @param count Number of processes
+ * @param text Display text (taken over by the job)
+ * @param stopped Whether the job is already stopped
+ * @return The new job, or NULL on allocation failure
+ */
+job *job_add(pid_t pgid, const pid_t *pids, int count, char *text, int stopped)
+{
+    job *j = (job *)calloc(1, sizeof(job));
+    if (j)
+    {
+        j->pids = (pid_t *)malloc(count * sizeof(pid_t));
+        j->pidfds = (int *)malloc(count * sizeof(int));
+    }
+    if (!j || !j->pids || !j->pidfds)
+    {
+        perror("Memory allocation failed");
+        if (j)
+        {
+            free(j->pids);
+            free(j->pidfds);
+        }
+        free(j);
+        free(text);
+        return NULL;
+    }
+
+    // Job numbers continue after the highest one still in the table
+    int id = 1;
+    job **tail = &job_list;
+    while (*tail != NULL)
+    {
+        if ((*tail)->id >= id)
+            id = (*tail)->id + 1;
+        tail = &(*tail)->next;
+    }
+
+    j->id = id;
+    j->pgid = pgid;
+    j->count = count;
+    j->text = text;
+    j->stopped = stopped;
+    j->status = pids[count - 1] > 0 ? 0 : 127;
+
+    for (int i = 0; i < count; i++)
+    {
+        j->pids[i] = pids[i] > 0 ? pids[i] : 0;
+        j->pidfds[i] = pids[i] > 0 ? (int)syscall(SYS_pidfd_open, pids[i], 0) : -1;
+        if (pids[i] > 0)
+            j->running++;
+    }
+
+    *tail = j;
+    return j;
+}
+
+/**
+ * Function to unlink a job from the table and free it
+ *
+ * @param j Job to remove
+ */
+void job_remove(job *j)
+{
+    for (job **link = &job_list; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == j)
+        {
+            *link = j->next;
+            break;
+        }
+    }
+
+    for (int i = 0; i < j->count; i++)
+    {
+        if (j->pidfds[i] >= 0)
+            close(j->pidfds[i]);
+    }
+    free(j->pids);
+    free(j->pidfds);
+    free(j->text);
+    free(j);
+}
+
+/**
+ * Function to record a wait status reported for one process of a job
+ *
+ * @param j Job owning the process
+ * @param index Index of the process in j->pids
+ * @param wait_status Status filled in by waitpid()
+ */
+void job_update(job *j, int index, int wait_status)
+{
+    if (WIFSTOPPED(wait_status))
+    {
+        j->stopped = 1;
+        return;
+    }
+    if (WIFCONTINUED(wait_status))
+    {
+        j->stopped = 0;
+        return;
+    }
+
+    // Exited or killed: the process is gone
+    if (index == j->count - 1)
+        j->status = exit_status_of(wait_status);
+    if (j->pidfds[index] >= 0)
+        close(j->pidfds[index]);
+    j->pidfds[index] = -1;
+    j->pids[index] = 0;
+    j->running--;
+}
+
+/**
+ * Function to reap finished background processes without blocking.
+ * Only processes whose pidfd has become readable are waited for.
+ */
+void jobs_poll()
+{
+    int live = 0;
+
+    for (job *j = job_list; j != NULL; j = j->next)
+        live += j->running;
+    if (live == 0)
+        return;
+
+    struct pollfd fds[live];
+    job *owners[live];
+    int indexes[live];
+    int n = 0;
+
+    for (job *j = job_list; j != NULL; j = j->next)
+    {
+        for (int i = 0; i < j->count; i++)
+        {
+            if (j->pids[i] <= 0)
+                continue;
+
+            if (j->pidfds[i] < 0)
+            {
+                // No pidfd support: ask about this process directly
+                int wait_status;
+                if (waitpid(j->pids[i], &wait_status, WNOHANG) > 0)
+                    job_update(j, i, wait_status);
+                continue;
+            }
+
+            fds[n].fd = j->pidfds[i];
+            fds[n].events = POLLIN;
+            owners[n] = j;
+            indexes[n] = i;
+            n++;
+        }
+    }
+
+    if (n == 0 || poll(fds, n, 0) <= 0)
+        return;
+
+    for (int k = 0; k < n; k++)
+    {
+        int wait_status;
+        if ((fds[k].revents & POLLIN) && waitpid(owners[k]->pids[indexes[k]], &wait_status, WNOHANG) > 0)
+            job_update(owners[k], indexes[k], wait_status);
+    }
+}
+
+/**
+ * Function to refresh every job including stops and continues, which
+ * pidfds do not report
+ */
+void jobs_refresh()
+{
+    jobs_poll();
+
+    for (job *j = job_list; j != NULL; j = j->next)
+    {
+        for (int i = 0; i < j->count; i++)
+        {
+            int wait_status;
+            if (j->pids[i] > 0 && waitpid(j->pids[i], &wait_status, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+                job_update(j, i, wait_status);
+        }
+    }
+}
+
+/**
+ * Function to print one line of job status
+ *
+ * @param j Job to describe
+ */
+void job_print(job *j)
+{
+    char state[32];
+
+    if (j->running == 0 && j->status == 0)
+        snprintf(state, sizeof(state), "Done");
+    else if (j->running == 0)
+        snprintf(state, sizeof(state), "Exit %d", j->status);
+    else if (j->stopped)
+        snprintf(state, sizeof(state), "Stopped");
+    else
+        snprintf(state, sizeof(state), "Running");
+
+    printf("[%d]%c  %-22s  %s%s\n", j->id, j->next == NULL ? '+' : ' ', state, j->text ? j->text : "",
+           j->running > 0 && !j->stopped ? " &" : "");
+}
+
+/**
+ * Function called before each prompt: reap what has finished and report
+ * it. Without a terminal nobody reads the notices, so finished jobs are
+ * kept for jobs/wait instead, up to JOB_HISTORY of them.
+ */
+void jobs_notify()
+{
+    jobs_poll();
+
+    int finished = 0;
+    job *j = job_list;
+    while (j != NULL)
+    {
+        job *next = j->next;
+
+        if (j->running == 0)
+        {
+            if (interactive)
+            {
+                job_print(j);
+                job_remove(j);
+            }
+            else if (++finished > JOB_HISTORY)
+            {
+                job_remove(j);
+            }
+        }
+        j = next;
+    }
+}
+
+/**
+ * Function to look up a job by %N, %%, %+ or process ID
+ *
+ * @param spec Job specification, NULL for the current (most recent) job
+ * @return The job, or NULL if there is no such job
+ */
+job *job_find(const char *spec)
+{
+    job *current = job_list;
+
+    while (current != NULL && current->next != NULL)
+        current = current->next;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+        return current;
+
+    char *end;
+    long number = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+    if (*end != '\0' || number <= 0)
+        return NULL;
+
+    for (job *j = job_list; j != NULL; j = j->next)
+    {
+        if (spec[0] == '%' && j->id == number)
+            return j;
+        if (spec[0] != '%' && j->pgid == number)
+            return j;
+        for (int i = 0; spec[0] != '%' && i < j->count; i++)
+        {
+            if (j->pids[i] == number)
+                return j;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Function to wait for a job to finish (or, in the foreground, to stop)
+ *
+ * @param j Job to wait for; removed from the table once finished
+ * @param foreground Give it the terminal and resume it if stopped
+ * @return Exit status of the job, 128 + SIGTSTP if it stopped again
+ */
+int job_wait(job *j, int foreground)
+{
+    int untraced = foreground && job_control ? WUNTRACED : 0;
+
+    if (foreground && job_control)
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+
+    if (foreground && j->stopped)
+    {
+        killpg(j->pgid, SIGCONT);
+        j->stopped = 0;
+    }
+
+    for (int i = 0; i < j->count && !(untraced && j->stopped); i++)
+    {
+        int wait_status;
+
+        if (j->pids[i] <= 0)
+            continue;
+
+        // SIGCHLD handling there may already have reaped this one
+        foreground_wait(j->pids, j->count, i, foreground ? j->pgid : 0);
+        if (j->pids[i] <= 0)
+            continue;
+
+        pid_t result = waitpid(j->pids[i], &wait_status, untraced);
+        if (result < 0 && errno == EINTR)
+        {
+            i--;
+            continue;
+        }
+        if (result < 0)
+        {
+            // Reaped elsewhere: all that is known is that it is gone
+            wait_status = 0;
+        }
+
+        job_update(j, i, wait_status);
+    }
+
+    if (foreground && job_control)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (j->running > 0)
+    {
+        printf("\n[%d]+  Stopped                 %s\n", j->id, j->text ? j->text : "");
+        return 128 + SIGTSTP;
+    }
+
+    int status = j->status;
+    if (foreground && job_control && status == 128 + SIGINT)
+        printf("\n");
+
+    job_remove(j);
+    return status;
+}
+
+/**
+ * Function to wait for the processes of a foreground pipeline. With job
+ * control the pipeline owns the terminal meanwhile, and if it is stopped
+ * (Ctrl+Z) it moves to the job table instead.
+ *
+ * @param pids Processes of the pipeline (<= 0: not launched); reaped ones are zeroed
+ * @param count Number of processes
+ * @param last Index of the process whose status is the pipeline's
+ * @param pgid Process group of the pipeline, 0 if it has none of its own
+ * @param stages Stages in source order (for the job text)
+ * @param reverse Stages are joined with =
+ * @return Exit status of pids[last], 128 + SIGTSTP if the pipeline stopped
+ */
+int wait_foreground(pid_t *pids, int count, int last, pid_t pgid, command_node **stages, int reverse)
+{
+    int status = 127;
+    int stopped = 0;
+    int untraced = job_control ? WUNTRACED : 0;
+
+    if (job_control && pgid > 0)
+        tcsetpgrp(STDIN_FILENO, pgid);
+
+    for (int i = 0; i < count; i++)
+    {
+        int wait_status;
+        struct rusage usage;
+
+        if (pids[i] <= 0)
+            continue;
+
+        // Sleep in the event loop so signals and the deadline are handled
+        foreground_wait(pids, count, i, pgid);
+
+        // time shows where the stage ran, readable until wait4() reaps it
+        int cpu = -1;
+        siginfo_t info;
+        if (timing_active && waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT | untraced) == 0)
+            cpu = process_last_cpu(pids[i]);
+
+        // wait4() hands over the child's resource usage for free
+        pid_t result = wait4(pids[i], &wait_status, untraced, &usage);
+        if (result < 0 && errno == EINTR)
+        {
+            i--;
+            continue;
+        }
+        if (result < 0)
+            continue;
+
+        if (WIFSTOPPED(wait_status))
+        {
+            if (pgid > 0)
+            {
+                stopped = 1;
+                continue;
+            }
+
+            // Sharing the shell's group (threads in the pipeline): it
+            // cannot be suspended, so keep it running
+            kill(pids[i], SIGCONT);
+            i--;
+            continue;
+        }
+
+        if (i == last)
+            status = exit_status_of(wait_status);
+        if (timing_active)
+            timing_record(stages[i], NULL, monotonic_seconds() - pipeline_started, &usage, 0, cpu);
+        if (trace_active)
+            trace_record(stages[i], NULL, pids[i], exit_status_of(wait_status), monotonic_seconds() - pipeline_started,
+                         &usage);
+        if (pstat_active)
+            pstat_collect(pids[i], stages[i]);
+        pids[i] = 0;
+    }
+
+    if (job_control && pgid > 0)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    // Ctrl+C left the cursor after "^C"
+    if (job_control && status == 128 + SIGINT)
+        printf("\n");
+
+    if (stopped)
+    {
+        job *j = job_add(pgid, pids, count, pipeline_text(stages, count, reverse), 1);
+        if (j != NULL)
+        {
+            if (pids[last] <= 0)
+                j->status = status;
+            printf("\n[%d]+  Stopped                 %s\n", j->id, j->text ? j->text : "");
+        }
+        return 128 + SIGTSTP;
+    }
+
+    return status;
+}
+
+/**
+ * Function to start an and-or list in the background. A lone external
+ * command is launched directly; anything else runs in a forked subshell.
+ * Either way the job gets its own process group.
+ *
+ * @param node And-or list followed by &
+ * @return 0 if the job was started, 1 otherwise
+ */
+int execute_background(and_or_node *node)
+{
+    command_node *cmd = node->count == 1 && node->items[0]->count == 1 ? node->items[0]->stages[0] : NULL;
+    spawn_io io;
+    pid_t pid;
+
+    spawn_io_init(&io);
+    io.pgid = 0;
+
+    // Without job control a background job must not read the terminal
+    int null_fd = -1;
+    if (!job_control)
+    {
+        null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd >= 0)
+            io.in_fd = null_fd;
+    }
+
+    // A $(...) is run by the subshell, not held up here
+    if (cmd != NULL && cmd->argc > 0 && !cmd->expand && !is_shell_command(cmd))
+    {
+        pid = launch_stage(cmd, &io);
+    }
+    else
+    {
+        fflush(stdout);
+        pid = fork();
+
+        if (pid < 0)
+        {
+            perror("fork failed");
+        }
+        else if (pid == 0)
+        {
+            // Subshell: its children stay in its group, off the terminal
+            child_enter_group(&io);
+            if (io.in_fd != STDIN_FILENO)
+                dup2(io.in_fd, STDIN_FILENO);
+
+            job_control = 0;
+            interactive = 0;
+            job_list = NULL;
+            trace_active = 0;
+            zygote_detach();
+
+            int status = execute_conditional_commands(node);
+            fflush(stdout);
+            _exit(status);
+        }
+        else
+        {
+            setpgid(pid, pid);
+        }
+    }
+
+    if (null_fd >= 0)
+        close(null_fd);
+
+    if (pid < 0)
+        return 1;
+
+    job *j = job_add(pid, &pid, 1, and_or_text(node), 0);
+    if (j != NULL && interactive)
+        printf("[%d] %d\n", j->id, (int)pid);
+
+    return 0;
+}
+
+/**
+ * Function to handle the jobs builtin ("jobs [-p]")
+ *
+ * @param args Command and its arguments
+ * @return Exit status (0 on success)
+ */
+int jobs_command(char **args)
+{
+    int pids_only = args[1] != NULL && strcmp(args[1], "-p") == 0;
+
+    jobs_refresh();
+
+    job *j = job_list;
+    while (j != NULL)
+    {
+        job *next = j->next;
+
+        if (pids_only)
+            printf("%d\n", (int)j->pgid);
+        else
+            job_print(j);
+
+        // A finished job is reported once
+        if (j->running == 0)
+            job_remove(j);
+        j = next;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to handle the fg builtin ("fg [job]")
+ *
+ * @param args Command and its arguments
+ * @return Exit status of the job
+ */
+int fg_command(char **args)
+{
+    jobs_poll();
+
+    job *j = job_find(args[1]);
+    if (j == NULL)
+    {
+        fprintf(stderr, "w25shell: fg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+
+    printf("%s\n", j->text ? j->text : "");
+    fflush(stdout);
+    return job_wait(j, 1);
+}
+
+/**
+ * Function to handle the bg builtin ("bg [job]")
+ *
+ * @param args Command and its arguments
+ * @return Exit status (0 on success)
+ */
+int bg_command(char **args)
+{
+    jobs_refresh();
+
+    job *j = job_find(args[1]);
+    if (j == NULL)
+    {
+        fprintf(stderr, "w25shell: bg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+
+    if (j->stopped)
+    {
+        killpg(j->pgid, SIGCONT);
+        j->stopped = 0;
+    }
+    printf("[%d]+ %s &\n", j->id, j->text ? j->text : "");
+    return 0;
+}
+
+/**
+ * Function to handle the wait builtin ("wait [job ...]"). Without
+ * operands it waits for every running job and returns 0.
+ *
+ * @param args Command and its arguments
+ * @return Exit status of the last job waited for
+ */
+int wait_command(char **args)
+{
+    int status = 0;
+
+    if (args[1] == NULL)
+    {
+        // Stopped jobs would never finish, so they are skipped
+        job *j = job_list;
+        while (j != NULL)
+        {
+            job *next = j->next;
+            if (!j->stopped)
+                job_wait(j, 0);
+            j = next;
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        job *j = job_find(args[i]);
+        if (j == NULL)
+        {
+            fprintf(stderr, "w25shell: wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        status = job_wait(j, 0);
+    }
+
+    return status;
+}
+// SECTION ENDS: "JOB CONTROL"
+
+// SECTION STARTS: "EVENT LOOP"
+/**
+ * Function to set up the event loop: SIGINT, SIGTERM and SIGCHLD are
+ * blocked and read from a signalfd instead, which shares one epoll set
+ * with the deadline timerfd. Children, stdin and pidfds are added to the
+ * set only while they are being waited for. Safe to call repeatedly.
+ *
+ * @return 0 when the loop is available, -1 if the shell has to fall back
+ *         to plain blocking waits
+ */
+int event_init()
+{
+    if (event_fd >= 0)
+        return 0;
+
+    sigset_t events;
+    sigemptyset(&events);
+    sigaddset(&events, SIGINT);
+    sigaddset(&events, SIGTERM);
+    sigaddset(&events, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &events, &event_saved_mask);
+
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &events, SFD_CLOEXEC | SFD_NONBLOCK);
+    event_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    // Ids: the signalfd and the timer stay registered for good
+    int watched[2] = {signal_fd, event_timer};
+    int ready = event_fd >= 0;
+    for (int i = 0; i < 2 && ready; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i == 0 ? EVENT_SIGNAL : EVENT_TIMER;
+        if (watched[i] < 0 || epoll_ctl(event_fd, EPOLL_CTL_ADD, watched[i], &ev) < 0)
+            ready = 0;
+    }
+
+    if (!ready)
+    {
+        event_detach();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function to leave the event loop in a freshly forked child: close the
+ * inherited descriptors and unblock the signals again, so whatever the
+ * child runs sees SIGINT and SIGTERM as usual
+ */
+void event_detach()
+{
+    if (event_fd < 0 && signal_fd < 0 && event_timer < 0)
+        return;
+
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (event_timer >= 0)
+        close(event_timer);
+    if (event_fd >= 0)
+        close(event_fd);
+    event_fd = signal_fd = event_timer = -1;
+    sigprocmask(SIG_SETMASK, &event_saved_mask, NULL);
+}
+
+/**
+ * Function to handle the signals queued on the signalfd. A SIGINT or
+ * SIGTERM sent to the shell goes on to the foreground processes; a
+ * Ctrl+C from the terminal already reached their group and is not sent
+ * twice. SIGCHLD collects finished background jobs.
+ *
+ * @param pids Foreground processes (<= 0: not launched or reaped), may be NULL
+ * @param count Number of processes
+ * @param pgid Process group of the foreground, 0 if it has none of its own
+ * @return EVENT_SAW_* bits of the signals read
+ */
+int event_signals(pid_t *pids, int count, pid_t pgid)
+{
+    struct signalfd_siginfo info;
+    int seen = 0;
+
+    while (signal_fd >= 0 && read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGCHLD)
+        {
+            seen |= EVENT_SAW_CHLD;
+            continue;
+        }
+
+        if (info.ssi_signo == SIGINT)
+        {
+            seen |= EVENT_SAW_INT;
+            if (!interactive)
+                shell_interrupted = 1;
+            if (info.ssi_code != SI_KERNEL)
+                deadline_signal(pids, count, pgid, SIGINT);
+        }
+        else
+        {
+            // SIGTERM: the foreground goes first, the shell exits after it
+            seen |= EVENT_SAW_TERM;
+            shell_terminating = 1;
+            deadline_signal(pids, count, pgid, SIGTERM);
+        }
+    }
+
+    if ((seen & EVENT_SAW_CHLD) && job_list != NULL)
+        jobs_poll();
+    return seen;
+}
+
+/**
+ * Function to block until one process of a foreground pipeline has
+ * exited (or, with job control, stopped). The process is watched through
+ * a pidfd in the event loop, next to the signalfd and, under timeout,
+ * the armed deadline timer. Nothing is reaped here: wait4() still does
+ * that.
+ *
+ * @param pids Processes of the pipeline (<= 0: not launched or reaped)
+ * @param count Number of processes
+ * @param index Process to wait for
+ * @param pgid Process group of the pipeline, 0 if it has none of its own
+ * @return 0 when wait4() will not block, -1 if the event loop is not
+ *         available (the caller then simply waits)
+ */
+int foreground_wait(pid_t *pids, int count, int index, pid_t pgid)
+{
+    if (event_init() < 0)
+        return -1;
+
+    int pidfd = (int)syscall(SYS_pidfd_open, pids[index], 0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_CHILD;
+    if (pidfd < 0 || epoll_ctl(event_fd, EPOLL_CTL_ADD, pidfd, &ev) < 0)
+    {
+        if (pidfd >= 0)
+            close(pidfd);
+        return -1;
+    }
+
+    int result = -1;
+    int killed = 0;
+    int armed = 0;
+
+    while (result < 0)
+    {
+        // A stopped pipeline leaves the foreground; wait4() reports it
+        siginfo_t stopped;
+        stopped.si_pid = 0;
+        if (job_control && waitid(P_PID, pids[index], &stopped, WSTOPPED | WNOHANG | WNOWAIT) == 0 &&
+            stopped.si_pid != 0)
+        {
+            result = 0;
+            break;
+        }
+
+        // SIGTERM at the deadline, SIGKILL once the grace period is over;
+        // after that only the exit is left to wait for
+        if (deadline_at > 0 && !killed)
+        {
+            double at = deadline_fired ? deadline_kill_at : deadline_at;
+            struct itimerspec when;
+            memset(&when, 0, sizeof(when));
+            when.it_value.tv_sec = (time_t)at;
+            when.it_value.tv_nsec = (long)((at - (time_t)at) * 1e9);
+            timerfd_settime(event_timer, TFD_TIMER_ABSTIME, &when, NULL);
+            armed = 1;
+        }
+
+        struct epoll_event events[EVENT_BATCH];
+        int n = epoll_wait(event_fd, events, EVENT_BATCH, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 == EVENT_CHILD)
+            {
+                result = 0;
+            }
+            else if (events[i].data.u32 == EVENT_TIMER)
+            {
+                uint64_t expirations;
+                if (read(event_timer, &expirations, sizeof(expirations)) < 0 || deadline_at <= 0)
+                    continue;
+                deadline_signal(pids, count, pgid, deadline_fired ? SIGKILL : SIGTERM);
+                if (deadline_fired)
+                    killed = 1;
+                else
+                    deadline_kill_at = monotonic_seconds() + TIMEOUT_GRACE_MS / 1000.0;
+                deadline_fired = 1;
+            }
+            else if (events[i].data.u32 == EVENT_SIGNAL)
+            {
+                // A stop shows up as SIGCHLD and is checked above
+                event_signals(pids, count, pgid);
+            }
+        }
+    }
+
+    if (armed)
+    {
+        struct itimerspec off;
+        memset(&off, 0, sizeof(off));
+        timerfd_settime(event_timer, 0, &off, NULL);
+    }
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+    return result;
+}
+
+/**
+ * Function to read from a descriptor while the event loop keeps running.
+ * The descriptor is non-blocking only for the duration of the call, so
+ * no command ever inherits O_NONBLOCK on stdin. Regular files cannot be
+ * polled and are read directly.
+ *
+ * @param fd Descriptor to read from
+ * @param buf Buffer to fill
+ * @param len Size of buf
+ * @return Bytes read, 0 at end of input (also once SIGTERM arrived or a
+ *         non-interactive shell was interrupted), -1 on error; errno is
+ *         ECANCELED when Ctrl+C discarded the line being typed
+ */
+ssize_t event_read(int fd, char *buf, size_t len)
+{
+    if (event_init() < 0)
+        return read(fd, buf, len);
+
+    int flags = fcntl(fd, F_GETFL);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_INPUT;
+    if (flags < 0 || epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return read(fd, buf, len);
+    if (!(flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    // Signals left over from the last line: a Ctrl+C that only reached
+    // the foreground job is not one for the prompt
+    event_signals(NULL, 0, 0);
+
+    ssize_t n = -1;
+    int waiting = 1;
+    while (waiting)
+    {
+        if (event_stopping())
+        {
+            n = 0;
+            break;
+        }
+
+        n = read(fd, buf, len);
+        if (n >= 0 || (errno != EAGAIN && errno != EINTR))
+            break;
+
+        struct epoll_event events[EVENT_BATCH];
+        int ready = epoll_wait(event_fd, events, EVENT_BATCH, -1);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.u32 == EVENT_SIGNAL && (event_signals(NULL, 0, 0) & EVENT_SAW_INT) && interactive)
+            {
+                errno = ECANCELED;
+                n = -1;
+                waiting = 0;
+            }
+            else if (events[i].data.u32 == EVENT_TIMER)
+            {
+                uint64_t expirations;
+                if (read(event_timer, &expirations, sizeof(expirations)) < 0)
+                    continue;
+            }
+        }
+    }
+
+    int saved_errno = errno;
+    if (!(flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags);
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+    errno = saved_errno;
+    return n;
+}
+
+/**
+ * Function to tell whether a signal asked the shell to stop running
+ * further commands: SIGTERM always, SIGINT when nobody is at a prompt
+ *
+ * @return 1 if the current line should be abandoned, 0 otherwise
+ */
+int event_stopping()
+{
+    return shell_terminating || (shell_interrupted && !interactive);
+}
+// SECTION ENDS: "EVENT LOOP"
+
+// SECTION STARTS: "PARALLEL EXECUTION"
+/**
+ * Function to recognise and strip a "parallel [-j N]" prefix from the
+ * first command of a line
+ *
+ * @param cmd First command of the line (argv is shifted past the prefix)
+ * @param jobs Output worker count (online CPUs unless -j is given)
+ * @return 1 if the prefix was present, 0 if not, -1 on a usage error
+ */
+int parallel_prefix(command_node *cmd, int *jobs)
+{
+    if (cmd->kind != CMD_EXEC || cmd->argc == 0 || strcmp(cmd->argv[0], "parallel") != 0)
+        return 0;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *jobs = cpus > 0 ? (int)cpus : 1;
+
+    int used = 1;
+    if (cmd->argv[1] != NULL && strncmp(cmd->argv[1], "-j", 2) == 0)
+    {
+        char *value = cmd->argv[1][2] != '\0' ? cmd->argv[1] + 2 : cmd->argv[2];
+        char *end = NULL;
+        long n = value != NULL ? strtol(value, &end, 10) : 0;
+
+        if (value == NULL || *end != '\0' || n < 1)
+        {
+            fprintf(stderr, "w25shell: parallel: usage: parallel [-j N] cmd ; cmd ...\n");
+            return -1;
+        }
+        *jobs = (int)n;
+        used += cmd->argv[1][2] != '\0' ? 1 : 2;
+    }
+
+    cmd->argv += used;
+    cmd->argc -= used;
+    return 1;
+}
+
+/**
+ * Function to start one command list of a parallel line in a subshell
+ * whose stdout and stderr go to memfds
+ *
+ * @param task Task to start (pid, pidfd and output descriptors are set)
+ * @param null_fd /dev/null, used as the subshell's stdin
+ * @return 0 on success, -1 if the task could not be started
+ */
+int parallel_start(parallel_task *task, int null_fd)
+{
+    task->out_fd = memfd_create("w25shell-parallel-out", MFD_CLOEXEC);
+    task->err_fd = memfd_create("w25shell-parallel-err", MFD_CLOEXEC);
+    if (task->out_fd < 0 || task->err_fd < 0)
+    {
+        perror("memfd_create failed");
+        return -1;
+    }
+
+    task->pid = fork();
+    if (task->pid < 0)
+    {
+        perror("fork failed");
+        return -1;
+    }
+
+    if (task->pid == 0)
+    {
+        // Subshell: stays in the shell's group so Ctrl+C reaches it
+        spawn_io io;
+        spawn_io_init(&io);
+        child_enter_group(&io);
+
+        dup2(task->out_fd, STDOUT_FILENO);
+        dup2(task->err_fd, STDERR_FILENO);
+        if (null_fd >= 0)
+            dup2(null_fd, STDIN_FILENO);
+
+        job_control = 0;
+        interactive = 0;
+        job_list = NULL;
+        trace_active = 0;
+        zygote_detach();
+
+        int status = execute_conditional_commands(task->node);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+
+    task->pidfd = (int)syscall(SYS_pidfd_open, task->pid, 0);
+    task->started = monotonic_seconds();
+    return 0;
+}
+
+/**
+ * Function to record a finished parallel task for the time report and trace
+ *
+ * @param task Task that was just reaped
+ * @param usage Its resource usage (the whole subshell)
+ */
+void parallel_timing(parallel_task *task, const struct rusage *usage)
+{
+    if (!timing_active && !trace_active)
+        return;
+
+    char *text = and_or_text(task->node);
+    double real = monotonic_seconds() - task->started;
+    if (timing_active)
+        timing_record(NULL, text, real, usage, 0, -1);
+    if (trace_active)
+        trace_record(NULL, text, task->pid, task->status, real, usage);
+    free(text);
+}
+
+/**
+ * Function to wait until at least one running task has finished
+ *
+ * @param tasks Tasks of the line
+ * @param count Number of tasks
+ * @return Number of tasks reaped
+ */
+int parallel_reap(parallel_task *tasks, int count)
+{
+    struct pollfd fds[count + 1];
+    int indexes[count];
+    pid_t pids[count];
+    int n = 0;
+    int reaped = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (tasks[i].pid <= 0)
+            continue;
+
+        // Without pidfds, block on the oldest running task instead
+        if (tasks[i].pidfd < 0)
+        {
+            int wait_status;
+            struct rusage usage;
+            if (wait4(tasks[i].pid, &wait_status, 0, &usage) > 0)
+            {
+                tasks[i].status = exit_status_of(wait_status);
+                parallel_timing(&tasks[i], &usage);
+            }
+            tasks[i].pid = 0;
+            tasks[i].done = 1;
+            return 1;
+        }
+
+        fds[n].fd = tasks[i].pidfd;
+        fds[n].events = POLLIN;
+        pids[n] = tasks[i].pid;
+        indexes[n++] = i;
+    }
+
+    // Signals for the tasks arrive on the event loop's signalfd
+    unsigned int watched = n;
+    if (n > 0 && signal_fd >= 0)
+    {
+        fds[watched].fd = signal_fd;
+        fds[watched++].events = POLLIN;
+    }
+
+    if (n == 0 || poll(fds, watched, -1) <= 0)
+        return 0;
+    if (watched > (unsigned int)n && (fds[n].revents & POLLIN))
+        event_signals(pids, n, 0);
+
+    for (int k = 0; k < n; k++)
+    {
+        parallel_task *task = &tasks[indexes[k]];
+        int wait_status;
+        struct rusage usage;
+
+        if (!(fds[k].revents & POLLIN) || wait4(task->pid, &wait_status, WNOHANG, &usage) <= 0)
+            continue;
+
+        task->status = exit_status_of(wait_status);
+        parallel_timing(task, &usage);
+        task->pid = 0;
+        task->done = 1;
+        close(task->pidfd);
+        task->pidfd = -1;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+/**
+ * Function to print a finished task's captured output and release it
+ *
+ * @param task Finished task
+ */
+void parallel_emit(parallel_task *task)
+{
+    int method;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    // memfd -> stdout/stderr with the same in-kernel copy as +
+    if (task->out_fd >= 0 && lseek(task->out_fd, 0, SEEK_SET) == 0)
+    {
+        method = COPY_RANGE;
+        copy_fd_to_fd(task->out_fd, STDOUT_FILENO, &method);
+    }
+    if (task->err_fd >= 0 && lseek(task->err_fd, 0, SEEK_SET) == 0)
+    {
+        method = COPY_RANGE;
+        copy_fd_to_fd(task->err_fd, STDERR_FILENO, &method);
+    }
+
+    if (task->out_fd >= 0)
+        close(task->out_fd);
+    if (task->err_fd >= 0)
+        close(task->err_fd);
+    task->out_fd = task->err_fd = -1;
+}
+
+/**
+ * Function to run the command lists of a line concurrently on at most
+ * jobs subshells. Output is captured per command and printed in the
+ * order the commands were written, as soon as all earlier ones are done.
+ *
+ * @param list Parsed line (the parallel prefix already stripped)
+ * @param first Index of the first list item to run
+ * @param jobs Maximum number of commands running at once
+ * @return 0 if every command succeeded, else the number that failed (at most 101)
+ */
+int execute_parallel_commands(list_node *list, int first, int jobs)
+{
+    int count = list->count - first;
+    parallel_task *tasks = (parallel_task *)calloc(count > 0 ? count : 1, sizeof(parallel_task));
+    if (!tasks)
+    {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int next = 0;    // Next task to start
+    int printed = 0; // Tasks whose output has been printed
+    int running = 0;
+    int failed = 0;
+
+    fflush(stdout);
+
+    while (printed < count)
+    {
+        // Keep every worker slot busy
+        while (next < count && running < jobs)
+        {
+            parallel_task *task = &tasks[next++];
+            task->node = list->items[first + next - 1];
+            task->out_fd = task->err_fd = task->pidfd = -1;
+
+            // Once SIGTERM or an interrupt arrived, nothing new starts
+            if (event_stopping() || parallel_start(task, null_fd) < 0)
+            {
+                task->status = 1;
+                task->done = 1;
+                continue;
+            }
+            running++;
+        }
+
+        // Print everything that is now complete in submission order
+        while (printed < next && tasks[printed].done)
+        {
+            parallel_emit(&tasks[printed]);
+            if (tasks[printed].status != 0)
+                failed++;
+            printed++;
+        }
+
+        if (printed < count && running > 0)
+            running -= parallel_reap(tasks, next);
+    }
+
+    if (null_fd >= 0)
+        close(null_fd);
+    free(tasks);
+
+    if (failed > 0)
+        fprintf(stderr, "w25shell: parallel: %d of %d commands failed\n", failed, count);
+
+    return failed > 101 ? 101 : failed;
+}
+// SECTION ENDS: "PARALLEL EXECUTION"
+
+// SECTION STARTS: "TIMING"
+/**
+ * Function to recognise and strip a one-word line prefix such as "time"
+ * or "pstat" from the first command of a line
+ *
+ * @param cmd First command of the line (argv is shifted past the prefix)
+ * @param word Prefix to look for
+ * @return 1 if the prefix was present, 0 otherwise
+ */
+int command_prefix(command_node *cmd, const char *word)
+{
+    if (cmd->kind != CMD_EXEC || cmd->argc == 0 || strcmp(cmd->argv[0], word) != 0)
+        return 0;
+
+    cmd->argv++;
+    cmd->argc--;
+    return 1;
+}
+
+/**
+ * Function to note when the stages about to be launched started, so
+ * their real time can be reported. Free when nothing is being timed.
+ */
+void timing_start()
+{
+    if (timing_active || trace_active)
+        pipeline_started = monotonic_seconds();
+}
+
+/**
+ * Function to record the figures of one finished stage
+ *
+ * @param cmd Stage that finished (for its label), or NULL
+ * @param label Label to use when cmd is NULL
+ * @param real Seconds from launch to exit
+ * @param usage Resources used by the stage
+ * @param in_process Stage ran on a thread of the shell
+ * @param cpu CPU the stage last ran on, -1 if unknown
+ */
+void timing_record(command_node *cmd, const char *label, double real, const struct rusage *usage, int in_process,
+                   int cpu)
+{
+    if (timing_count == timing_capacity)
+    {
+        int capacity = timing_capacity ? timing_capacity * 2 : 8;
+        stage_timing *grown = (stage_timing *)realloc(timings, capacity * sizeof(stage_timing));
+        if (!grown)
+            return;
+        timings = grown;
+        timing_capacity = capacity;
+    }
+
+    stage_timing *t = &timings[timing_count++];
+    char *text = cmd != NULL ? pipeline_text(&cmd, 1, 0) : NULL;
+
+    // In-process stages are marked with a leading *
+    snprintf(t->label, sizeof(t->label), "%s%s", in_process ? "*" : "", text ? text : label ? label : "?");
+    free(text);
+    t->real = real;
+    t->usage = *usage;
+    t->in_process = in_process;
+    t->cpu = cpu;
+}
+
+/**
+ * Function to convert a timeval to seconds
+ *
+ * @param tv Time value
+ * @return Seconds
+ */
+double timeval_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * Function to print one row of the time report
+ *
+ * @param label Stage text or "total"
+ * @param real Wall-clock seconds
+ * @param usage Resources used
+ * @param cpu CPU it last ran on, -1 for none/unknown
+ */
+void timing_print_row(const char *label, double real, const struct rusage *usage, int cpu)
+{
+    char where[16] = "-";
+    if (cpu >= 0)
+        snprintf(where, sizeof(where), "%d", cpu);
+
+    fprintf(stderr, "%-28.28s %9.3f %9.3f %9.3f %9ld %7ld %7ld %9ld %6ld %4s\n", label, real,
+            timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime), usage->ru_maxrss,
+            usage->ru_nvcsw, usage->ru_nivcsw, usage->ru_minflt, usage->ru_majflt, where);
+}
+
+/**
+ * Function to run a line under "time": every stage reaped meanwhile is
+ * recorded from wait4() (filter threads from RUSAGE_THREAD), then a table
+ * with one row per stage and a total row is printed on stderr. The total
+ * CPU includes the shell itself (in-process filters and builtins).
+ *
+ * @param list Parsed line (the time prefix already stripped)
+ * @param first Index of the first list item to run
+ * @return Exit status of the line
+ */
+int execute_timed_commands(list_node *list, int first)
+{
+    list_node rest = *list;
+    struct rusage self_before, self_after, children_before, children_after;
+    int status = 0;
+
+    rest.items += first;
+    rest.background += first;
+    rest.count -= first;
+
+    timing_active = 1;
+    timing_count = 0;
+    getrusage(RUSAGE_SELF, &self_before);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    double start = monotonic_seconds();
+
+    if (rest.count > 0)
+        status = execute_sequential_commands(&rest);
+
+    double real = monotonic_seconds() - start;
+    getrusage(RUSAGE_SELF, &self_after);
+    getrusage(RUSAGE_CHILDREN, &children_after);
+    timing_active = 0;
+
+    // Total = everything reaped meanwhile + the shell's own share
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    double user = timeval_seconds(&children_after.ru_utime) - timeval_seconds(&children_before.ru_utime) +
+                  timeval_seconds(&self_after.ru_utime) - timeval_seconds(&self_before.ru_utime);
+    double sys = timeval_seconds(&children_after.ru_stime) - timeval_seconds(&children_before.ru_stime) +
+                 timeval_seconds(&self_after.ru_stime) - timeval_seconds(&self_before.ru_stime);
+    total.ru_utime.tv_sec = (time_t)user;
+    total.ru_utime.tv_usec = (suseconds_t)((user - (time_t)user) * 1e6);
+    total.ru_stime.tv_sec = (time_t)sys;
+    total.ru_stime.tv_usec = (suseconds_t)((sys - (time_t)sys) * 1e6);
+    total.ru_nvcsw = self_after.ru_nvcsw - self_before.ru_nvcsw;
+    total.ru_nivcsw = self_after.ru_nivcsw - self_before.ru_nivcsw;
+    total.ru_minflt = self_after.ru_minflt - self_before.ru_minflt;
+    total.ru_majflt = self_after.ru_majflt - self_before.ru_majflt;
+    total.ru_maxrss = self_after.ru_maxrss;
+
+    fflush(stdout);
+    fprintf(stderr, "%-28s %9s %9s %9s %9s %7s %7s %9s %6s %4s\n", "stage", "real(s)", "user(s)", "sys(s)",
+            "maxrss(K)", "vcsw", "ivcsw", "minflt", "majflt", "cpu");
+    for (int i = 0; i < timing_count; i++)
+    {
+        struct rusage *u = &timings[i].usage;
+
+        timing_print_row(timings[i].label, timings[i].real, u, timings[i].cpu);
+
+        // Threads of the shell are already part of its own share
+        if (timings[i].in_process)
+            continue;
+        if (u->ru_maxrss > total.ru_maxrss)
+            total.ru_maxrss = u->ru_maxrss;
+        total.ru_nvcsw += u->ru_nvcsw;
+        total.ru_nivcsw += u->ru_nivcsw;
+        total.ru_minflt += u->ru_minflt;
+        total.ru_majflt += u->ru_majflt;
+    }
+    timing_print_row("total", real, &total, -1);
+
+    for (int i = 0; i < timing_count; i++)
+    {
+        if (timings[i].in_process)
+        {
+            fprintf(stderr, "* ran on a thread of the shell (counted in the total through the shell)\n");
+            break;
+        }
+    }
+
+    return status;
+}
+// SECTION ENDS: "TIMING"
+
+// SECTION STARTS: "DEADLINES AND LIMITS"
+/**
+ * Function to parse a duration such as "30", "1.5s", "2m", "1h" or "1d"
+ *
+ * @param text Duration text
+ * @return Seconds, or -1 if text is not a positive duration
+ */
+double parse_duration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value <= 0)
+        return -1;
+    if (*end == 's')
+        end++;
+    else if (*end == 'm')
+        value *= 60, end++;
+    else if (*end == 'h')
+        value *= 3600, end++;
+    else if (*end == 'd')
+        value *= 86400, end++;
+
+    return *end == '\0' ? value : -1;
+}
+
+/**
+ * Function to recognise and strip a "timeout DURATION" prefix from the
+ * first command of a line
+ *
+ * @param cmd First command of the line (argv is shifted past the prefix)
+ * @param seconds Output deadline in seconds from now
+ * @return 1 if the prefix was present, 0 if not, -1 on a usage error
+ */
+int deadline_prefix(command_node *cmd, double *seconds)
+{
+    if (cmd->kind != CMD_EXEC || cmd->argc == 0 || strcmp(cmd->argv[0], "timeout") != 0)
+        return 0;
+
+    *seconds = cmd->argv[1] != NULL ? parse_duration(cmd->argv[1]) : -1;
+    if (*seconds < 0)
+    {
+        fprintf(stderr, "w25shell: timeout: usage: timeout DURATION[s|m|h|d] cmd ...\n");
+        return -1;
+    }
+
+    cmd->argv += 2;
+    cmd->argc -= 2;
+    return 1;
+}
+
+/**
+ * Function to run a line under "timeout": every foreground process it
+ * starts is sent SIGTERM at the deadline and SIGKILL TIMEOUT_GRACE_MS
+ * later. A nested timeout can shorten the deadline but never extend it.
+ *
+ * @param list Parsed line (the timeout prefix already stripped)
+ * @param first Index of the first list item to run
+ * @param seconds Deadline in seconds from now
+ * @return Exit status of the line, TIMEOUT_STATUS if the deadline hit
+ */
+int execute_deadline_commands(list_node *list, int first, double seconds)
+{
+    list_node rest = *list;
+    int status = 0;
+
+    rest.items += first;
+    rest.background += first;
+    rest.count -= first;
+
+    double outer_at = deadline_at;
+    double outer_kill_at = deadline_kill_at;
+    int outer_fired = deadline_fired;
+
+    double at = monotonic_seconds() + seconds;
+    if (outer_at > 0 && outer_at <= at)
+        return rest.count > 0 ? execute_sequential_commands(&rest) : 0;
+
+    deadline_at = at;
+    deadline_fired = 0;
+
+    if (rest.count > 0)
+        status = execute_sequential_commands(&rest);
+
+    int fired = deadline_fired;
+    deadline_at = outer_at;
+    deadline_kill_at = outer_kill_at;
+    deadline_fired = outer_fired;
+
+    if (fired)
+    {
+        fprintf(stderr, "w25shell: timeout: deadline of %gs reached\n", seconds);
+        return TIMEOUT_STATUS;
+    }
+    return status;
+}
+
+/**
+ * Function to signal every process of a foreground pipeline, waking
+ * stopped ones so they can act on it
+ *
+ * @param pids Processes of the pipeline (<= 0: not launched or reaped)
+ * @param count Number of processes
+ * @param pgid Process group of the pipeline, 0 if it has none of its own
+ * @param sig Signal to send
+ */
+void deadline_signal(pid_t *pids, int count, pid_t pgid, int sig)
+{
+    if (pgid > 0)
+    {
+        killpg(pgid, sig);
+        killpg(pgid, SIGCONT);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pids[i] > 0)
+        {
+            kill(pids[i], sig);
+            kill(pids[i], SIGCONT);
+        }
+    }
+}
+
+/**
+ * Function to recognise and strip a "limit KEY=VALUE..." prefix from the
+ * first command of a line. Keys: cpu (seconds), as (bytes, K/M/G
+ * suffixes) and nofile (descriptors).
+ *
+ * @param cmd First command of the line (argv is shifted past the prefix)
+ * @param parsed Output limits (LIMIT_MAX entries)
+ * @param count Output number of limits
+ * @return 1 if the prefix was present, 0 if not, -1 on a usage error
+ */
+int limit_prefix(command_node *cmd, resource_limit *parsed, int *count)
+{
+    static const char *keys[LIMIT_MAX] = {"cpu=", "as=", "nofile="};
+    static const int resources[LIMIT_MAX] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+
+    if (cmd->kind != CMD_EXEC || cmd->argc == 0 || strcmp(cmd->argv[0], "limit") != 0)
+        return 0;
+
+    int used = 1;
+    *count = 0;
+    while (cmd->argv[used] != NULL && strchr(cmd->argv[used], '=') != NULL)
+    {
+        char *word = cmd->argv[used];
+        int k = 0;
+        while (k < LIMIT_MAX && strncmp(word, keys[k], strlen(keys[k])) != 0)
+            k++;
+
+        char *text = k < LIMIT_MAX ? word + strlen(keys[k]) : NULL;
+        double value = text == NULL ? -1 : k == 0 ? parse_duration(text) : (double)parse_size(text);
+        if (value < 0 || (k == 2 && value == 0))
+        {
+            *count = 0;
+            break;
+        }
+
+        // A repeated key replaces the earlier value
+        int slot = 0;
+        while (slot < *count && parsed[slot].resource != resources[k])
+            slot++;
+        if (slot == *count)
+            (*count)++;
+
+        // CPU time: SIGXCPU at the limit, SIGKILL one second later
+        rlim_t limit = k == 0 ? (rlim_t)(value + 0.999999) : (rlim_t)value;
+        parsed[slot].resource = resources[k];
+        parsed[slot].value.rlim_cur = limit;
+        parsed[slot].value.rlim_max = k == 0 ? limit + 1 : limit;
+        used++;
+    }
+
+    if (*count == 0)
+    {
+        fprintf(stderr, "w25shell: limit: usage: limit [cpu=SECONDS] [as=SIZE] [nofile=N] cmd ...\n");
+        return -1;
+    }
+
+    cmd->argv += used;
+    cmd->argc -= used;
+    return 1;
+}
+
+/**
+ * Function to run a line under "limit": every process it starts gets the
+ * limits installed between fork and exec. Those processes are forked
+ * directly (not spawned or zygote-launched) and no stage runs on a shell
+ * thread, so nothing the line runs escapes them. A nested limit overrides
+ * the same key of an outer one.
+ *
+ * @param list Parsed line (the limit prefix already stripped)
+ * @param first Index of the first list item to run
+ * @param parsed Limits from limit_prefix()
+ * @param count Number of limits
+ * @return Exit status of the line
+ */
+int execute_limited_commands(list_node *list, int first, resource_limit *parsed, int count)
+{
+    list_node rest = *list;
+    resource_limit outer[LIMIT_MAX];
+    int outer_count = limit_count;
+    int status = 0;
+
+    rest.items += first;
+    rest.background += first;
+    rest.count -= first;
+
+    memcpy(outer, limits, sizeof(outer));
+    for (int i = 0; i < count; i++)
+    {
+        int slot = 0;
+        while (slot < limit_count && limits[slot].resource != parsed[i].resource)
+            slot++;
+        if (slot == limit_count)
+            limit_count++;
+        limits[slot] = parsed[i];
+    }
+
+    if (rest.count > 0)
+        status = execute_sequential_commands(&rest);
+
+    memcpy(limits, outer, sizeof(outer));
+    limit_count = outer_count;
+    return status;
+}
+
+/**
+ * Function to install the active limits on the calling process. Called in
+ * a child between fork and exec.
+ *
+ * @return 0 on success, -1 if a limit was refused (reported)
+ */
+int limit_apply()
+{
+    for (int i = 0; i < limit_count; i++)
+    {
+        if (prlimit(0, limits[i].resource, &limits[i].value, NULL) < 0)
+        {
+            fprintf(stderr, "w25shell: limit: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+// SECTION ENDS: "DEADLINES AND LIMITS"
+
+// SECTION STARTS: "CPU PLACEMENT"
+/**
+ * Function to parse a CPU list such as "3", "0,2,4" or "0-3,8-11"
+ *
+ * @param text List text
+ * @param cpus Output CPUs in the order given
+ * @param max Capacity of cpus
+ * @return Number of CPUs, or -1 if text is not a CPU list
+ */
+int parse_cpu_list(const char *text, int *cpus, int max)
+{
+    int count = 0;
+    const char *p = text;
+
+    while (*p != '\0')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE || count + (last - first + 1) > max)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus[count++] = (int)cpu;
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+
+    return count > 0 ? count : -1;
+}
+
+/**
+ * Function to read one number from a sysfs topology file of a CPU
+ *
+ * @param cpu CPU number
+ * @param name File under /sys/devices/system/cpu/cpuN/topology
+ * @return The number, 0 if the file is missing
+ */
+long cpu_topology_value(int cpu, const char *name)
+{
+    char path[PATH_MAX];
+    long value = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld", &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
+
+/**
+ * Function to compare two sort keys for qsort()
+ *
+ * @param a First key
+ * @param b Second key
+ * @return Negative, zero or positive as a is less, equal or greater
+ */
+int compare_cpu_keys(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function to order the CPUs this shell may use so that neighbours share
+ * as much as possible: SMT siblings of a core first, then the other cores
+ * of the same package, then the next package / NUMA node. Built once.
+ *
+ * @return Number of CPUs in cpu_order, 0 if the topology is unknown
+ */
+int cpu_topology()
+{
+    if (cpu_order != NULL)
+        return cpu_order_count;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return 0;
+
+    int count = CPU_COUNT(&allowed);
+    unsigned long long *keys = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+    cpu_order = (int *)malloc(count * sizeof(int));
+    if (!keys || !cpu_order)
+    {
+        free(keys);
+        free(cpu_order);
+        cpu_order = NULL;
+        return 0;
+    }
+
+    // Key: package, node, core, CPU number (16 bits each)
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < count; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        // The NUMA node shows up as a nodeN link next to topology/
+        char path[PATH_MAX];
+        long node = 0;
+        for (int k = 0; k < SCHED_MAX_NODES; k++)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, k);
+            if (access(path, F_OK) == 0)
+            {
+                node = k;
+                break;
+            }
+        }
+
+        keys[n++] = (unsigned long long)(cpu_topology_value(cpu, "physical_package_id") & 0xffff) << 48 |
+                    (unsigned long long)(node & 0xffff) << 32 |
+                    (unsigned long long)(cpu_topology_value(cpu, "core_id") & 0xffff) << 16 | (unsigned)cpu;
+    }
+
+    qsort(keys, n, sizeof(unsigned long long), compare_cpu_keys);
+    for (int i = 0; i < n; i++)
+        cpu_order[i] = (int)(keys[i] & 0xffff);
+    free(keys);
+
+    cpu_order_count = n;
+    return n;
+}
+
+/**
+ * Function to pick the CPU for a stage of the pipeline being launched.
+ * With automatic placement each pipeline takes the next run of CPUs from
+ * cpu_order, so adjacent stages (a producer and its consumer) land on
+ * sibling cores and consecutive pipelines spread out. Stages must be
+ * placed in order, starting at 0 for every pipeline.
+ *
+ * @param stage Index of the stage in its pipeline
+ * @return CPU to pin the stage to, or -1 to leave it unpinned
+ */
+int sched_stage_cpu(int stage)
+{
+    if (stage_sched.placement == SCHED_PLACE_LIST)
+        return stage_sched.cpus[stage % stage_sched.cpu_count];
+    if (stage_sched.placement != SCHED_PLACE_AUTO || cpu_topology() == 0)
+        return -1;
+
+    if (stage == 0)
+        sched_base = sched_next;
+    sched_next = (sched_base + stage + 1) % cpu_order_count;
+    return cpu_order[(sched_base + stage) % cpu_order_count];
+}
+
+/**
+ * Function to tell whether stages need the sched settings installed
+ *
+ * @return 1 if nice, ionice or SCHED_BATCH is requested, 0 otherwise
+ */
+int sched_tuned()
+{
+    return stage_sched.nice != 0 || stage_sched.ioprio >= 0 || stage_sched.batch;
+}
+
+/**
+ * Function to install the sched settings on the calling thread: the
+ * child of a stage between fork and exec, or an in-process filter thread
+ * (Linux applies affinity, nice, ioprio and policy per thread)
+ *
+ * @param cpu CPU to pin to, -1 to leave the affinity alone
+ * @return 0 on success, -1 if a setting was refused (reported)
+ */
+int sched_apply(int cpu)
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        {
+            fprintf(stderr, "w25shell: sched: cpu %d: %s\n", cpu, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (stage_sched.nice != 0)
+    {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 || setpriority(PRIO_PROCESS, 0, current + stage_sched.nice) < 0)
+        {
+            fprintf(stderr, "w25shell: sched: nice: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (stage_sched.ioprio >= 0 && syscall(SYS_ioprio_set, SCHED_IOPRIO_WHO, 0, stage_sched.ioprio) < 0)
+    {
+        fprintf(stderr, "w25shell: sched: ionice: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (stage_sched.batch)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        if (sched_setscheduler(0, SCHED_BATCH, &param) < 0)
+        {
+            fprintf(stderr, "w25shell: sched: batch: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Function to parse a placement: "auto", "off" or a CPU list
+ *
+ * @param text Placement text
+ * @param settings Settings to update
+ * @return 0 on success, -1 if text is not a placement
+ */
+int sched_parse_placement(const char *text, sched_settings *settings)
+{
+    if (strcmp(text, "auto") == 0)
+    {
+        settings->placement = SCHED_PLACE_AUTO;
+        return 0;
+    }
+    if (strcmp(text, "off") == 0)
+    {
+        settings->placement = SCHED_PLACE_NONE;
+        return 0;
+    }
+
+    int cpus[SCHED_MAX_CPUS];
+    int count = parse_cpu_list(text, cpus, SCHED_MAX_CPUS);
+    if (count < 0)
+        return -1;
+    memcpy(settings->cpus, cpus, count * sizeof(int));
+    settings->placement = SCHED_PLACE_LIST;
+    settings->cpu_count = count;
+    return 0;
+}
+
+/**
+ * Function to recognise and strip a "sched [cpus=auto|off|LIST] [nice=N]
+ * [ionice=idle|be[:N]|rt[:N]] [batch]" prefix from the first command of a
+ * line. Stages are placed automatically unless cpus= says otherwise.
+ *
+ * @param cmd First command of the line (argv is shifted past the prefix)
+ * @param parsed Output settings (the current ones with the prefix applied)
+ * @return 1 if the prefix was present, 0 if not, -1 on a usage error
+ */
+int sched_prefix(command_node *cmd, sched_settings *parsed)
+{
+    static const char *classes[] = {"rt", "be", "idle"};
+
+    if (cmd->kind != CMD_EXEC || cmd->argc == 0 || strcmp(cmd->argv[0], "sched") != 0)
+        return 0;
+
+    *parsed = stage_sched;
+    parsed->placement = SCHED_PLACE_AUTO;
+
+    int used = 1;
+    int bad = 0;
+    for (char *word; !bad && (word = cmd->argv[used]) != NULL; used++)
+    {
+        if (strncmp(word, "cpus=", 5) == 0)
+        {
+            bad = sched_parse_placement(word + 5, parsed) < 0;
+        }
+        else if (strncmp(word, "nice=", 5) == 0)
+        {
+            char *end;
+            long nice_value = strtol(word + 5, &end, 10);
+            bad = end == word + 5 || *end != '\0' || nice_value < -39 || nice_value > 39;
+            parsed->nice = (int)nice_value;
+        }
+        else if (strncmp(word, "ionice=", 7) == 0)
+        {
+            // Class 1-3 in the top bits, level 0-7 (default 4) below
+            char *name = word + 7;
+            char *colon = strchr(name, ':');
+            long level = 4;
+            if (colon != NULL)
+            {
+                char *end;
+                level = strtol(colon + 1, &end, 10);
+                bad = end == colon + 1 || *end != '\0' || level < 0 || level > 7;
+            }
+            size_t len = colon != NULL ? (size_t)(colon - name) : strlen(name);
+            int k = 0;
+            while (k < 3 && (strlen(classes[k]) != len || strncmp(name, classes[k], len) != 0))
+                k++;
+            bad = bad || k == 3;
+            parsed->ioprio = (k + 1) << SCHED_IOPRIO_SHIFT | (k == 2 ? 0 : (int)level);
+        }
+        else if (strcmp(word, "batch") == 0)
+        {
+            parsed->batch = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (bad)
+    {
+        fprintf(stderr, "w25shell: sched: usage: sched [cpus=auto|off|LIST] [nice=N] "
+                        "[ionice=idle|be[:N]|rt[:N]] [batch] cmd ...\n");
+        return -1;
+    }
+
+    cmd->argv += used;
+    cmd->argc -= used;
+    return 1;
+}
+
+/**
+ * Function to run a line under "sched": every stage it launches is pinned
+ * and tuned in the child before exec (filter threads pin themselves)
+ *
+ * @param list Parsed line (the sched prefix already stripped)
+ * @param first Index of the first list item to run
+ * @param parsed Settings from sched_prefix()
+ * @return Exit status of the line
+ */
+int execute_sched_commands(list_node *list, int first, sched_settings *parsed)
+{
+    list_node rest = *list;
+    sched_settings outer = stage_sched;
+    int status = 0;
+
+    rest.items += first;
+    rest.background += first;
+    rest.count -= first;
+
+    stage_sched = *parsed;
+
+    if (rest.count > 0)
+        status = execute_sequential_commands(&rest);
+
+    stage_sched = outer;
+    return status;
+}
+
+/**
+ * Function to find the CPU a process last ran on. Still readable for a
+ * zombie, so time reads it before the stage is reaped.
+ *
+ * @param pid Process
+ * @return CPU number, -1 if unknown
+ */
+int process_last_cpu(pid_t pid)
+{
+    char path[64];
+    char stat[1024];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    stat[n] = '\0';
+
+    // processor is field 39; the command name (field 2) may contain spaces
+    char *p = strrchr(stat, ')');
+    for (int field = 2; p != NULL && field < 39; field++)
+        p = strchr(p + 1, ' ');
+
+    return p != NULL ? atoi(p + 1) : -1;
+}
+// SECTION ENDS: "CPU PLACEMENT"
+
+// SECTION STARTS: "PERFORMANCE COUNTERS"
+/**
+ * Function to open the pstat counters for a process or the calling thread
+ *
+ * @param pid Process to count (counting starts at its exec), or 0 for the
+ *            calling thread (counting starts now)
+ * @param fds Output descriptors, -1 for counters that could not be opened
+ * @return Number of counters opened
+ */
+int pstat_open(pid_t pid, int *fds)
+{
+    const pstat_event *events = pstat_software ? pstat_software_events : pstat_hardware_events;
+    int opened = 0;
+
+    for (int i = 0; i < PSTAT_EVENTS; i++)
+    {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_hv = 1;
+
+        // Software events such as context switches happen in the kernel;
+        // hardware ones are limited to user space (perf_event_paranoid 2)
+        attr.exclude_kernel = events[i].type != PERF_TYPE_SOFTWARE;
+
+        // A child is counted from its exec() on, including its own children
+        if (pid > 0)
+        {
+            attr.disabled = 1;
+            attr.enable_on_exec = 1;
+            attr.inherit = 1;
+        }
+
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0 && errno == EACCES && !attr.exclude_kernel)
+        {
+            attr.exclude_kernel = 1;
+            fds[i] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fds[i] >= 0)
+            opened++;
+    }
+
+    return opened;
+}
+
+/**
+ * Function to read and close a set of pstat counters. Counts are scaled
+ * up when the kernel had to multiplex the counters.
+ *
+ * @param fds Counter descriptors (-1 entries are skipped); reset to -1
+ * @param values Output counts, -1 for counters that were not available
+ */
+void pstat_read(int *fds, double *values)
+{
+    for (int i = 0; i < PSTAT_EVENTS; i++)
+    {
+        uint64_t data[3]; // value, time enabled, time running
+
+        values[i] = -1;
+        if (fds[i] < 0)
+            continue;
+
+        if (read(fds[i], data, sizeof(data)) == (ssize_t)sizeof(data))
+            values[i] = data[2] > 0 ? (double)data[0] * data[1] / data[2] : 0;
+
+        close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+/**
+ * Function to add a row to the pstat report
+ *
+ * @param pid Stage process, or 0 for a row that is already complete
+ * @return The new sample, or NULL on allocation failure
+ */
+pstat_sample *pstat_add(pid_t pid)
+{
+    if (pstat_count == pstat_capacity)
+    {
+        int capacity = pstat_capacity ? pstat_capacity * 2 : 8;
+        pstat_sample *grown = (pstat_sample *)realloc(pstat_samples, capacity * sizeof(pstat_sample));
+        if (!grown)
+            return NULL;
+        pstat_samples = grown;
+        pstat_capacity = capacity;
+    }
+
+    pstat_sample *sample = &pstat_samples[pstat_count++];
+    memset(sample, 0, sizeof(*sample));
+    sample->pid = pid;
+    for (int i = 0; i < PSTAT_EVENTS; i++)
+        sample->fds[i] = -1;
+    return sample;
+}
+
+/**
+ * Function called by the spawn path between fork() and releasing the
+ * child's gate: attach counters to the child before it can exec
+ *
+ * @param pid Freshly forked child, still waiting on its gate
+ */
+void pstat_attach(pid_t pid)
+{
+    pstat_sample *sample = pstat_add(pid);
+
+    if (sample != NULL)
+        pstat_open(pid, sample->fds);
+}
+
+/**
+ * Function to read a reaped stage's counters into its report row
+ *
+ * @param pid Stage that was just reaped
+ * @param cmd The stage (for its label)
+ */
+void pstat_collect(pid_t pid, command_node *cmd)
+{
+    for (int i = 0; i < pstat_count; i++)
+    {
+        pstat_sample *sample = &pstat_samples[i];
+        if (sample->pid != pid || sample->done)
+            continue;
+
+        char *text = pipeline_text(&cmd, 1, 0);
+        snprintf(sample->label, sizeof(sample->label), "%s", text ? text : "?");
+        free(text);
+
+        pstat_read(sample->fds, sample->values);
+        sample->done = 1;
+        return;
+    }
+}
+
+/**
+ * Function to add the counters of an in-process filter thread
+ *
+ * @param cmd The stage (for its label)
+ * @param values Counts read by the thread itself
+ */
+void pstat_record_thread(command_node *cmd, const double *values)
+{
+    pstat_sample *sample = pstat_add(0);
+    if (sample == NULL)
+        return;
+
+    char *text = pipeline_text(&cmd, 1, 0);
+    snprintf(sample->label, sizeof(sample->label), "*%s", text ? text : "?");
+    free(text);
+
+    memcpy(sample->values, values, sizeof(sample->values));
+    sample->done = 1;
+}
+
+/**
+ * Function to print one pstat column value
+ *
+ * @param value Count, or -1 if unavailable
+ */
+void pstat_print_value(double value)
+{
+    if (value < 0)
+        fprintf(stderr, " %12s", "-");
+    else
+        fprintf(stderr, " %12.0f", value);
+}
+
+/**
+ * Function to run a line under "pstat": every external stage is counted
+ * with perf_event_open() (cycles, instructions, cache references and
+ * misses, branch misses, task clock), in-process filters count their own
+ * thread. Hardware counters fall back to software events when the kernel
+ * or perf_event_paranoid does not allow them.
+ *
+ * @param list Parsed line (the pstat prefix already stripped)
+ * @param first Index of the first list item to run
+ * @return Exit status of the line
+ */
+int execute_pstat_commands(list_node *list, int first)
+{
+    list_node rest = *list;
+    int status = 0;
+
+    rest.items += first;
+    rest.background += first;
+    rest.count -= first;
+
+    // Probe once: can this process count cycles at all?
+    int probe[PSTAT_EVENTS];
+    double ignored[PSTAT_EVENTS];
+    pstat_software = 0;
+    pstat_open(0, probe);
+    if (probe[1] < 0)
+        pstat_software = 1;
+    pstat_read(probe, ignored);
+
+    pstat_active = 1;
+    pstat_count = 0;
+
+    if (rest.count > 0)
+        status = execute_sequential_commands(&rest);
+
+    pstat_active = 0;
+
+    const pstat_event *events = pstat_software ? pstat_software_events : pstat_hardware_events;
+    fflush(stdout);
+    if (pstat_software)
+        fprintf(stderr, "(hardware counters unavailable: software events)\n");
+
+    fprintf(stderr, "%-28s", "stage");
+    for (int i = 0; i < PSTAT_EVENTS; i++)
+        fprintf(stderr, " %12s", events[i].name);
+    fprintf(stderr, pstat_software ? "\n" : " %6s %7s\n", "IPC", "miss%");
+
+    for (int i = 0; i < pstat_count; i++)
+    {
+        pstat_sample *sample = &pstat_samples[i];
+
+        // Stages that never got reaped here (e.g. stopped) still get read
+        if (!sample->done)
+        {
+            snprintf(sample->label, sizeof(sample->label), "pid %d", (int)sample->pid);
+            pstat_read(sample->fds, sample->values);
+        }
+
+        fprintf(stderr, "%-28.28s", sample->label);
+        for (int j = 0; j < PSTAT_EVENTS; j++)
+            pstat_print_value(j == 0 && sample->values[0] >= 0 ? sample->values[0] / 1e6 : sample->values[j]);
+
+        if (!pstat_software)
+        {
+            double *v = sample->values;
+            if (v[1] > 0 && v[2] >= 0)
+                fprintf(stderr, " %6.2f", v[2] / v[1]);
+            else
+                fprintf(stderr, " %6s", "-");
+            if (v[3] > 0 && v[4] >= 0)
+                fprintf(stderr, " %6.1f%%", 100 * v[4] / v[3]);
+            else
+                fprintf(stderr, " %7s", "-");
+        }
+        fprintf(stderr, "\n");
+    }
+
+    return status;
+}
+// SECTION ENDS: "PERFORMANCE COUNTERS"
+
+// SECTION STARTS: "EXECUTION TRACE"
+/**
+ * Function to start writing a JSONL execution trace
+ *
+ * @param path File to append records to
+ * @return 0 on success, -1 on error (reported)
+ */
+int trace_open(const char *path)
+{
+    trace_close();
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0)
+    {
+        fprintf(stderr, "w25shell: trace: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    trace_ring = ring_create();
+    if (!trace_ring)
+    {
+        perror("Memory allocation failed");
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+
+    trace_stopping = 0;
+    if (pthread_create(&trace_thread, NULL, trace_flusher, NULL) != 0)
+    {
+        perror("Failed to start trace writer");
+        ring_destroy(trace_ring);
+        trace_ring = NULL;
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+
+    // Flush what is left however the shell exits
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(trace_close);
+        registered = 1;
+    }
+
+    free(trace_path);
+    trace_path = strdup(path);
+    trace_active = 1;
+    return 0;
+}
+
+/**
+ * Function to stop tracing: the writer drains the buffer, then exits
+ */
+void trace_close()
+{
+    if (!trace_ring)
+        return;
+
+    trace_active = 0;
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+
+    if (trace_dropped > 0)
+        fprintf(stderr, "w25shell: trace: %lu records dropped (writer fell behind)\n", trace_dropped);
+
+    ring_destroy(trace_ring);
+    trace_ring = NULL;
+    close(trace_fd);
+    trace_fd = -1;
+    trace_dropped = 0;
+    free(trace_path);
+    trace_path = NULL;
+}
+
+/**
+ * Writer thread: moves records from the ring to the trace file. It polls
+ * on a timer rather than being woken, so recording a command never costs
+ * the shell a syscall.
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+void *trace_flusher(void *arg)
+{
+    (void)arg;
+    spsc_ring *ring = trace_ring;
+    struct timespec pause = {0, TRACE_FLUSH_MS * 1000000L};
+
+    while (1)
+    {
+        // Read stopping before head, so nothing published before it is missed
+        int stopping = __atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            if (stopping)
+                break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // Write straight out of the ring, in two pieces around the wrap
+        size_t offset = tail & (RING_CAPACITY - 1);
+        size_t n = head - tail;
+        if (n > RING_CAPACITY - offset)
+            n = RING_CAPACITY - offset;
+
+        ssize_t written = write(trace_fd, ring->data + offset, n);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            written = n; // Trace file broken: discard rather than stall
+
+        __atomic_store_n(&ring->tail, tail + written, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Function to append one record to the trace ring without blocking;
+ * the record is dropped (and counted) if the writer has fallen behind
+ *
+ * @param record Bytes of the record
+ * @param len Length of the record
+ */
+void trace_push(const char *record, size_t len)
+{
+    spsc_ring *ring = trace_ring;
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (RING_CAPACITY - (head - tail) < len)
+    {
+        trace_dropped++;
+        return;
+    }
+
+    size_t offset = head & (RING_CAPACITY - 1);
+    size_t first = len < RING_CAPACITY - offset ? len : RING_CAPACITY - offset;
+    memcpy(ring->data + offset, record, first);
+    memcpy(ring->data, record + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to append a JSON string literal to a record buffer
+ *
+ * @param out Record buffer
+ * @param pos Current length, advanced past the literal
+ * @param size Capacity of out
+ * @param text String to escape
+ */
+void trace_escape(char *out, size_t *pos, size_t size, const char *text)
+{
+    size_t p = *pos;
+
+    if (p + 2 < size)
+        out[p++] = '"';
+
+    for (const unsigned char *c = (const unsigned char *)text; *c && p + 8 < size; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out[p++] = '\\';
+            out[p++] = *c;
+        }
+        else if (*c < 0x20)
+        {
+            p += snprintf(out + p, size - p, "\\u%04x", *c);
+        }
+        else
+        {
+            out[p++] = *c;
+        }
+    }
+
+    if (p + 1 < size)
+        out[p++] = '"';
+    *pos = p;
+}
+
+/**
+ * Function to remember how long launching a child took, until it is reaped
+ *
+ * @param pid Child that was launched
+ * @param seconds Time spent in fork()/posix_spawn()
+ */
+void trace_spawned(pid_t pid, double seconds)
+{
+    trace_spawn_pids[pid % TRACE_PENDING] = pid;
+    trace_spawn_times[pid % TRACE_PENDING] = seconds;
+}
+
+/**
+ * Function to record one executed command in the trace
+ *
+ * @param cmd Command that ran, or NULL for a whole subshell
+ * @param label Text of the subshell when cmd is NULL
+ * @param pid Its process, 0 if it ran inside the shell
+ * @param status Exit status
+ * @param run Seconds from launch to exit
+ * @param usage Resources it used
+ */
+void trace_record(command_node *cmd, const char *label, pid_t pid, int status, double run, const struct rusage *usage)
+{
+    static const char *kinds[] = {"exec", "append", "count", "concat"};
+    char record[TRACE_RECORD_SIZE];
+    size_t pos = 0;
+    double spawn = 0;
+
+    if (pid > 0 && trace_spawn_pids[pid % TRACE_PENDING] == pid)
+        spawn = trace_spawn_times[pid % TRACE_PENDING];
+
+    pos += snprintf(record + pos, sizeof(record) - pos, "{\"seq\":%lu,\"line_id\":%lu,\"line\":", ++trace_seq,
+                    trace_line_id);
+    trace_escape(record, &pos, sizeof(record) - 1, trace_line ? trace_line : "");
+    pos += snprintf(record + pos, sizeof(record) - pos, ",\"op\":\"%s\",\"pipe\":\"%s\",\"kind\":\"%s\",\"argv\":[",
+                    trace_list_op, trace_pipe_op,
+                    cmd == NULL                                        ? "subshell"
+                    : cmd->kind == CMD_EXEC && is_shell_command(cmd) ? "builtin"
+                                                                       : kinds[cmd->kind]);
+
+    if (cmd == NULL)
+        trace_escape(record, &pos, sizeof(record) - 64, label ? label : "");
+    for (int i = 0; cmd != NULL && i < cmd->argc && pos + 64 < sizeof(record); i++)
+    {
+        if (i > 0)
+            record[pos++] = ',';
+        trace_escape(record, &pos, sizeof(record) - 64, cmd->argv[i]);
+    }
+
+    if (pos + 512 > sizeof(record))
+        pos = sizeof(record) - 512; // Overlong argv: the record stays valid JSON minus args
+
+    pos += snprintf(record + pos, sizeof(record) - pos,
+                    "],\"in_process\":%s,\"parse_us\":%.1f,\"spawn_us\":%.1f,\"run_us\":%.1f,\"status\":%d,"
+                    "\"utime_us\":%ld,\"stime_us\":%ld,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,"
+                    "\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                    pid > 0 ? "false" : "true", trace_parse_seconds * 1e6, spawn * 1e6, run * 1e6, status,
+                    (long)(usage->ru_utime.tv_sec * 1000000L + usage->ru_utime.tv_usec),
+                    (long)(usage->ru_stime.tv_sec * 1000000L + usage->ru_stime.tv_usec), usage->ru_maxrss,
+                    usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw);
+
+    trace_push(record, pos < sizeof(record) ? pos : sizeof(record) - 1);
+}
+
+/**
+ * Function to pull the "line" string out of a trace record
+ *
+ * @param record One JSONL record (unescaped in place)
+ * @param line_id Output line_id of the record
+ * @return The line, or NULL if the record has none
+ */
+char *trace_parse_line(char *record, unsigned long *line_id)
+{
+    char *id = strstr(record, "\"line_id\":");
+    char *text = strstr(record, "\"line\":\"");
+    if (!id || !text)
+        return NULL;
+
+    *line_id = strtoul(id + 10, NULL, 10);
+
+    // Undo trace_escape() in place
+    char *in = text + 8;
+    char *out = in;
+    char *start = in;
+    while (*in && *in != '"')
+    {
+        if (*in == '\\' && in[1] == 'u')
+        {
+            *out++ = (char)strtol((char[]){in[2], in[3], in[4], in[5], 0}, NULL, 16);
+            in += 6;
+        }
+        else if (*in == '\\' && in[1])
+        {
+            *out++ = in[1];
+            in += 2;
+        }
+        else
+        {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return start;
+}
+
+/**
+ * Function to compare two doubles for qsort()
+ */
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function to re-execute the lines of a trace and report throughput and
+ * latency percentiles ("--replay FILE [REPEAT]"). Command output goes to
+ * /dev/null so only the shell's own cost and the commands' run time count.
+ *
+ * @param path Trace file
+ * @param repeat How many times to run the whole trace
+ * @return 0 on success, 1 on error
+ */
+int trace_replay(const char *path, long repeat)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+    {
+        fprintf(stderr, "w25shell: replay: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // Collect each traced line once, in order
+    char **lines = NULL;
+    int count = 0;
+    int capacity = 0;
+    unsigned long last_id = 0;
+    char *record = NULL;
+    size_t record_size = 0;
+
+    while (getline(&record, &record_size, in) > 0)
+    {
+        unsigned long id;
+        char *line = trace_parse_line(record, &id);
+        if (!line || *line == '\0' || (count > 0 && id == last_id))
+            continue;
+        last_id = id;
+
+        // The shell's own exits would end the replay, and tracing it again
+        // would measure the trace writer
+        if (strncmp(line, "killterm", 8) == 0 || strncmp(line, "killallterms", 12) == 0 ||
+            strncmp(line, "set trace", 9) == 0)
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = (char **)realloc(lines, capacity * sizeof(char *));
+            if (!grown)
+                break;
+            lines = grown;
+        }
+        lines[count++] = strdup(line);
+    }
+    free(record);
+    fclose(in);
+
+    if (count == 0)
+    {
+        fprintf(stderr, "w25shell: replay: no commands in %s\n", path);
+        free(lines);
+        return 1;
+    }
+
+    if (repeat < 1)
+        repeat = 1;
+    long runs = repeat * count;
+    double *latencies = (double *)malloc(runs * sizeof(double));
+    char *copy = NULL;
+    size_t copy_size = 0;
+
+    // Output of the replayed commands is not what is being measured
+    fflush(stdout);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    long done = 0;
+    int failed = 0;
+    double start = monotonic_seconds();
+
+    for (long r = 0; r < repeat && latencies; r++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            size_t len = strlen(lines[i]) + 1;
+            if (len > copy_size)
+            {
+                free(copy);
+                copy = (char *)malloc(len);
+                copy_size = copy ? len : 0;
+                if (!copy)
+                    break;
+            }
+            memcpy(copy, lines[i], len);
+
+            double t0 = monotonic_seconds();
+            arena_reset(&line_arena);
+            list_node *list = parse_input(copy);
+            if (list != NULL && execute_sequential_commands(list) != 0)
+                failed++;
+            latencies[done++] = monotonic_seconds() - t0;
+        }
+    }
+
+    double elapsed = monotonic_seconds() - start;
+
+    fflush(stdout);
+    if (saved_out >= 0)
+    {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+
+    if (done > 0)
+    {
+        qsort(latencies, done, sizeof(double), compare_doubles);
+        printf("replay lines=%d runs=%ld failed=%d elapsed=%.3fs throughput=%.1f lines/s\n", count, done, failed,
+               elapsed, done / elapsed);
+        printf("latency_ms p50=%.3f p90=%.3f p99=%.3f max=%.3f\n", latencies[done / 2] * 1e3,
+               latencies[done * 90 / 100] * 1e3, latencies[done * 99 / 100] * 1e3, latencies[done - 1] * 1e3);
+    }
+
+    for (int i = 0; i < count; i++)
+        free(lines[i]);
+    free(lines);
+    free(copy);
+    free(latencies);
+    return done > 0 ? 0 : 1;
+}
+// SECTION ENDS: "EXECUTION TRACE"
+
+// SECTION STARTS: "BENCHMARKS"
+/**
+ * Function to print one benchmark result as a JSON line
+ *
+ * @param name Benchmark name
+ * @param size_mb Size of the input file in MB (0 when there is none)
+ * @param unit Unit of value
+ * @param value Measured value
+ */
+void bench_emit(const char *name, long size_mb, const char *unit, double value)
+{
+    printf("{\"bench\":\"%s\",\"size_mb\":%ld,\"unit\":\"%s\",\"value\":%.3f}\n", name, size_mb, unit, value);
+    fflush(stdout);
+}
+
+/**
+ * Function to point a standard stream at a file for the duration of a
+ * measurement (the file operators report on stdout/stderr)
+ *
+ * @param target STDOUT_FILENO or STDERR_FILENO
+ * @param path File to write to (truncated)
+ * @return Copy of the original stream for bench_restore(), or -1
+ */
+int bench_redirect(int target, const char *path)
+{
+    fflush(stdout);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int saved = fcntl(target, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, target);
+    close(fd);
+    return saved;
+}
+
+/**
+ * Function to undo bench_redirect()
+ *
+ * @param target Stream that was redirected
+ * @param saved Value returned by bench_redirect()
+ */
+void bench_restore(int target, int saved)
+{
+    if (saved < 0)
+        return;
+
+    fflush(stdout);
+    dup2(saved, target);
+    close(saved);
+}
+
+/**
+ * Function to create a text file of the given size with a realistic mix
+ * of words and lines (lines of 1 to 16 words of 1 to 10 letters)
+ *
+ * @param path File to create
+ * @param size_mb Size in MB
+ * @return 0 on success, -1 on error (reported)
+ */
+int bench_make_file(const char *path, long size_mb)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "w25shell: bench: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // One megabyte of text, written as many times as needed
+    char *chunk = (char *)malloc(1 << 20);
+    if (!chunk)
+    {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t seed = 12345;
+    size_t pos = 0;
+    int words_left = 0;
+    while (pos < (1 << 20))
+    {
+        seed = seed * 1103515245 + 12345;
+        if (words_left == 0)
+            words_left = 1 + (seed >> 16) % 16;
+
+        int letters = 1 + (seed >> 8) % 10;
+        for (int i = 0; i < letters && pos < (1 << 20); i++)
+            chunk[pos++] = 'a' + (seed >> (i + 3)) % 26;
+        if (pos < (1 << 20))
+            chunk[pos++] = --words_left == 0 ? '\n' : ' ';
+    }
+    chunk[(1 << 20) - 1] = '\n';
+
+    int status = 0;
+    for (long i = 0; i < size_mb && status == 0; i++)
+    {
+        if (write(fd, chunk, 1 << 20) != (1 << 20))
+        {
+            fprintf(stderr, "w25shell: bench: %s: %s\n", path, strerror(errno));
+            status = -1;
+        }
+    }
+
+    free(chunk);
+    close(fd);
+    return status;
+}
+
+/**
+ * Function to measure how long execute_command() takes to run "true"
+ *
+ * @param backend SPAWN_BACKEND_* value to measure
+ * @param iterations Commands to run
+ * @return Microseconds per command
+ */
+double bench_launch(int backend, int iterations)
+{
+    int saved_backend = spawn_backend;
+    spawn_backend = backend;
+
+    char line[] = "true";
+    arena_reset(&line_arena);
+    list_node *list = parse_input(line);
+    command_node *cmd = list->items[0]->items[0]->stages[0];
+
+    execute_command(cmd); // Resolve the path and warm the caches
+    double start = monotonic_seconds();
+    for (int i = 0; i < iterations; i++)
+        execute_command(cmd);
+    double elapsed = monotonic_seconds() - start;
+
+    spawn_backend = saved_backend;
+    return elapsed * 1e6 / iterations;
+}
+
+/**
+ * Function to measure the throughput of a pipeline of cat stages reading
+ * a file, through execute_piped_commands() or, written with =, through
+ * execute_reverse_piped_commands()
+ *
+ * @param file Input file
+ * @param size_mb Its size in MB
+ * @param stages Stages in the pipeline (2 or more)
+ * @param reverse Use = instead of |
+ * @return Best MB/s over BENCH_REPEATS runs
+ */
+double bench_pipeline(const char *file, long size_mb, int stages, int reverse)
+{
+    char line[PATH_MAX + 256];
+    int len = 0;
+
+    // cat FILE | cat | ... | cat > /dev/null, or the same written right to left
+    if (reverse)
+    {
+        len += snprintf(line + len, sizeof(line) - len, "cat > /dev/null");
+        for (int i = 1; i < stages - 1; i++)
+            len += snprintf(line + len, sizeof(line) - len, " = cat");
+        snprintf(line + len, sizeof(line) - len, " = cat %s", file);
+    }
+    else
+    {
+        len += snprintf(line + len, sizeof(line) - len, "cat %s", file);
+        for (int i = 1; i < stages - 1; i++)
+            len += snprintf(line + len, sizeof(line) - len, " | cat");
+        snprintf(line + len, sizeof(line) - len, " | cat > /dev/null");
+    }
+
+    double best = 0;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        char copy[sizeof(line)];
+        memcpy(copy, line, sizeof(line));
+        arena_reset(&line_arena);
+        list_node *list = parse_input(copy);
+        pipeline_node *pipeline = list->items[0]->items[0];
+
+        double start = monotonic_seconds();
+        if (reverse)
+            execute_reverse_piped_commands(pipeline->stages, pipeline->count, pipeline->pipe_sizes);
+        else
+            execute_piped_commands(pipeline->stages, pipeline->count, pipeline->pipe_sizes);
+        double rate = size_mb / (monotonic_seconds() - start);
+        if (rate > best)
+            best = rate;
+    }
+
+    return best;
+}
+
+/**
+ * Function to measure the word counter (without its result cache)
+ *
+ * @param file Input file
+ * @param size_mb Its size in MB
+ * @return Best MB/s over BENCH_REPEATS runs
+ */
+double bench_count(const char *file, long size_mb)
+{
+    double best = 0;
+
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        word_counts counts;
+        double start = monotonic_seconds();
+        if (count_file(file, 0, &counts) < 0)
+            return 0;
+        double rate = size_mb / (monotonic_seconds() - start);
+        if (rate > best)
+            best = rate;
+    }
+
+    return best;
+}
+
+/**
+ * Function to measure "file + file > out" through concatenate_files()
+ *
+ * @param file Input file (concatenated with itself)
+ * @param out Scratch output file
+ * @param size_mb Size of the input in MB
+ * @return Best MB/s (of input read) over BENCH_REPEATS runs
+ */
+double bench_concat(const char *file, const char *out, long size_mb)
+{
+    char *files[] = {(char *)file, (char *)file};
+    double best = 0;
+    int saved_err = bench_redirect(STDERR_FILENO, "/dev/null");
+
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        int saved_out = bench_redirect(STDOUT_FILENO, out);
+        if (saved_out < 0)
+            break;
+
+        double start = monotonic_seconds();
+        concatenate_files(files, 2);
+        double rate = 2 * size_mb / (monotonic_seconds() - start);
+        bench_restore(STDOUT_FILENO, saved_out);
+        if (rate > best)
+            best = rate;
+    }
+
+    bench_restore(STDERR_FILENO, saved_err);
+    unlink(out);
+    return best;
+}
+
+/**
+ * Function to measure "a ~ b" through append_files(). Both files are cut
+ * back to their original size between runs.
+ *
+ * @param file Input file (copied to the two operands)
+ * @param a First scratch operand
+ * @param b Second scratch operand
+ * @param size_mb Size of the input in MB
+ * @return Best MB/s (of data appended) over BENCH_REPEATS runs
+ */
+double bench_append(const char *file, const char *a, const char *b, long size_mb)
+{
+    char *files[] = {(char *)file};
+    double best = 0;
+    int saved_err = bench_redirect(STDERR_FILENO, "/dev/null");
+
+    // Two independent copies of the input
+    for (int i = 0; i < 2; i++)
+    {
+        int saved_out = bench_redirect(STDOUT_FILENO, i == 0 ? a : b);
+        concatenate_files(files, 1);
+        bench_restore(STDOUT_FILENO, saved_out);
+    }
+
+    int saved_out = bench_redirect(STDOUT_FILENO, "/dev/null");
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        if (truncate(a, size_mb << 20) < 0 || truncate(b, size_mb << 20) < 0)
+            break;
+
+        double start = monotonic_seconds();
+        if (append_files((char *)a, (char *)b) != 0)
+            break;
+        double rate = 2 * size_mb / (monotonic_seconds() - start);
+        if (rate > best)
+            best = rate;
+    }
+    bench_restore(STDOUT_FILENO, saved_out);
+    bench_restore(STDERR_FILENO, saved_err);
+
+    unlink(a);
+    unlink(b);
+    return best;
+}
+
+/**
+ * Function to run the benchmark suite ("--bench [SIZE_MB]..."). Results
+ * are printed one JSON object per line; bench/compare.sh checks them
+ * against bench/baseline.jsonl. Scratch files go to $W25SHELL_BENCH_DIR
+ * (default /tmp) and are removed afterwards.
+ *
+ * @param sizes File sizes in MB, as given on the command line
+ * @param count Number of sizes (0 = BENCH_DEFAULT_SIZES)
+ * @return 0 on success, 1 on error
+ */
+int run_benchmarks(char **sizes, int count)
+{
+    static char *default_sizes[] = BENCH_DEFAULT_SIZES;
+    char file[PATH_MAX];
+    char out[PATH_MAX];
+    char other[PATH_MAX];
+
+    if (count == 0)
+    {
+        sizes = default_sizes;
+        count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    }
+
+    const char *dir = getenv("W25SHELL_BENCH_DIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    snprintf(file, sizeof(file), "%s/w25bench.%d.in", dir, (int)getpid());
+    snprintf(out, sizeof(out), "%s/w25bench.%d.out", dir, (int)getpid());
+    snprintf(other, sizeof(other), "%s/w25bench.%d.other", dir, (int)getpid());
+
+    // Measure the shell's own pipe plumbing, not the in-process filters
+    inprocess_filters = 0;
+
+    bench_emit("launch_spawn", 0, "us", bench_launch(SPAWN_BACKEND_SPAWN, BENCH_LAUNCHES));
+    bench_emit("launch_fork", 0, "us", bench_launch(SPAWN_BACKEND_FORK, BENCH_LAUNCHES));
+    bench_emit("launch_zygote", 0, "us", bench_launch(SPAWN_BACKEND_ZYGOTE, BENCH_LAUNCHES));
+
+    // Once the shell has grown, fork() copies its page tables; the zygote
+    // was forked before that and does not (4 KiB pages, like a heap built
+    // from many small allocations)
+    size_t heap_size = (size_t)BENCH_HEAP_MB << 20;
+    char *heap = (char *)mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (heap != MAP_FAILED)
+    {
+        madvise(heap, heap_size, MADV_NOHUGEPAGE);
+        memset(heap, 1, heap_size);
+        bench_emit("launch_fork_heap", BENCH_HEAP_MB, "us", bench_launch(SPAWN_BACKEND_FORK, BENCH_LAUNCHES));
+        bench_emit("launch_zygote_heap", BENCH_HEAP_MB, "us", bench_launch(SPAWN_BACKEND_ZYGOTE, BENCH_LAUNCHES));
+        munmap(heap, heap_size);
+    }
+    zygote_stop();
+
+    long parsed;
+    double allocs;
+    bench_emit("parse", 0, "lines/s", 1e9 / parse_benchmark_run(PARSE_BENCH_ITERATIONS / 4, &parsed, &allocs));
+
+    for (int s = 0; s < count; s++)
+    {
+        long size_mb = atol(sizes[s]);
+        if (size_mb < 1 || bench_make_file(file, size_mb) < 0)
+        {
+            fprintf(stderr, "w25shell: bench: bad size '%s'\n", sizes[s]);
+            unlink(file);
+            return 1;
+        }
+
+        char name[32];
+        for (int stages = 2; stages <= 6; stages++)
+        {
+            snprintf(name, sizeof(name), "pipe_%d", stages);
+            bench_emit(name, size_mb, "MB/s", bench_pipeline(file, size_mb, stages, 0));
+            snprintf(name, sizeof(name), "reverse_pipe_%d", stages);
+            bench_emit(name, size_mb, "MB/s", bench_pipeline(file, size_mb, stages, 1));
+        }
+
+        bench_emit("count_words", size_mb, "MB/s", bench_count(file, size_mb));
+        bench_emit("concatenate", size_mb, "MB/s", bench_concat(file, out, size_mb));
+        bench_emit("append", size_mb, "MB/s", bench_append(file, out, other, size_mb));
+
+        unlink(file);
+    }
+
+    return 0;
+}
+// SECTION ENDS: "BENCHMARKS"
+
+// SECTION STARTS: "SEQUENTIAL EXECUTION"
+/**
+ * Function to tell whether stripping a line prefix ("time ; a" or
+ * "parallel ; a") left nothing but an empty first command
+ *
+ * @param list Parsed line
+ * @return 1 if the first list item is now empty, 0 otherwise
+ */
+int list_head_empty(list_node *list)
+{
+    command_node *head = list->items[0]->items[0]->stages[0];
+
+    return head->argc == 0 && head->redirs == NULL && list->items[0]->count == 1 &&
+           list->items[0]->items[0]->count == 1;
+}
+
+/**
+ * Function to execute sequential commands (;)
+ *
+ * @param list And-or lists separated by ;
+ * @return Exit status of the last and-or list
+ */
+int execute_sequential_commands(list_node *list)
+{
+    int status = 0;
+    int jobs;
+
+    // "time" / "pstat" in front of a line report on everything it runs
+    command_node *head = list->items[0]->items[0]->stages[0];
+    if (command_prefix(head, "time"))
+    {
+        return execute_timed_commands(list, list_head_empty(list));
+    }
+    if (command_prefix(head, "pstat"))
+    {
+        return execute_pstat_commands(list, list_head_empty(list));
+    }
+
+    // "timeout DURATION" / "limit KEY=VALUE..." bound everything it runs,
+    // "sched ..." places and tunes it
+    double seconds;
+    int prefix = deadline_prefix(head, &seconds);
+    if (prefix < 0)
+        return 2;
+    if (prefix > 0)
+    {
+        return execute_deadline_commands(list, list_head_empty(list), seconds);
+    }
+    resource_limit parsed[LIMIT_MAX];
+    int parsed_count;
+    prefix = limit_prefix(head, parsed, &parsed_count);
+    if (prefix < 0)
+        return 2;
+    if (prefix > 0)
+    {
+        return execute_limited_commands(list, list_head_empty(list), parsed, parsed_count);
+    }
+    sched_settings tuned;
+    prefix = sched_prefix(head, &tuned);
+    if (prefix < 0)
+        return 2;
+    if (prefix > 0)
+    {
+        return execute_sched_commands(list, list_head_empty(list), &tuned);
+    }
+
+    // "parallel [-j N]" in front of a line runs all of its lists at once
+    prefix = parallel_prefix(head, &jobs);
+    if (prefix < 0)
+        return 2;
+    if (prefix > 0)
+    {
+        return execute_parallel_commands(list, list_head_empty(list), jobs);
+    }
+
+    // Execute each and-or list sequentially, until a signal ends the line
+    for (int i = 0; i < list->count && !event_stopping(); i++)
+    {
+        trace_list_op = i == 0 ? "" : list->background[i - 1] ? "&" : ";";
+        if (list->background[i])
+            status = execute_background(list->items[i]);
+        else
+            status = execute_conditional_commands(list->items[i]);
+    }
+
+    return status;
+}
+// SECTION ENDS: "SEQUENTIAL EXECUTION"
+
+// SECTION STARTS: "CONDITIONAL EXECUTION"
+/**
+ * Function to execute conditional commands (&& and ||)
+ *
+ * @param node Pipelines joined by && / ||
+ * @return Exit status of the last pipeline that ran
+ */
+int execute_conditional_commands(and_or_node *node)
+{
+    // Execute first pipeline
+    int status = execute_pipeline(node->items[0]);
+
+    // Execute remaining pipelines based on previous results
+    for (int i = 1; i < node->count; i++)
+    {
+        int execute = 0;
+
+        // Determine whether to execute current pipeline based on operator
+        if (node->ops[i - 1] == OP_AND && status == 0)
+        {
+            // Execute if previous command succeeded (&&)
+            execute = 1;
+        }
+        else if (node->ops[i - 1] == OP_OR && status != 0)
+        {
+            // Execute if previous command failed (||)
+            execute = 1;
+        }
+
+        if (execute)
+        {
+            trace_list_op = node->ops[i - 1] == OP_AND ? "&&" : "||";
+            status = execute_pipeline(node->items[i]);
+        }
+    }
+
+    return status;
+}
+// SECTION ENDS: "CONDITIONAL EXECUTION"
+
+// SECTION STARTS: "FILE OPERATIONS - APPEND"
+/**
+ * Function to append contents between two text files.
+ * Both original sizes are captured before anything is written, so file1
+ * receives exactly the original file2 and file2 exactly the original
+ * file1. Each direction is a single copy_file_range() over that byte range.
+ *
+ * @param file1 First file
+ * @param file2 Second file
+ * @return Exit status (0 on success)
+ */
+int append_files(char *file1, char *file2)
+{
+    struct stat st1, st2;
+    int flags = append_mode == APPEND_ATOMIC ? O_RDONLY : O_RDWR;
+
+    int fd1 = open(file1, flags | O_CLOEXEC);
+    if (fd1 < 0)
+    {
+        perror("Failed to open first file");
+        return 1;
+    }
+
+    int fd2 = open(file2, flags | O_CLOEXEC);
+    if (fd2 < 0)
+    {
+        perror("Failed to open second file");
+        close(fd1);
+        return 1;
+    }
+
+    // Record both original sizes before writing anything
+    if (fstat(fd1, &st1) < 0 || fstat(fd2, &st2) < 0)
+    {
+        perror("Failed to stat files");
+        close(fd1);
+        close(fd2);
+        return 1;
+    }
+
+    int failed;
+
+    if (append_mode == APPEND_ATOMIC)
+    {
+        // Originals are never modified in place; each result is renamed over
+        failed = append_atomic(file1, fd1, st1.st_size, fd2, st2.st_size) < 0 ||
+                 append_atomic(file2, fd2, st2.st_size, fd1, st1.st_size) < 0;
+    }
+    else
+    {
+        // file1 += original file2, then file2 += original file1
+        failed = copy_range(fd2, 0, fd1, st1.st_size, st2.st_size) < 0 ||
+                 copy_range(fd1, 0, fd2, st2.st_size, st1.st_size) < 0;
+
+        if (!failed && append_mode == APPEND_FSYNC)
+            failed = fsync(fd1) < 0 || fsync(fd2) < 0;
+    }
+
+    if (failed)
+        perror("Failed to append files");
+
+    close(fd1);
+    close(fd2);
+
+    if (!failed)
+        printf("Files appended successfully\n");
+
+    return failed;
+}
+
+/**
+ * Function to produce "target + source" as a new file and atomically
+ * replace target with it. A symlink is followed, so the file it points to
+ * is replaced rather than the link; owner and mode are carried over (hard
+ * links to the old file keep the old contents). The temp file lives next
+ * to the real target so the final rename() stays on one filesystem; the
+ * directory is fsynced afterwards so the rename itself survives a crash.
+ *
+ * @param target Path of the file being extended
+ * @param target_fd Open descriptor of the original target
+ * @param target_size Original size of target
+ * @param source_fd Open descriptor of the file being appended
+ * @param source_size Original size of source
+ * @return 0 on success, -1 on error (errno set)
+ */
+int append_atomic(const char *target, int target_fd, off_t target_size, int source_fd, off_t source_size)
+{
+    char real[PATH_MAX], dir_buf[PATH_MAX], base_buf[PATH_MAX], temp[PATH_MAX];
+    struct stat st;
+
+    if (realpath(target, real) == NULL)
+        return -1;
+
+    snprintf(dir_buf, sizeof(dir_buf), "%s", real);
+    snprintf(base_buf, sizeof(base_buf), "%s", real);
+    char *dir = dirname(dir_buf);
+    char *base = basename(base_buf);
+
+    if (snprintf(temp, sizeof(temp), "%s/.%s.w25XXXXXX", dir, base) >= (int)sizeof(temp))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int temp_fd = mkostemp(temp, O_CLOEXEC);
+    if (temp_fd < 0)
+        return -1;
+
+    // Original contents first (a reflink where supported), then the source
+    int failed = copy_range(target_fd, 0, temp_fd, 0, target_size) < 0 ||
+                 copy_range(source_fd, 0, temp_fd, target_size, source_size) < 0;
+
+    // Keep the original owner and permissions (chown first: it may clear
+    // set-id bits). Only root can give the file away to another user.
+    if (!failed && fstat(target_fd, &st) == 0)
+    {
+        if (fchown(temp_fd, st.st_uid, st.st_gid) < 0)
+            fchown(temp_fd, -1, st.st_gid);
+        fchmod(temp_fd, st.st_mode & 07777);
+    }
+
+    if (!failed)
+        failed = fsync(temp_fd) < 0;
+
+    int saved_errno = errno;
+    close(temp_fd);
+
+    if (failed || rename(temp, real) < 0)
+    {
+        if (!failed)
+            saved_errno = errno;
+        unlink(temp);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Persist the directory entry change
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return 0;
+}
+// SECTION ENDS: "FILE OPERATIONS - APPEND"
+
+// SECTION STARTS: "FILE OPERATIONS - COUNT WORDS"
+/**
+ * Function to handle the # operator: "# [--threads N] [--verify] file"
+ *
+ * @param args Operands of the # operator
+ * @return Exit status (0 on success)
+ */
+int count_words_command(char **args)
+{
+    int threads = 0; // 0 = pick automatically from file size and CPU count
+    int verify = 0;
+    char *filename = NULL;
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "--threads") == 0 && args[i + 1] != NULL)
+        {
+            threads = atoi(args[++i]);
+            if (threads < 1)
+            {
+                fprintf(stderr, "w25shell: --threads expects a positive number\n");
+                return 1;
+            }
+        }
+        else if (strcmp(args[i], "--verify") == 0)
+        {
+            verify = 1;
+        }
+        else
+        {
+            filename = args[i];
+        }
+    }
+
+    if (filename == NULL)
+    {
+        fprintf(stderr, "w25shell: # expects a file name\n");
+        return 1;
+    }
+
+    return count_words(filename, threads, verify);
+}
+
+/**
+ * Function to count words in a text file
+ *
+ * @param filename Name of the file
+ * @param threads Worker threads to use (0 = automatic)
+ * @param verify Also run the byte-at-a-time reference counter and compare
+ * @return Exit status (0 on success)
+ */
+int count_words(char *filename, int threads, int verify)
+{
+    word_counts counts;
+
+    if (count_file_cached(filename, threads, &counts) < 0)
+    {
+        fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    printf("Number of words in %s: %llu (lines: %llu, bytes: %llu)\n", filename, counts.words, counts.lines,
+           counts.bytes);
+
+    if (verify)
+    {
+        word_counts expected;
+
+        if (count_words_reference(filename, &expected) < 0)
+        {
+            fprintf(stderr, "Failed to verify %s: %s\n", filename, strerror(errno));
+            return 1;
+        }
+        else if (expected.words != counts.words || expected.lines != counts.lines || expected.bytes != counts.bytes)
+        {
+            printf("Verification FAILED: reference counted %llu words, %llu lines, %llu bytes\n", expected.words,
+                   expected.lines, expected.bytes);
+            return 1;
+        }
+        else
+        {
+            printf("Verification passed\n");
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Function to classify a byte as a word separator (space, \t or \n)
+ *
+ * @param c Byte to classify
+ * @return Non-zero for a separator
+ */
+static inline int is_word_space(unsigned char c)
+{
+    return c == ' ' || c == '\n' || c == '\t';
+}
+
+/**
+ * Function to count a block one byte at a time
+ *
+ * @param p Data to count
+ * @param len Number of bytes
+ * @param in_word In/out: whether the byte before p was part of a word
+ * @param counts Counts to add to
+ */
+void count_block_scalar(const unsigned char *p, size_t len, int *in_word, word_counts *counts)
+{
+    int state = *in_word;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int space = is_word_space(p[i]);
+        counts->words += !space & !state;
+        counts->lines += p[i] == '\n';
+        state = !space;
+    }
+
+    *in_word = state;
+}
+
+#if defined(__x86_64__)
+/**
+ * Function to count a block 16 bytes at a time with SSE2.
+ * A word starts at every non-whitespace byte whose predecessor is
+ * whitespace, so starts = nonspace & ~(nonspace << 1 | carry-in).
+ *
+ * @param p Data to count
+ * @param len Number of bytes
+ * @param in_word In/out: whether the byte before p was part of a word
+ * @param counts Counts to add to
+ */
+void count_block_sse2(const unsigned char *p, size_t len, int *in_word, word_counts *counts)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    unsigned int carry = *in_word;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i nl = _mm_cmpeq_epi8(v, newline);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)), nl);
+
+        unsigned int nonspace = ~(unsigned int)_mm_movemask_epi8(ws) & 0xFFFF;
+        unsigned int starts = nonspace & ~((nonspace << 1) | carry);
+
+        counts->words += __builtin_popcount(starts);
+        counts->lines += __builtin_popcount(_mm_movemask_epi8(nl));
+        carry = nonspace >> 15;
+    }
+
+    int state = carry;
+    count_block_scalar(p + i, len - i, &state, counts);
+    *in_word = state;
+}
+
+/**
+ * Function to count a block 32 bytes at a time with AVX2 (see SSE2 version)
+ *
+ * @param p Data to count
+ * @param len Number of bytes
+ * @param in_word In/out: whether the byte before p was part of a word
+ * @param counts Counts to add to
+ */
+__attribute__((target("avx2,popcnt"))) void count_block_avx2(const unsigned char *p, size_t len, int *in_word,
+                                                              word_counts *counts)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    unsigned int carry = *in_word;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i nl = _mm256_cmpeq_epi8(v, newline);
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)), nl);
+
+        unsigned int nonspace = ~(unsigned int)_mm256_movemask_epi8(ws);
+        unsigned int starts = nonspace & ~((nonspace << 1) | carry);
+
+        counts->words += __builtin_popcount(starts);
+        counts->lines += __builtin_popcount((unsigned int)_mm256_movemask_epi8(nl));
+        carry = nonspace >> 31;
+    }
+
+    int state = carry;
+    count_block_sse2(p + i, len - i, &state, counts);
+    *in_word = state;
+}
+#endif
+
+/**
+ * Function to count a block with the fastest kernel this CPU supports
+ *
+ * @param p Data to count
+ * @param len Number of bytes
+ * @param in_word In/out: whether the byte before p was part of a word
+ * @param counts Counts to add to
+ */
+void count_block(const unsigned char *p, size_t len, int *in_word, word_counts *counts)
+{
+#if defined(__x86_64__)
+    static int has_avx2 = -1;
+
+    if (has_avx2 < 0)
+        has_avx2 = __builtin_cpu_supports("avx2");
+
+    if (has_avx2)
+        count_block_avx2(p, len, in_word, counts);
+    else
+        count_block_sse2(p, len, in_word, counts);
+#else
+    count_block_scalar(p, len, in_word, counts);
+#endif
+    counts->bytes += len;
+}
+
+/**
+ * Thread pool task: count one chunk of a mapping. The word state is seeded
+ * from the byte before the chunk, so a word spanning two chunks is only
+ * counted by the chunk it starts in and the results simply add up.
+ *
+ * @param arg Array of word_chunk
+ * @param index Chunk to count
+ */
+void count_chunk_task(void *arg, int index)
+{
+    word_chunk *chunk = (word_chunk *)arg + index;
+    int in_word = chunk->start > 0 && !is_word_space(chunk->data[chunk->start - 1]);
+
+    memset(&chunk->counts, 0, sizeof(chunk->counts));
+    count_block(chunk->data + chunk->start, chunk->end - chunk->start, &in_word, &chunk->counts);
+}
+
+/**
+ * Function to count words, lines and bytes of a file in one pass.
+ * Regular files are mmap'ed and, when large, split into chunks counted on
+ * the worker pool; anything else (pipes, devices) is read in large blocks.
+ *
+ * @param filename Name of the file
+ * @param threads Worker threads to use (0 = automatic)
+ * @param counts Output counts
+ * @return 0 on success, -1 on error (errno set)
+ */
+int count_file(const char *filename, int threads, word_counts *counts)
+{
+    struct stat st;
+
+    memset(counts, 0, sizeof(*counts));
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && count_region(fd, 0, st.st_size, threads, counts) == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    // Non-seekable or unmappable input: stream it through large reads
+    char *buffer = copy_buffer();
+    int in_word = 0;
+
+    if (buffer == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while (1)
+    {
+        ssize_t n = read(fd, buffer, COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        count_block((const unsigned char *)buffer, n, &in_word, counts);
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Function to count bytes [start, end) of a regular file through mmap.
+ * The mapping begins at or before start - 1, so the word state at start is
+ * derived from the real preceding byte; counts for consecutive regions
+ * therefore add up exactly.
+ *
+ * @param fd Open descriptor of the file
+ * @param start First byte to count
+ * @param end One past the last byte to count
+ * @param threads Worker threads to use (0 = automatic)
+ * @param counts Counts to add to
+ * @return 0 on success, -1 if the region could not be mapped
+ */
+int count_region(int fd, off_t start, off_t end, int threads, word_counts *counts)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t map_off = start > 0 ? ((start - 1) & ~(off_t)(page - 1)) : 0;
+    size_t map_len = end - map_off;
+    size_t size = end - start;
+
+    const unsigned char *data = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_off);
+    if (data == MAP_FAILED)
+        return -1;
+
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = size >= WC_PARALLEL_MIN && cpus > 1 ? (int)cpus : 1;
+    }
+
+    // Never hand a worker a chunk too small to be worth the wakeup
+    if ((size_t)threads > size / WC_CHUNK_MIN)
+        threads = size / WC_CHUNK_MIN > 0 ? (int)(size / WC_CHUNK_MIN) : 1;
+
+    madvise((void *)data, map_len, threads > 1 ? MADV_WILLNEED : MADV_SEQUENTIAL);
+
+    word_chunk chunks[threads];
+    size_t base = start - map_off;
+    for (int i = 0; i < threads; i++)
+    {
+        chunks[i].data = data;
+        chunks[i].start = base + size / threads * i;
+        chunks[i].end = i == threads - 1 ? base + size : base + size / threads * (i + 1);
+    }
+
+    if (threads == 1 || thread_pool_run(count_chunk_task, chunks, threads) < 0)
+    {
+        // Single-threaded (or the pool could not start): count inline
+        for (int i = 0; i < threads; i++)
+            count_chunk_task(chunks, i);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        counts->words += chunks[i].counts.words;
+        counts->lines += chunks[i].counts.lines;
+        counts->bytes += chunks[i].counts.bytes;
+    }
+
+    munmap((void *)data, map_len);
+    return 0;
+}
+
+/**
+ * Function to count a file the original way, one fgetc() per byte.
+ * Kept as the reference the vectorised counter is checked against.
+ *
+ * @param filename Name of the file
+ * @param counts Output counts
+ * @return 0 on success, -1 on error (errno set)
+ */
+int count_words_reference(const char *filename, word_counts *counts)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        return -1;
+
+    int in_word = 0;
+    int c;
+
+    memset(counts, 0, sizeof(*counts));
+
+    while ((c = fgetc(file)) != EOF)
+    {
+        counts->bytes++;
+        if (c == '\n')
+            counts->lines++;
+
+        if (c == ' ' || c == '\n' || c == '\t')
+        {
+            in_word = 0;
+        }
+        else if (in_word == 0)
+        {
+            in_word = 1;
+            counts->words++;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+// SECTION ENDS: "FILE OPERATIONS - COUNT WORDS"
+
+// SECTION STARTS: "SHELL REGISTRY"
+/**
+ * Function to get the registry value identifying a process: its start
+ * time (which differs between a process and any later one reusing its PID)
+ * above its PID
+ *
+ * @param pid Process to identify
+ * @return Identity, or 0 if the process does not exist
+ */
+uint64_t registry_identity(pid_t pid)
+{
+    char path[64];
+    char stat[512];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    stat[n] = '\0';
+
+    // starttime is field 22; the command name (field 2) may contain spaces
+    char *p = strrchr(stat, ')');
+    for (int field = 2; p != NULL && field < 22; field++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL)
+        return 0;
+
+    unsigned long long started = strtoull(p + 1, NULL, 10);
+    return (uint64_t)started << REGISTRY_PID_BITS | (uint64_t)pid;
+}
+
+/**
+ * Function to map the registry of running shells, creating it on first
+ * use. It lives in /dev/shm and is shared by every shell of the user.
+ *
+ * @return 0 on success, -1 if no registry is available
+ */
+int registry_open()
+{
+    if (registry != NULL)
+        return 0;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/shm/w25shell-%d.registry", (int)getuid());
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return -1;
+
+    // Size (or re-initialise) the file under an exclusive lock. Every
+    // shell keeps it mapped, so it is only ever grown: shrinking it would
+    // kill them with SIGBUS. A stale header is reset below.
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < (off_t)sizeof(registry_file) && ftruncate(fd, sizeof(registry_file)) < 0))
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    registry_file *file = mmap(NULL, sizeof(registry_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    if (file->magic != REGISTRY_MAGIC || file->version != REGISTRY_VERSION || file->slots != REGISTRY_SLOTS)
+    {
+        memset(file, 0, sizeof(registry_file));
+        file->magic = REGISTRY_MAGIC;
+        file->version = REGISTRY_VERSION;
+        file->slots = REGISTRY_SLOTS;
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    registry = file;
+    return 0;
+}
+
+/**
+ * Function to claim a registry slot for this shell. Free slots are taken
+ * with compare-and-swap; when none is left, slots of shells that died
+ * without deregistering are reclaimed.
+ */
+void registry_register()
+{
+    uint64_t me = registry_identity(getpid());
+    if (me == 0 || registry_open() < 0)
+        return;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < REGISTRY_SLOTS; i++)
+        {
+            uint64_t owner = __atomic_load_n(&registry->owners[i], __ATOMIC_ACQUIRE);
+
+            // Second pass: a slot whose owner no longer exists is free too
+            if (owner != 0 && (pass == 0 || registry_identity(owner & REGISTRY_PID_MASK) == owner))
+                continue;
+
+            if (__atomic_compare_exchange_n(&registry->owners[i], &owner, me, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+            {
+                if (registry_self == 0)
+                    atexit(registry_deregister);
+                registry_slot = i;
+                registry_self = me;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Function to release this shell's registry slot
+ */
+void registry_deregister()
+{
+    if (registry_slot < 0)
+        return;
+
+    // Only from the shell itself, not from a forked child exiting
+    uint64_t expected = registry_self;
+    if ((uint64_t)getpid() == (registry_self & REGISTRY_PID_MASK))
+        __atomic_compare_exchange_n(&registry->owners[registry_slot], &expected, 0, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE);
+    registry_slot = -1;
+}
+// SECTION ENDS: "SHELL REGISTRY"
+
+// SECTION STARTS: "WORD COUNT CACHE"
+/**
+ * Function to map the word-count cache file, creating it on first use.
+ * It lives in $XDG_CACHE_HOME/w25shell (or ~/.cache/w25shell) and is
+ * shared by every shell of the user.
+ *
+ * @return 0 on success, -1 if no cache is available
+ */
+int wc_cache_open()
+{
+    if (wc_cache != NULL)
+        return 0;
+
+    char dir[PATH_MAX];
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (base != NULL && base[0] != '\0')
+        snprintf(dir, sizeof(dir), "%s", base);
+    else if (home != NULL)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return -1;
+
+    mkdir(dir, 0700);
+    strncat(dir, "/w25shell", sizeof(dir) - strlen(dir) - 1);
+    mkdir(dir, 0700);
+    int len = snprintf(wc_cache_path, sizeof(wc_cache_path), "%s/wordcount.cache", dir);
+    if (len < 0 || (size_t)len >= sizeof(wc_cache_path))
+        return -1;
+
+    int fd = open(wc_cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    // Size (or re-initialise) the file under an exclusive lock. It is
+    // only ever grown: other shells may have it mapped, and shrinking it
+    // would kill them with SIGBUS. A stale header is reset below.
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < (off_t)sizeof(wc_cache_file) && ftruncate(fd, sizeof(wc_cache_file)) < 0))
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    wc_cache_file *cache = mmap(NULL, sizeof(wc_cache_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache == MAP_FAILED)
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    if (cache->magic != WC_CACHE_MAGIC || cache->version != WC_CACHE_VERSION || cache->slots != WC_CACHE_SLOTS)
+    {
+        memset(cache, 0, sizeof(wc_cache_file));
+        cache->magic = WC_CACHE_MAGIC;
+        cache->version = WC_CACHE_VERSION;
+        cache->slots = WC_CACHE_SLOTS;
+    }
+
+    flock(fd, LOCK_UN);
+
+    wc_cache = cache;
+    wc_cache_fd = fd;
+    return 0;
+}
+
+/**
+ * Function to compute the first slot probed for a file
+ *
+ * @param dev Device number
+ * @param ino Inode number
+ * @return Slot index
+ */
+unsigned int wc_cache_slot(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = (dev * 0x9E3779B97F4A7C15ull) ^ (ino * 0xC2B2AE3D27D4EB4Full);
+    return (unsigned int)(h ^ (h >> 29)) & (WC_CACHE_SLOTS - 1);
+}
+
+/**
+ * Function to take a consistent snapshot of the entry for a file
+ *
+ * @param dev Device number
+ * @param ino Inode number
+ * @param out Snapshot of the entry
+ * @return 1 if an entry was found, 0 otherwise
+ */
+int wc_cache_find(uint64_t dev, uint64_t ino, wc_cache_entry *out)
+{
+    unsigned int slot = wc_cache_slot(dev, ino);
+
+    for (int i = 0; i < WC_CACHE_PROBES; i++)
+    {
+        wc_cache_entry *entry = &wc_cache->entries[(slot + i) & (WC_CACHE_SLOTS - 1)];
+
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            return 0; // Being rewritten by another shell; just recount
+
+        memcpy(out, entry, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+            return 0;
+
+        if (!out->used)
+            return 0;
+        if (out->dev == dev && out->ino == ino)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to store the result for a file, evicting within its probe range
+ *
+ * @param value Entry to store (seq is ignored)
+ */
+void wc_cache_store(const wc_cache_entry *value)
+{
+    unsigned int slot = wc_cache_slot(value->dev, value->ino);
+    wc_cache_entry *target = NULL;
+
+    flock(wc_cache_fd, LOCK_EX);
+
+    // Reuse the file's own slot, else the first free one, else evict the first
+    for (int i = 0; i < WC_CACHE_PROBES; i++)
+    {
+        wc_cache_entry *entry = &wc_cache->entries[(slot + i) & (WC_CACHE_SLOTS - 1)];
+        if (entry->used && entry->dev == value->dev && entry->ino == value->ino)
+        {
+            target = entry;
+            break;
+        }
+        if (!entry->used && target == NULL)
+            target = entry;
+    }
+    if (target == NULL)
+        target = &wc_cache->entries[slot];
+
+    uint32_t seq = target->seq;
+    __atomic_store_n(&target->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    target->used = 1;
+    target->dev = value->dev;
+    target->ino = value->ino;
+    target->size = value->size;
+    target->mtime_ns = value->mtime_ns;
+    target->ctime_ns = value->ctime_ns;
+    target->tail_hash = value->tail_hash;
+    target->counts = value->counts;
+
+    __atomic_store_n(&target->seq, seq + 2, __ATOMIC_RELEASE);
+
+    flock(wc_cache_fd, LOCK_UN);
+}
+
+/**
+ * Function to fingerprint the bytes just before an offset, used to tell an
+ * appended file from one that was rewritten with a larger size
  *
- * @param input Buffer to store the input
- * @param size Size of the input buffer
- * @return Length of input read, or 0 for empty input
+ * @param fd Open descriptor of the file
+ * @param end Offset the fingerprint ends at
+ * @param hash Output FNV-1a hash
+ * @return 0 on success, -1 on read error
  */
-int read_input(char *input, size_t size)
+int wc_tail_hash(int fd, off_t end, uint64_t *hash)
 {
-    if (fgets(input, size, stdin) == NULL)
-    {
-        // Handle EOF (Ctrl+D)
-        printf("\n");
-        exit(0);
-    }
+    unsigned char window[WC_TAIL_WINDOW];
+    off_t start = end > WC_TAIL_WINDOW ? end - WC_TAIL_WINDOW : 0;
+    ssize_t len = end - start;
+    uint64_t h = 14695981039346656037ull;
+
+    if (pread(fd, window, len, start) != len)
+        return -1;
 
-    // Remove newline character
-    size_t length = strlen(input);
-    if (length > 0 && input[length - 1] == '\n')
+    for (ssize_t i = 0; i < len; i++)
     {
-        input[length - 1] = '\0';
-        length--;
+        h ^= window[i];
+        h *= 1099511628211ull;
     }
 
-    return length;
+    *hash = h;
+    return 0;
 }
-// SECTION ENDS: "SHELL INTERFACE"
 
-// SECTION STARTS: "COMMAND PARSING"
 /**
- * Function to parse the input and identify special characters
+ * Function to count a file, answering from the persistent cache when the
+ * file is unchanged and counting only the appended tail when it grew.
+ * Non-regular files and cache failures fall back to count_file().
  *
- * @param input The user input string
- * @param commands Array to store parsed commands
- * @param command_count Pointer to store number of commands
- * @param special_char Pointer to store identified special character
- * @return 0 on success, non-zero on error
+ * @param filename Name of the file
+ * @param threads Worker threads to use (0 = automatic)
+ * @param counts Output counts
+ * @return 0 on success, -1 on error (errno set)
  */
-int parse_input(char *input, char ***commands, int *command_count, char *special_char)
+int count_file_cached(const char *filename, int threads, word_counts *counts)
 {
-    char *token;
-    char *saveptr1, *saveptr2;
-    char *input_copy = strdup(input);
+    struct stat st;
 
-    if (!input_copy)
-    {
-        perror("Memory allocation failed");
-        return 1;
-    }
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || wc_cache_open() < 0)
+        return count_file(filename, threads, counts);
 
-    // Check for special characters
-    if (strstr(input, "|"))
-    {
-        strcpy(special_char, "|");
-        token = strtok_r(input_copy, "|", &saveptr1);
-    }
-    else if (strstr(input, "="))
-    {
-        strcpy(special_char, "=");
-        token = strtok_r(input_copy, "=", &saveptr1);
-    }
-    else if (strstr(input, "~"))
-    {
-        strcpy(special_char, "~");
-        token = strtok_r(input_copy, "~", &saveptr1);
-    }
-    else if (strstr(input, "#"))
-    {
-        strcpy(special_char, "#");
-        token = strtok_r(input_copy, "#", &saveptr1);
-    }
-    else if (strstr(input, "+"))
-    {
-        strcpy(special_char, "+");
-        token = strtok_r(input_copy, "+", &saveptr1);
-    }
-    else if (strstr(input, ";"))
-    {
-        strcpy(special_char, ";");
-        token = strtok_r(input_copy, ";", &saveptr1);
-    }
-    else if (strstr(input, "&&"))
-    {
-        strcpy(special_char, "&&");
-        token = strtok_r(input_copy, "&&", &saveptr1);
-    }
-    else if (strstr(input, "||"))
-    {
-        strcpy(special_char, "||");
-        token = strtok_r(input_copy, "||", &saveptr1);
-    }
-    else
+    int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    int64_t ctime_ns = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+    wc_cache_entry cached;
+    int found = wc_cache_find(st.st_dev, st.st_ino, &cached);
+
+    // Unchanged file: no need to even open it. mtime can be set back with
+    // touch -r after a rewrite, but any write also moves ctime.
+    if (found && cached.size == (uint64_t)st.st_size && cached.mtime_ns == mtime_ns && cached.ctime_ns == ctime_ns)
     {
-        // No special character
-        special_char[0] = '\0';
-        token = input_copy;
+        *counts = cached.counts;
+        return 0;
     }
 
-    *command_count = 0;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
 
-    // Parse the first command
-    while (token != NULL && *command_count < MAX_COMMANDS)
+    // Re-stat through the descriptor we are about to count
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
     {
-        // Remove leading and trailing whitespace
-        while (*token == ' ')
-            token++;
-
-        char *cmd_copy = strdup(token);
-        if (!cmd_copy)
-        {
-            perror("Memory allocation failed");
-            free(input_copy);
-            return 1;
-        }
-
-        // Allocate memory for command arguments
-        commands[*command_count] = (char **)malloc(MAX_ARGS * sizeof(char *));
-        if (!commands[*command_count])
-        {
-            perror("Memory allocation failed");
-            free(cmd_copy);
-            free(input_copy);
-            return 1;
-        }
-
-        // Initialize all argument pointers to NULL
-        for (int i = 0; i < MAX_ARGS; i++)
-        {
-            commands[*command_count][i] = NULL;
-        }
+        close(fd);
+        return count_file(filename, threads, counts);
+    }
 
-        // Parse command arguments
-        int arg_count = 0;
-        char *arg = strtok_r(cmd_copy, " ", &saveptr2);
+    wc_cache_entry fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    memset(counts, 0, sizeof(*counts));
 
-        while (arg != NULL && arg_count < MAX_ARGS)
-        {
-            commands[*command_count][arg_count] = strdup(arg);
-            arg_count++;
-            arg = strtok_r(NULL, " ", &saveptr2);
-        }
+    off_t start = 0;
+    uint64_t hash;
 
-        // Validate argument count (must be between 1 and 5)
-        if (arg_count < 1 || arg_count > MAX_ARGS)
-        {
-            printf("w25shell: Invalid number of arguments for command\n");
-            free(cmd_copy);
-            free(input_copy);
-            return 1;
-        }
+    // Grown file whose old end still looks the same: count only the tail
+    if (found && cached.dev == (uint64_t)st.st_dev && cached.ino == (uint64_t)st.st_ino &&
+        cached.size < (uint64_t)st.st_size && wc_tail_hash(fd, cached.size, &hash) == 0 &&
+        hash == cached.tail_hash)
+    {
+        *counts = cached.counts;
+        start = cached.size;
+    }
 
-        // If more arguments exist but we've reached MAX_ARGS, report error
-        if (arg != NULL)
-        {
-            printf("w25shell: Too many arguments (max %d allowed)\n", MAX_ARGS);
-            free(cmd_copy);
-            free(input_copy);
-            return 1;
-        }
+    if (count_region(fd, start, st.st_size, threads, counts) < 0)
+    {
+        close(fd);
+        return count_file(filename, threads, counts);
+    }
 
-        free(cmd_copy);
-        (*command_count)++;
+    fresh.dev = st.st_dev;
+    fresh.ino = st.st_ino;
+    fresh.size = st.st_size;
+    fresh.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    fresh.ctime_ns = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+    fresh.counts = *counts;
 
-        // Get next command if special character exists
-        if (special_char[0] != '\0')
-        {
-            token = strtok_r(NULL, special_char, &saveptr1);
-            // Remove leading whitespace from token
-            if (token != NULL)
-            {
-                while (*token == ' ')
-                    token++;
-            }
-        }
-        else
-        {
-            token = NULL;
-        }
-    }
+    if (wc_tail_hash(fd, st.st_size, &fresh.tail_hash) == 0)
+        wc_cache_store(&fresh);
 
-    free(input_copy);
+    close(fd);
     return 0;
 }
-// SECTION ENDS: "COMMAND PARSING"
 
-// SECTION STARTS: "BASIC COMMAND EXECUTION"
 /**
- * Function to execute a single command
+ * Function to handle the wccache builtin
+ * "wccache" lists cached results, "wccache clear" empties the cache
  *
  * @param args Command and its arguments
  */
-void execute_command(char **args)
+int wccache_command(char **args)
 {
-    // Validate argument count
-    if (!validate_args_count(args))
+    if (wc_cache_open() < 0)
     {
-        return;
+        fprintf(stderr, "w25shell: wccache: cache unavailable\n");
+        return 1;
     }
 
-    int in_fd = STDIN_FILENO;
-    int out_fd = STDOUT_FILENO;
-
-    // Check for redirection in the command
-    handle_redirection(args, &in_fd, &out_fd);
-
-    // Create a child process
-    pid_t pid = fork();
-
-    if (pid < 0)
+    if (args[1] != NULL && strcmp(args[1], "clear") == 0)
     {
-        // Fork failed
-        perror("fork failed");
-        return;
-    }
-    else if (pid == 0)
-    {
-        // Child process
-
-        // Handle input/output redirection
-        if (in_fd != STDIN_FILENO)
+        flock(wc_cache_fd, LOCK_EX);
+        for (int i = 0; i < WC_CACHE_SLOTS; i++)
         {
-            dup2(in_fd, STDIN_FILENO);
-            close(in_fd);
+            wc_cache_entry *entry = &wc_cache->entries[i];
+            __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            entry->used = 0;
+            __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
         }
+        flock(wc_cache_fd, LOCK_UN);
+        return 0;
+    }
 
-        if (out_fd != STDOUT_FILENO)
-        {
-            dup2(out_fd, STDOUT_FILENO);
-            close(out_fd);
-        }
+    if (args[1] != NULL)
+    {
+        fprintf(stderr, "w25shell: wccache: usage: wccache [clear]\n");
+        return 1;
+    }
 
-        // Execute the command
-        execvp(args[0], args);
+    int shown = 0;
+    printf("cache: %s\n", wc_cache_path);
 
-        // If execvp returns, it means an error occurred
-        perror("execvp failed");
-        exit(EXIT_FAILURE);
-    }
-    else
+    for (int i = 0; i < WC_CACHE_SLOTS; i++)
     {
-        // Parent process
+        wc_cache_entry *entry = &wc_cache->entries[i];
+        if (!entry->used)
+            continue;
 
-        // Close any open file descriptors
-        if (in_fd != STDIN_FILENO)
-            close(in_fd);
-        if (out_fd != STDOUT_FILENO)
-            close(out_fd);
+        if (shown++ == 0)
+            printf("%-20s %14s %12s %12s %12s\n", "dev:inode", "size", "words", "lines", "bytes");
 
-        // Wait for the child process to complete
-        waitpid(pid, NULL, 0);
+        char key[48];
+        snprintf(key, sizeof(key), "%llu:%llu", (unsigned long long)entry->dev, (unsigned long long)entry->ino);
+        printf("%-20s %14llu %12llu %12llu %12llu\n", key, (unsigned long long)entry->size, entry->counts.words,
+               entry->counts.lines, entry->counts.bytes);
     }
+
+    if (shown == 0)
+        printf("wccache: cache empty\n");
+    return 0;
 }
-// SECTION ENDS: "BASIC COMMAND EXECUTION"
+// SECTION ENDS: "WORD COUNT CACHE"
 
-// SECTION STARTS: "FORWARD PIPING"
+// SECTION STARTS: "FILE OPERATIONS - CONCATENATE"
 /**
- * Function to execute piped commands
+ * Function to concatenate multiple text files to standard output.
+ * The data never passes through user space when the kernel can move it:
+ * copy_file_range() for a regular file, splice() for a pipe and sendfile()
+ * for anything else, with a large aligned buffer as the last resort.
  *
- * @param commands Array of commands and their arguments
- * @param command_count Number of commands
+ * @param filenames Array of filenames
+ * @param count Number of files
+ * @return Exit status (0 on success)
  */
-void execute_piped_commands(char ***commands, int command_count)
+int concatenate_files(char **filenames, int count)
 {
-    int i;
-    int pipefd[2 * (command_count - 1)];
-    pid_t pid;
+    struct stat out_st;
+    int best = COPY_SENDFILE;
+    long long total = 0;
+    int status = 0;
+
+    // Anything already sitting in stdio's buffer must go out first
+    fflush(stdout);
 
-    // Create all required pipes
-    for (i = 0; i < command_count - 1; i++)
+    // Pick the best strategy for the kind of stdout we have
+    if (fstat(STDOUT_FILENO, &out_st) == 0)
     {
-        if (pipe(pipefd + 2 * i) < 0)
-        {
-            perror("pipe failed");
-            return;
-        }
+        if (S_ISREG(out_st.st_mode))
+            best = COPY_RANGE;
+        else if (S_ISFIFO(out_st.st_mode))
+            best = COPY_SPLICE;
     }
 
-    // Execute each command in the pipeline
-    for (i = 0; i < command_count; i++)
+    double start = monotonic_seconds();
+
+    // Process each file
+    for (int i = 0; i < count; i++)
     {
-        // Validate argument count for current command
-        if (!validate_args_count(commands[i]))
+        int fd = open(filenames[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
         {
-            // Clean up pipes
-            for (int j = 0; j < 2 * (command_count - 1); j++)
-            {
-                close(pipefd[j]);
-            }
-            return;
+            fprintf(stderr, "Failed to open file %s: %s\n", filenames[i], strerror(errno));
+            status = 1;
+            continue;
         }
 
-        pid = fork();
-
-        if (pid < 0)
+        // Each input starts from the best method again: a pipe or procfs
+        // file that needed a fallback says nothing about the next file
+        int method = best;
+        long long copied = copy_fd_to_fd(fd, STDOUT_FILENO, &method);
+        if (copied < 0)
         {
-            perror("fork failed");
-            return;
+            fprintf(stderr, "Failed to copy file %s: %s\n", filenames[i], strerror(errno));
+            status = 1;
         }
-        else if (pid == 0)
+        else
         {
-            // Child process
-
-            // Set up input (read from previous pipe)
-            if (i > 0)
-            {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
-            }
-
-            // Set up output (write to next pipe)
-            if (i < command_count - 1)
-            {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
-            }
-
-            // Close all pipe file descriptors
-            for (int j = 0; j < 2 * (command_count - 1); j++)
-            {
-                close(pipefd[j]);
-            }
-
-            // Execute command
-            execvp(commands[i][0], commands[i]);
-
-            // If execvp returns, it means an error occurred
-            perror("execvp failed");
-            exit(EXIT_FAILURE);
+            total += copied;
         }
-    }
 
-    // Parent process closes all pipe file descriptors
-    for (i = 0; i < 2 * (command_count - 1); i++)
-    {
-        close(pipefd[i]);
+        close(fd);
     }
 
-    // Wait for all children to complete
-    for (i = 0; i < command_count; i++)
-    {
-        wait(NULL);
-    }
+    // On request, report throughput on stderr so it never mixes with the data
+    double elapsed = monotonic_seconds() - start;
+    if (concat_stats)
+        fprintf(stderr, "w25shell: concatenated %lld bytes in %.6f s (%.1f MB/s)\n", total, elapsed,
+                elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+
+    return status;
 }
-// SECTION ENDS: "FORWARD PIPING"
 
-// SECTION STARTS: "REVERSE PIPING"
 /**
- * Function to execute reverse piped commands
+ * Function to copy everything readable from one descriptor to another.
+ * Starts with *method and moves down the COPY_* list whenever the kernel
+ * reports that the current strategy does not apply to these descriptors;
+ * the downgraded method is written back so later files skip the probing.
  *
- * @param commands Array of commands and their arguments
- * @param command_count Number of commands
+ * @param in_fd Source descriptor (read from its current offset)
+ * @param out_fd Destination descriptor
+ * @param method In/out: COPY_* strategy to try first
+ * @return Bytes copied, or -1 on a real I/O error (errno set)
  */
-void execute_reverse_piped_commands(char ***commands, int command_count)
+long long copy_fd_to_fd(int in_fd, int out_fd, int *method)
 {
-    int i;
-    int pipefd[2 * (command_count - 1)];
-    pid_t pid;
+    long long total = 0;
 
-    // Create all required pipes
-    for (i = 0; i < command_count - 1; i++)
+    while (*method != COPY_BUFFER)
     {
-        if (pipe(pipefd + 2 * i) < 0)
-        {
-            perror("pipe failed");
-            return;
-        }
-    }
-
-    // Execute commands in reverse order
-    for (i = command_count - 1; i >= 0; i--)
-    {
-        // Validate argument count for current command
-        if (!validate_args_count(commands[i]))
-        {
-            // Clean up pipes
-            for (int j = 0; j < 2 * (command_count - 1); j++)
-            {
-                close(pipefd[j]);
-            }
-            return;
-        }
+        ssize_t n;
 
-        pid = fork();
+        if (*method == COPY_RANGE)
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        else if (*method == COPY_SPLICE)
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
 
-        if (pid < 0)
+        if (n > 0)
         {
-            perror("fork failed");
-            return;
+            total += n;
+            continue;
         }
-        else if (pid == 0)
-        {
-            // Child process
-
-            // Set up input (read from previous pipe)
-            if (i < command_count - 1)
-            {
-                dup2(pipefd[i * 2], STDIN_FILENO);
-            }
-
-            // Set up output (write to next pipe)
-            if (i > 0)
-            {
-                dup2(pipefd[(i - 1) * 2 + 1], STDOUT_FILENO);
-            }
-
-            // Close all pipe file descriptors
-            for (int j = 0; j < 2 * (command_count - 1); j++)
-            {
-                close(pipefd[j]);
-            }
-
-            // Execute command
-            execvp(commands[i][0], commands[i]);
+        if (n == 0)
+            return total;
+        if (errno == EINTR)
+            continue;
 
-            // If execvp returns, it means an error occurred
-            perror("execvp failed");
-            exit(EXIT_FAILURE);
+        // These mean "not supported for this pair", not "I/O failed"
+        if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EBADF ||
+            errno == EOPNOTSUPP || errno == ESPIPE)
+        {
+            (*method)++;
+            continue;
         }
-    }
 
-    // Parent process closes all pipe file descriptors
-    for (i = 0; i < 2 * (command_count - 1); i++)
-    {
-        close(pipefd[i]);
+        return -1;
     }
 
-    // Wait for all children to complete
-    for (i = 0; i < command_count; i++)
-    {
-        wait(NULL);
-    }
+    long long rest = copy_with_buffer(in_fd, out_fd);
+    return rest < 0 ? -1 : total + rest;
 }
-// SECTION ENDS: "REVERSE PIPING"
 
-// SECTION STARTS: "SEQUENTIAL EXECUTION"
 /**
- * Function to execute sequential commands (;)
+ * Function to copy through a large page-aligned buffer with read()/write()
  *
- * @param commands Array of commands and their arguments
- * @param command_count Number of commands
+ * @param in_fd Source descriptor
+ * @param out_fd Destination descriptor
+ * @return Bytes copied, or -1 on error (errno set)
  */
-void execute_sequential_commands(char ***commands, int command_count)
+long long copy_with_buffer(int in_fd, int out_fd)
 {
-    // Execute each command sequentially
-    for (int i = 0; i < command_count; i++)
+    char *buffer = copy_buffer();
+    long long total = 0;
+
+    if (buffer == NULL)
+        return -1;
+
+    while (1)
     {
-        execute_command(commands[i]);
+        ssize_t bytes_read = read(in_fd, buffer, COPY_BUFFER_SIZE);
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0)
+            return total;
+
+        // Write the whole chunk, coping with short writes
+        ssize_t written = 0;
+        while (written < bytes_read)
+        {
+            ssize_t n = write(out_fd, buffer + written, bytes_read - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += n;
+        }
+
+        total += bytes_read;
     }
 }
-// SECTION ENDS: "SEQUENTIAL EXECUTION"
 
-// SECTION STARTS: "CONDITIONAL EXECUTION"
 /**
- * Function to execute conditional commands (&& and ||)
+ * Function to copy an exact byte range between two files at explicit
+ * offsets. Neither descriptor's file offset is used or changed.
  *
- * @param commands Array of commands and their arguments
- * @param command_count Number of commands
- * @param operators String containing operator types (&&, ||)
+ * @param in_fd Source descriptor
+ * @param in_off Offset to start reading from
+ * @param out_fd Destination descriptor
+ * @param out_off Offset to start writing at
+ * @param len Number of bytes to copy
+ * @return 0 on success, -1 on error (errno set)
  */
-void execute_conditional_commands(char ***commands, int command_count, char *operators)
+int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len)
 {
-    // Execute first command
-    int status = 0;
-    pid_t pid = fork();
-
-    if (pid < 0)
-    {
-        perror("fork failed");
-        return;
-    }
-    else if (pid == 0)
-    {
-        // Child process
-        execvp(commands[0][0], commands[0]);
-        perror("execvp failed");
-        exit(EXIT_FAILURE);
-    }
-    else
-    {
-        // Parent process
-        waitpid(pid, &status, 0);
-    }
-
-    // Execute remaining commands based on previous results
-    for (int i = 1; i < command_count; i++)
+    // Kernel-side copy first; a short count just means "call again"
+    while (len > 0)
     {
-        int execute = 0;
-
-        // Determine whether to execute current command based on operator
-        if (operators[i - 1] == '&' && WIFEXITED(status) && WEXITSTATUS(status) == 0)
-        {
-            // Execute if previous command succeeded (&&)
-            execute = 1;
-        }
-        else if (operators[i - 1] == '|' && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off,
+                                    len > COPY_CHUNK ? COPY_CHUNK : (size_t)len, 0);
+        if (n > 0)
         {
-            // Execute if previous command failed (||)
-            execute = 1;
+            len -= n;
+            continue;
         }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP)
+            return -1;
 
-        if (execute)
-        {
-            pid = fork();
+        // Unsupported here (or source shrank): finish with pread/pwrite
+        break;
+    }
 
-            if (pid < 0)
-            {
-                perror("fork failed");
-                return;
-            }
-            else if (pid == 0)
-            {
-                // Child process
-                execvp(commands[i][0], commands[i]);
-                perror("execvp failed");
-                exit(EXIT_FAILURE);
-            }
-            else
+    char *buffer = len > 0 ? copy_buffer() : NULL;
+    if (len > 0 && buffer == NULL)
+        return -1;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(in_fd, buffer, len > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t)len, in_off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO; // The source lost data we measured earlier
+            return -1;
+        }
+
+        for (ssize_t done = 0; done < n;)
+        {
+            ssize_t w = pwrite(out_fd, buffer + done, n - done, out_off + done);
+            if (w < 0)
             {
-                // Parent process
-                waitpid(pid, &status, 0);
+                if (errno == EINTR)
+                    continue;
+                return -1;
             }
+            done += w;
         }
+
+        in_off += n;
+        out_off += n;
+        len -= n;
     }
+
+    return 0;
 }
-// SECTION ENDS: "CONDITIONAL EXECUTION"
 
-// SECTION STARTS: "FILE OPERATIONS - APPEND"
 /**
- * Function to append contents between two text files
+ * Function to get the shared page-aligned fallback copy buffer
  *
- * @param file1 First file
- * @param file2 Second file
+ * @return Buffer of COPY_BUFFER_SIZE bytes, or NULL (errno set)
  */
-void append_files(char *file1, char *file2)
+char *copy_buffer()
 {
-    FILE *f1, *f2;
-    char buffer[4096];
-    size_t bytes_read;
-
-    // Read contents of file2
-    f2 = fopen(file2, "r");
-    if (!f2)
-    {
-        perror("Failed to open second file");
-        return;
-    }
-
-    // Append contents of file2 to file1
-    f1 = fopen(file1, "a");
-    if (!f1)
-    {
-        perror("Failed to open first file");
-        fclose(f2);
-        return;
-    }
+    static char *buffer = NULL;
 
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), f2)) > 0)
+    // Allocated once and kept for the lifetime of the shell
+    if (buffer == NULL)
     {
-        fwrite(buffer, 1, bytes_read, f1);
+        void *mem;
+        int err = posix_memalign(&mem, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE);
+        if (err != 0)
+        {
+            errno = err;
+            return NULL;
+        }
+        buffer = (char *)mem;
     }
 
-    fclose(f1);
-    fclose(f2);
+    return buffer;
+}
 
-    // Read contents of file1
-    f1 = fopen(file1, "r");
-    if (!f1)
-    {
-        perror("Failed to open first file");
-        return;
-    }
+/**
+ * Function to read the monotonic clock
+ *
+ * @return Seconds since an arbitrary fixed point
+ */
+double monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+// SECTION ENDS: "FILE OPERATIONS - CONCATENATE"
 
-    // Append contents of file1 to file2
-    f2 = fopen(file2, "a");
-    if (!f2)
+// SECTION STARTS: "THREAD POOL"
+/**
+ * Function to grab and run tasks of the current batch until none are left
+ *
+ * @param pool Pool whose lock is held by the caller
+ */
+void thread_pool_drain(thread_pool *pool)
+{
+    while (pool->next_task < pool->task_count)
     {
-        perror("Failed to open second file");
-        fclose(f1);
-        return;
-    }
+        int index = pool->next_task++;
 
-    rewind(f1); // Go back to beginning of file1
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->arg, index);
+        pthread_mutex_lock(&pool->lock);
 
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), f1)) > 0)
-    {
-        fwrite(buffer, 1, bytes_read, f2);
+        if (++pool->tasks_done == pool->task_count)
+            pthread_cond_broadcast(&pool->work_done);
     }
-
-    fclose(f1);
-    fclose(f2);
-
-    printf("Files appended successfully\n");
 }
-// SECTION ENDS: "FILE OPERATIONS - APPEND"
 
-// SECTION STARTS: "FILE OPERATIONS - COUNT WORDS"
 /**
- * Function to count words in a text file
+ * Worker thread body: sleep until a new batch is published, help drain it
  *
- * @param filename Name of the file
+ * @param arg The thread_pool
+ * @return Never returns
  */
-void count_words(char *filename)
+void *thread_pool_worker(void *arg)
 {
-    FILE *file = fopen(filename, "r");
-    if (!file)
-    {
-        printf("Failed to open file %s", filename);
-        return;
-    }
+    thread_pool *pool = (thread_pool *)arg;
+    unsigned int seen = 0;
 
-    int word_count = 0;
-    int in_word = 0;
-    int c;
-
-    // Count words
-    while ((c = fgetc(file)) != EOF)
+    pthread_mutex_lock(&pool->lock);
+    while (1)
     {
-        if (c == ' ' || c == '\n' || c == '\t')
-        {
-            in_word = 0;
-        }
-        else if (in_word == 0)
-        {
-            in_word = 1;
-            word_count++;
-        }
+        while (pool->generation == seen)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+
+        seen = pool->generation;
+        thread_pool_drain(pool);
     }
 
-    fclose(file);
-    printf("Number of words in %s: %d\n", filename, word_count);
+    return NULL;
 }
-// SECTION ENDS: "FILE OPERATIONS - COUNT WORDS"
 
-// SECTION STARTS: "FILE OPERATIONS - CONCATENATE"
 /**
- * Function to concatenate multiple text files
+ * Function to run fn(arg, i) for every i in [0, tasks) on the worker pool.
+ * The pool grows on demand to tasks - 1 workers; the calling thread runs
+ * tasks too and returns once all of them have finished.
  *
- * @param filenames Array of filenames
- * @param count Number of files
+ * @param fn Task body
+ * @param arg Argument passed to every task
+ * @param tasks Number of tasks
+ * @return 0 on success, -1 if the pool could not be started
  */
-void concatenate_files(char **filenames, int count)
+int thread_pool_run(void (*fn)(void *, int), void *arg, int tasks)
 {
-    FILE *file;
-    char buffer[4096];
-    size_t bytes_read;
+    thread_pool *pool = &worker_pool;
 
-    // Process each file
-    for (int i = 0; i < count; i++)
+    pthread_mutex_lock(&pool->lock);
+
+    // Start any workers still missing for this degree of parallelism
+    while (pool->thread_count < tasks - 1)
     {
-        file = fopen(filenames[i], "r");
-        if (!file)
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thread_pool_worker, pool) != 0)
         {
-            fprintf(stderr, "Failed to open file %s: %s\n", filenames[i], strerror(errno));
-            continue;
+            if (pool->thread_count == 0)
+            {
+                pthread_mutex_unlock(&pool->lock);
+                return -1;
+            }
+            break;
         }
+        pthread_detach(thread);
+        pool->thread_count++;
+    }
 
-        // Read and output file contents
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
-        {
-            fwrite(buffer, 1, bytes_read, stdout);
-        }
+    // Publish the batch and take part in it
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->task_count = tasks;
+    pool->next_task = 0;
+    pool->tasks_done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
 
-        fclose(file);
-    }
+    thread_pool_drain(pool);
+    while (pool->tasks_done < pool->task_count)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
 }
-// SECTION ENDS: "FILE OPERATIONS - CONCATENATE"
+// SECTION ENDS: "THREAD POOL"
 
 // SECTION STARTS: "I/O REDIRECTION"
 /**
- * Function to handle input/output redirection
+ * Function to handle input/output redirection. Targets are opened in
+ * source order (a later one replaces an earlier one of the same direction)
+ * and close-on-exec, so only the dup2() in the child makes them visible.
  *
- * @param args Command and arguments array
+ * @param redirs Redirections of a command
  * @param in_fd Pointer to input file descriptor
  * @param out_fd Pointer to output file descriptor
+ * @param err_fd Pointer to error file descriptor
+ * @return 0 on success, -1 if a target could not be opened (reported)
  */
-void handle_redirection(char **args, int *in_fd, int *out_fd)
+int handle_redirection(redirection *redirs, int *in_fd, int *out_fd, int *err_fd)
 {
-    int i;
+    int failed = 0;
 
-    // Find redirection symbols
-    for (i = 0; args[i] != NULL; i++)
+    for (redirection *redir = redirs; redir != NULL && !failed; redir = redir->next)
     {
-        if (strcmp(args[i], "<") == 0)
+        int fd;
+
+        if (redir->kind == REDIR_HEREDOC || redir->kind == REDIR_HERESTRING)
         {
-            // Input redirection
-            if (args[i + 1] == NULL)
+            // Inline input: a pipe or sealed memfd, never a file
+            fd = redir->kind == REDIR_HEREDOC ? inline_input(redir->body ? redir->body : "", redir->body_len, 0)
+                                              : inline_input(redir->target, strlen(redir->target), 1);
+            if (fd < 0)
             {
-                fprintf(stderr, "w25shell: No input file specified\n");
-                return;
+                failed = 1;
+                continue;
             }
-
-            *in_fd = open(args[i + 1], O_RDONLY);
-            if (*in_fd < 0)
+            if (*in_fd != STDIN_FILENO)
+                close(*in_fd);
+            *in_fd = fd;
+        }
+        else if (redir->kind == REDIR_IN)
+        {
+            // Input redirection
+            fd = open(redir->target, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
             {
                 perror("Failed to open input file");
-                return;
+                failed = 1;
+                continue;
             }
-
-            // Remove redirection symbols from arguments
-            args[i] = NULL;
+            if (*in_fd != STDIN_FILENO)
+                close(*in_fd);
+            *in_fd = fd;
         }
-        else if (strcmp(args[i], ">") == 0)
+        else
         {
-            // Output redirection
-            if (args[i + 1] == NULL)
+            // Output or error redirection (truncate or append)
+            int is_err = redir->kind == REDIR_ERR || redir->kind == REDIR_ERR_APPEND;
+            int mode = redir->kind == REDIR_APPEND || redir->kind == REDIR_ERR_APPEND ? O_APPEND : O_TRUNC;
+            fd = open(redir->target, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0644);
+            if (fd < 0)
             {
-                fprintf(stderr, "w25shell: No output file specified\n");
-                return;
+                perror(is_err ? "Failed to open error file" : "Failed to open output file");
+                failed = 1;
+                continue;
             }
+            int *target = is_err ? err_fd : out_fd;
+            int standard = is_err ? STDERR_FILENO : STDOUT_FILENO;
+            if (*target != standard)
+                close(*target);
+            *target = fd;
+        }
+    }
 
-            *out_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (*out_fd < 0)
-            {
-                perror("Failed to open output file");
-                return;
-            }
+    if (!failed)
+        return 0;
 
-            // Remove redirection symbols from arguments
-            args[i] = NULL;
-        }
-        else if (strcmp(args[i], ">>") == 0)
+    // Do not leave half of the redirections open
+    if (*in_fd != STDIN_FILENO)
+        close(*in_fd);
+    if (*out_fd != STDOUT_FILENO)
+        close(*out_fd);
+    if (*err_fd != STDERR_FILENO)
+        close(*err_fd);
+    *in_fd = STDIN_FILENO;
+    *out_fd = STDOUT_FILENO;
+    *err_fd = STDERR_FILENO;
+    return -1;
+}
+/**
+ * Function to read the bodies of the here-documents of the line just
+ * parsed: the input lines that follow it, up to each delimiter in turn
+ *
+ * @param reader Line source the command line came from
+ */
+void heredoc_read(line_reader *reader)
+{
+    for (redirection *redir = heredoc_head; redir != NULL; redir = redir->next_heredoc)
+    {
+        char *body = NULL;
+        size_t len = 0;
+        size_t capacity = 0;
+
+        while (1)
         {
-            // Output redirection with append
-            if (args[i + 1] == NULL)
+            if (interactive)
             {
-                fprintf(stderr, "w25shell: No output file specified\n");
-                return;
+                printf("> ");
+                fflush(stdout);
             }
 
-            *out_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (*out_fd < 0)
+            char *line = read_input(reader);
+            if (line == NULL)
             {
-                perror("Failed to open output file");
-                return;
+                fprintf(stderr, "w25shell: warning: here-document ended by end of input (wanted '%s')\n",
+                        redir->target);
+                break;
             }
+            if (strcmp(line, redir->target) == 0)
+                break;
 
-            // Remove redirection symbols from arguments
-            args[i] = NULL;
+            // The body grows at the end of the arena, mostly in place
+            size_t length = strlen(line);
+            if (len + length + 1 > capacity)
+            {
+                size_t grown = (len + length + 1) * 2;
+                body = body == NULL ? (char *)arena_alloc(&line_arena, grown)
+                                    : (char *)arena_grow(&line_arena, body, capacity, grown);
+                capacity = grown;
+                if (body == NULL)
+                {
+                    perror("Memory allocation failed");
+                    len = 0;
+                    break;
+                }
+            }
+            memcpy(body + len, line, length);
+            len += length;
+            body[len++] = '\n';
         }
+
+        redir->body = body != NULL ? body : (char *)"";
+        redir->body_len = len;
     }
+
+    heredoc_head = NULL;
+    heredoc_tail = &heredoc_head;
 }
-// SECTION ENDS: "I/O REDIRECTION"
 
-// SECTION STARTS: "MEMORY MANAGEMENT"
 /**
- * Function to clean up allocated memory for commands
+ * Function to turn inline data into a readable descriptor without
+ * touching the filesystem. Up to HEREDOC_PIPE_MAX bytes are written
+ * straight into a pipe, which holds them without blocking; anything
+ * larger goes into a memfd that is sealed against changes and rewound.
  *
- * @param commands Array of commands and their arguments
- * @param command_count Number of commands
+ * @param data Bytes to provide
+ * @param len Number of bytes
+ * @param newline Append a newline (here-strings)
+ * @return Descriptor positioned at the data, or -1 on error (reported)
  */
-void cleanup_commands(char ***commands, int command_count)
+int inline_input(const char *data, size_t len, int newline)
 {
-    for (int i = 0; i < command_count; i++)
+    struct iovec parts[2] = {{(void *)data, len}, {(void *)"\n", 1}};
+    int count = newline ? 2 : 1;
+    size_t total = len + (newline ? 1 : 0);
+
+    if (total <= HEREDOC_PIPE_MAX)
     {
-        if (commands[i])
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
         {
-            for (int j = 0; j < MAX_ARGS; j++)
-            {
-                if (commands[i][j])
-                {
-                    free(commands[i][j]);
-                }
-            }
-            free(commands[i]);
+            perror("pipe failed");
+            return -1;
+        }
+        if (total > 0 && writev(fds[1], parts, count) != (ssize_t)total)
+        {
+            perror("Failed to write here-document");
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int fd = memfd_create("w25shell-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        perror("memfd_create failed");
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < total)
+    {
+        ssize_t n = written < len ? write(fd, data + written, len - written) : write(fd, "\n", 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("Failed to write here-document");
+            close(fd);
+            return -1;
         }
+        written += n;
     }
+
+    // Nobody can change the data under the reader, the shell included
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
 }
+// SECTION ENDS: "I/O REDIRECTION"
 
+// SECTION STARTS: "MEMORY MANAGEMENT"
 /**
- * Function to validate argument count for a command
+ * Function to allocate from an arena, adding a block when the current one
+ * is full. Blocks survive arena_reset(), so a steady-state line does no
+ * heap allocation at all.
  *
- * @param args Command and its arguments
- * @return 1 if valid, 0 if invalid
+ * @param a Arena to allocate from
+ * @param size Number of bytes
+ * @return Pointer aligned for any type, or NULL on allocation failure
  */
-int validate_args_count(char **args)
+void *arena_alloc(arena *a, size_t size)
 {
-    int count = 0;
+    size = (size + 15) & ~(size_t)15;
 
-    while (args[count] != NULL)
+    // Move to the next kept block (or add one) until the request fits
+    while (a->current == NULL || a->current->used + size > a->current->size)
     {
-        count++;
-        if (count > MAX_ARGS)
+        if (a->current != NULL && a->current->next != NULL)
         {
-            fprintf(stderr, "w25shell: Too many arguments (max %d allowed)\n", MAX_ARGS);
-            return 0;
+            a->current = a->current->next;
+            a->current->used = 0;
+            continue;
         }
+
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block *block = (arena_block *)malloc(sizeof(arena_block) + block_size);
+        if (!block)
+            return NULL;
+
+        a->block_allocs++;
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+
+        if (a->current != NULL)
+            a->current->next = block;
+        else
+            a->head = block;
+        a->current = block;
     }
 
-    if (count < 1)
+    void *ptr = a->current->data + a->current->used;
+    a->current->used += size;
+    a->last = ptr;
+    return ptr;
+}
+
+/**
+ * Function to grow an arena allocation, in place when it is the most
+ * recent one and the block has room, otherwise by copying
+ *
+ * @param a Arena the allocation came from
+ * @param old Existing allocation
+ * @param old_size Its size in bytes
+ * @param new_size Requested size in bytes
+ * @return Pointer to the grown allocation, or NULL on allocation failure
+ */
+void *arena_grow(arena *a, void *old, size_t old_size, size_t new_size)
+{
+    size_t old_rounded = (old_size + 15) & ~(size_t)15;
+    size_t new_rounded = (new_size + 15) & ~(size_t)15;
+
+    if (old == a->last && a->current->used - old_rounded + new_rounded <= a->current->size)
     {
-        fprintf(stderr, "w25shell: Command cannot be empty\n");
-        return 0;
+        a->current->used += new_rounded - old_rounded;
+        return old;
     }
 
-    return 1;
+    void *ptr = arena_alloc(a, new_size);
+    if (ptr)
+        memcpy(ptr, old, old_size);
+    return ptr;
+}
+
+/**
+ * Function to copy a string into an arena
+ *
+ * @param a Arena to allocate from
+ * @param s String to copy
+ * @return The copy, or NULL on allocation failure
+ */
+char *arena_strdup(arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = (char *)arena_alloc(a, len);
+
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+/**
+ * Function to release everything allocated from an arena at once
+ *
+ * @param a Arena to reset
+ */
+void arena_reset(arena *a)
+{
+    a->current = a->head;
+    a->last = NULL;
+    if (a->current)
+        a->current->used = 0;
 }
 // SECTION ENDS: "MEMORY MANAGEMENT"
 
@@ -979,42 +10352,176 @@ void killterm_command()
     exit(0);
 }
 /**
- * Function to handle killallterms command
- * Kills all w25shell processes by sending SIGTERM to all processes with
- * the name "w25shell"
+ * Function to handle the set builtin
+ * "set" lists shell options, "set <option> <value>" changes one
+ *
+ * @param args Command and its arguments
  */
-void killallterms_command()
+int set_command(char **args)
 {
-    printf("Killing all w25shell terminals...\n");
+    if (args[1] == NULL)
+    {
+        printf("spawn %s\n", spawn_backend_name(spawn_backend));
+        printf("append %s\n", append_mode == APPEND_ATOMIC ? "atomic" : append_mode == APPEND_FSYNC ? "fsync" : "fast");
+        printf("filters %s\n", inprocess_filters ? "on" : "off");
+        printf("concatstats %s\n", concat_stats ? "on" : "off");
+        if (pipe_size > 0)
+            printf("pipesize %ld\n", pipe_size);
+        else
+            printf("pipesize default\n");
+        printf("trace %s\n", trace_active ? trace_path : "off");
+        if (stage_sched.placement == SCHED_PLACE_LIST)
+        {
+            printf("affinity");
+            for (int i = 0; i < stage_sched.cpu_count; i++)
+                printf("%c%d", i == 0 ? ' ' : ',', stage_sched.cpus[i]);
+            printf("\n");
+        }
+        else
+            printf("affinity %s\n", stage_sched.placement == SCHED_PLACE_AUTO ? "auto" : "off");
+        return 0;
+    }
+
+    if (strcmp(args[1], "spawn") == 0)
+    {
+        int backend = args[2] != NULL ? spawn_backend_from_name(args[2]) : -1;
+        if (backend < 0)
+        {
+            fprintf(stderr, "w25shell: set spawn expects 'fork', 'spawn' or 'zygote'\n");
+            return 1;
+        }
+        if (backend != SPAWN_BACKEND_ZYGOTE)
+            zygote_stop();
+        spawn_backend = backend;
+        return 0;
+    }
+
+    if (strcmp(args[1], "append") == 0)
+    {
+        if (args[2] != NULL && strcmp(args[2], "fast") == 0)
+            append_mode = APPEND_FAST;
+        else if (args[2] != NULL && strcmp(args[2], "fsync") == 0)
+            append_mode = APPEND_FSYNC;
+        else if (args[2] != NULL && strcmp(args[2], "atomic") == 0)
+            append_mode = APPEND_ATOMIC;
+        else
+        {
+            fprintf(stderr, "w25shell: set append expects 'fast', 'fsync' or 'atomic' (each file replaced "
+                            "atomically on its own)\n");
+            return 1;
+        }
+        return 0;
+    }
 
-    // Use pgrep to find all w25shell processes
-    FILE *fp;
-    char command[100];
-    char pid_str[16];
+    if (strcmp(args[1], "filters") == 0)
+    {
+        if (args[2] != NULL && strcmp(args[2], "on") == 0)
+            inprocess_filters = 1;
+        else if (args[2] != NULL && strcmp(args[2], "off") == 0)
+            inprocess_filters = 0;
+        else
+        {
+            fprintf(stderr, "w25shell: set filters expects 'on' or 'off'\n");
+            return 1;
+        }
+        return 0;
+    }
 
-    // Create command to get PIDs of all w25shell processes
-    sprintf(command, "pgrep w25shell");
+    if (strcmp(args[1], "concatstats") == 0)
+    {
+        if (args[2] != NULL && strcmp(args[2], "on") == 0)
+            concat_stats = 1;
+        else if (args[2] != NULL && strcmp(args[2], "off") == 0)
+            concat_stats = 0;
+        else
+        {
+            fprintf(stderr, "w25shell: set concatstats expects 'on' or 'off'\n");
+            return 1;
+        }
+        return 0;
+    }
 
-    fp = popen(command, "r");
-    if (fp == NULL)
+    if (strcmp(args[1], "pipesize") == 0)
     {
-        perror("Failed to run pgrep");
-        return;
+        long size = args[2] == NULL ? -1 : strcmp(args[2], "default") == 0 ? 0 : parse_size(args[2]);
+        if (size < 0)
+        {
+            fprintf(stderr, "w25shell: set pipesize expects a size (e.g. 1M) or 'default'\n");
+            return 1;
+        }
+        pipe_size = size;
+        return 0;
     }
 
-    // Read each PID and send SIGTERM
-    while (fgets(pid_str, sizeof(pid_str), fp) != NULL)
+    if (strcmp(args[1], "affinity") == 0)
     {
-        pid_t pid = atoi(pid_str);
+        if (args[2] == NULL || sched_parse_placement(args[2], &stage_sched) < 0)
+        {
+            fprintf(stderr, "w25shell: set affinity expects 'auto', 'off' or a CPU list (e.g. 0-3,8)\n");
+            return 1;
+        }
+        return 0;
+    }
 
-        // Skip current process (we'll exit ourselves at the end)
-        if (pid != current_pid)
+    if (strcmp(args[1], "trace") == 0)
+    {
+        if (args[2] == NULL)
+        {
+            fprintf(stderr, "w25shell: set trace expects a file or 'off'\n");
+            return 1;
+        }
+        if (strcmp(args[2], "off") == 0)
         {
-            kill(pid, SIGTERM);
+            trace_close();
+            return 0;
         }
+        return trace_open(args[2]) < 0;
+    }
+
+    fprintf(stderr, "w25shell: set: unknown option '%s'\n", args[1]);
+    return 1;
+}
+
+/**
+ * Function to handle killallterms command
+ * Kills all registered w25shell processes with SIGTERM. Each one is
+ * checked against its recorded start time and signalled through a pidfd,
+ * so a process that merely reuses a dead shell's PID is never touched.
+ */
+void killallterms_command()
+{
+    printf("Killing all w25shell terminals...\n");
+
+    if (registry_open() < 0)
+    {
+        perror("Failed to open the shell registry");
+        exit(0);
     }
 
-    pclose(fp);
+    for (int i = 0; i < REGISTRY_SLOTS; i++)
+    {
+        uint64_t owner = __atomic_load_n(&registry->owners[i], __ATOMIC_ACQUIRE);
+        pid_t pid = (pid_t)(owner & REGISTRY_PID_MASK);
+
+        // Skip free slots and ourselves (we'll exit ourselves at the end)
+        if (owner == 0 || pid == current_pid)
+            continue;
+
+        // Pin the process first, then make sure it is still that shell
+        int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd >= 0 && registry_identity(pid) == owner)
+        {
+            syscall(SYS_pidfd_send_signal, pidfd, SIGTERM, NULL, 0);
+        }
+        else
+        {
+            // Left behind by a shell that died: free it
+            __atomic_compare_exchange_n(&registry->owners[i], &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+
+        if (pidfd >= 0)
+            close(pidfd);
+    }
 
     // Exit current shell
     exit(0);